@@ -1,9 +1,12 @@
 #include "application.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <functional>
-#include <set>
-#include <sstream>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+#include <thread>
 
 
 namespace application
@@ -11,64 +14,421 @@ namespace application
 
 	namespace gui
 	{
-    std::set<std::string> g_id_list;
-
-    std::string AddUniqueId(std::string id)
+    // Atom table. The deque keeps the strings in place so the map can key
+    // on views of them. Atom n is g_atom_names[n - 1].
+    std::deque<std::string> g_atom_names;
+    std::unordered_map<std::string_view, WidgetId> g_atoms;
+    // atom -> widget owning that id, indexed like g_atom_names
+    std::vector<Widget*> g_id_owner;
+    WidgetId g_next_anonymous_id = 0;
+    IdRegistryStats g_id_stats;
+
+    WidgetId InternId(std::string_view name)
     {
-      std::cout << "Add: " << id << std::endl;
-      if (g_id_list.find(id) != g_id_list.end())
-        throw std::runtime_error("Logic error: Two widget has the same id: " + id);
-      g_id_list.insert(id);
+      auto it = g_atoms.find(name);
+      if (it != g_atoms.end())
+        return it->second;
+
+      if (g_atom_names.size() + 1 >= AnonymousWidgetIdBit)
+        throw std::runtime_error("Too many widget ids");
+      std::string_view stored = g_atom_names.emplace_back(name);
+      WidgetId id = (WidgetId) g_atom_names.size();
+      g_atoms.emplace(stored, id);
+      g_id_owner.push_back(NULL);
+      g_id_stats.atoms = g_atom_names.size();
       return id;
     }
 
-    void RemoveUniqueId(std::string id)
+    WidgetId LookupId(std::string_view name)
+    {
+      auto it = g_atoms.find(name);
+      return it == g_atoms.end() ? InvalidWidgetId : it->second;
+    }
+
+    std::string IdString(WidgetId id)
+    {
+      if (id == InvalidWidgetId)
+        return "Invalid";
+      if (id & AnonymousWidgetIdBit)
+        return "#" + std::to_string(id & ~AnonymousWidgetIdBit);
+      return g_atom_names[id - 1];
+    }
+
+    void AddUniqueId(WidgetId id, Widget* widget)
+    {
+      // anonymous ids are unique by construction and not registered
+      if (id & AnonymousWidgetIdBit)
+        return;
+      logger::Debug("Add: %s", g_atom_names[id - 1].c_str());
+      Widget*& owner = g_id_owner[id - 1];
+      if (owner)
+        throw std::runtime_error("Logic error: Two widget has the same id: " + g_atom_names[id - 1]);
+      owner = widget;
+      g_id_stats.ids++;
+    }
+
+    void RemoveUniqueId(WidgetId id, Widget* widget)
+    {
+      if (id == InvalidWidgetId || (id & AnonymousWidgetIdBit))
+        return;
+      // a copied widget never registered its id, keep the original's entry
+      Widget*& owner = g_id_owner[id - 1];
+      if (owner == widget)
+      {
+        owner = NULL;
+        g_id_stats.ids--;
+      }
+    }
+
+    IdRegistryStats& GetIdRegistryStats()
+    {
+      return g_id_stats;
+    }
+
+    LayoutStats g_layout_stats;
+
+    // where CommitLayout records changes while a layout task runs
+    thread_local std::vector<WidgetHandle>* t_layout_changed = NULL;
+
+    WidgetTree& GetWidgetTree()
+    {
+      static WidgetTree tree;
+      return tree;
+    }
+
+    WidgetHandle WidgetTree::Allocate(Widget* w)
+    {
+      WidgetHandle node;
+      if (!free_list.empty())
+      {
+        node = free_list.back();
+        free_list.pop_back();
+      }
+      else
+      {
+        node = (WidgetHandle) widget.size();
+        widget.push_back(NULL);
+        parent.push_back(InvalidWidgetHandle);
+        first_child.push_back(InvalidWidgetHandle);
+        last_child.push_back(InvalidWidgetHandle);
+        next_sibling.push_back(InvalidWidgetHandle);
+        prev_sibling.push_back(InvalidWidgetHandle);
+        layout.push_back({});
+        subtree_size.push_back(1);
+      }
+
+      widget[node] = w;
+      parent[node] = InvalidWidgetHandle;
+      first_child[node] = InvalidWidgetHandle;
+      last_child[node] = InvalidWidgetHandle;
+      next_sibling[node] = InvalidWidgetHandle;
+      prev_sibling[node] = InvalidWidgetHandle;
+      layout[node] = {};
+      subtree_size[node] = 1;
+      // a new root, the pre-order numbering doesn't know it
+      structure_version++;
+      return node;
+    }
+
+    void WidgetTree::Free(WidgetHandle node)
+    {
+      assert(first_child[node] == InvalidWidgetHandle);
+      Detach(node);
+      widget[node] = NULL;
+      free_list.push_back(node);
+    }
+
+    void WidgetTree::Insert(WidgetHandle p, WidgetHandle before, WidgetHandle child)
+    {
+      assert(parent[child] == InvalidWidgetHandle);
+      parent[child] = p;
+      structure_version++;
+
+      for (WidgetHandle a = p; a != InvalidWidgetHandle; a = parent[a])
+        subtree_size[a] += subtree_size[child];
+
+      WidgetHandle prev = before == InvalidWidgetHandle ? last_child[p] : prev_sibling[before];
+      prev_sibling[child] = prev;
+      next_sibling[child] = before;
+
+      if (prev == InvalidWidgetHandle)
+        first_child[p] = child;
+      else
+        next_sibling[prev] = child;
+
+      if (before == InvalidWidgetHandle)
+        last_child[p] = child;
+      else
+        prev_sibling[before] = child;
+    }
+
+    void WidgetTree::Append(WidgetHandle p, WidgetHandle child)
+    {
+      Insert(p, InvalidWidgetHandle, child);
+    }
+
+    void WidgetTree::Detach(WidgetHandle child)
+    {
+      WidgetHandle p = parent[child];
+      if (p == InvalidWidgetHandle) return;
+
+      for (WidgetHandle a = p; a != InvalidWidgetHandle; a = parent[a])
+        subtree_size[a] -= subtree_size[child];
+
+      WidgetHandle prev = prev_sibling[child];
+      WidgetHandle next = next_sibling[child];
+
+      if (prev == InvalidWidgetHandle)
+        first_child[p] = next;
+      else
+        next_sibling[prev] = next;
+
+      if (next == InvalidWidgetHandle)
+        last_child[p] = prev;
+      else
+        prev_sibling[next] = prev;
+
+      parent[child] = InvalidWidgetHandle;
+      prev_sibling[child] = InvalidWidgetHandle;
+      next_sibling[child] = InvalidWidgetHandle;
+      structure_version++;
+    }
+
+    bool WidgetTree::IsAncestor(WidgetHandle ancestor, WidgetHandle node)
+    {
+      if (pre_order_version == structure_version)
+        return pre_order[node] >= pre_order[ancestor] &&
+          pre_order[node] - pre_order[ancestor] < subtree_size[ancestor];
+
+      for (; node != InvalidWidgetHandle; node = parent[node])
+      {
+        if (node == ancestor) return true;
+      }
+      return false;
+    }
+
+    void WidgetTree::NumberPreOrder()
+    {
+      if (pre_order_version == structure_version) return;
+
+      pre_order.resize(widget.size());
+      uint32_t next = 0;
+      for (WidgetHandle root = 0; root < widget.size(); ++root)
+      {
+        if (!widget[root] || parent[root] != InvalidWidgetHandle) continue;
+
+        // walks the links instead of recursing, trees can be deep
+        WidgetHandle node = root;
+        while (true)
+        {
+          pre_order[node] = next++;
+          if (first_child[node] != InvalidWidgetHandle)
+          {
+            node = first_child[node];
+            continue;
+          }
+          while (node != root && next_sibling[node] == InvalidWidgetHandle)
+            node = parent[node];
+          if (node == root) break;
+          node = next_sibling[node];
+        }
+      }
+      pre_order_version = structure_version;
+    }
+
+    size_t WidgetTree::Size()
+    {
+      return widget.size() - free_list.size();
+    }
+
+    void WidgetTree::CommitLayout(WidgetHandle node, LayoutInfo const& info)
+    {
+      LayoutInfo& old = layout[node];
+      if (old.x == info.x && old.y == info.y &&
+          old.width == info.width && old.height == info.height)
+        return;
+
+      old = info;
+
+      // layout tasks record into their own list, merged when they are joined
+      if (t_layout_changed)
+      {
+        t_layout_changed->push_back(node);
+        return;
+      }
+
+      if (layout_changed_overflow)
+        return;
+      if (layout_changed.size() >= widget.size())
+      {
+        layout_changed.clear();
+        layout_changed_overflow = true;
+        return;
+      }
+      layout_changed.push_back(node);
+    }
+
+    void WidgetTree::AddLayoutChanged(std::vector<WidgetHandle> const& nodes)
+    {
+      if (t_layout_changed)
+      {
+        t_layout_changed->insert(t_layout_changed->end(), nodes.begin(), nodes.end());
+        return;
+      }
+
+      if (layout_changed_overflow)
+        return;
+      if (layout_changed.size() + nodes.size() > widget.size())
+      {
+        layout_changed.clear();
+        layout_changed_overflow = true;
+        return;
+      }
+      layout_changed.insert(layout_changed.end(), nodes.begin(), nodes.end());
+    }
+
+    ThreadPool* g_layout_pool = NULL;
+    std::atomic<int> g_parallel_layouts = 0;
+
+    std::mutex g_deferred_layouts_mutex;
+    std::vector<std::pair<Widget*, LayoutConstraint>> g_deferred_layouts;
+
+    void SetLayoutThreadPool(ThreadPool* pool)
+    {
+      g_layout_pool = pool;
+    }
+
+    bool IsParallelLayoutActive()
+    {
+      return g_parallel_layouts.load() > 0;
+    }
+
+    void DeferLayout(Widget* w, LayoutConstraint const& c)
+    {
+      std::lock_guard<std::mutex> lock(g_deferred_layouts_mutex);
+      g_deferred_layouts.push_back({ w, c });
+    }
+
+    struct LayoutTask
+    {
+      Widget* widget;
+      LayoutConstraint constraint;
+      // nodes the task laid out with a new rectangle, merged when joined
+      std::vector<WidgetHandle> layout_changed = {};
+    };
+
+    // Whether laying out `node` is worth a task of its own
+    bool ShouldLayoutInParallel(WidgetHandle node, LayoutConstraint const& c, InteractionContext const& interaction_context)
+    {
+      WidgetTree& tree = GetWidgetTree();
+      return g_layout_pool &&
+        g_layout_pool->WorkerCount() > 0 &&
+        tree.subtree_size[node] >= ParallelLayoutMinNodes &&
+        tree.widget[node]->NeedsLayout(c, interaction_context);
+    }
+
+    // Lays out independent subtrees concurrently and joins them
+    void RunLayoutTasks(std::vector<LayoutTask>& tasks, InteractionContext const& interaction_context)
     {
-      g_id_list.erase(id);
+      // nothing to run concurrently, and there may be no pool
+      if (tasks.size() <= 1)
+      {
+        for (auto& task : tasks)
+          task.widget->Layout(task.constraint, interaction_context);
+        return;
+      }
+
+      g_parallel_layouts++;
+      TaskGroup group(*g_layout_pool);
+      for (auto& task : tasks)
+      {
+        group.Run([&task, &interaction_context]() {
+          // Wait runs other tasks on this thread, restore the outer list
+          auto* outer = t_layout_changed;
+          t_layout_changed = &task.layout_changed;
+          task.widget->Layout(task.constraint, interaction_context);
+          t_layout_changed = outer;
+        });
+      }
+
+      try
+      {
+        group.Wait();
+      }
+      catch (...)
+      {
+        g_parallel_layouts--;
+        throw;
+      }
+      g_parallel_layouts--;
+
+      WidgetTree& tree = GetWidgetTree();
+      for (auto& task : tasks)
+        tree.AddLayoutChanged(task.layout_changed);
     }
 
-		Widget* FindId(Widget* root_widget, std::string const& id)
+    void RunLayout(Widget* root, LayoutConstraint const& c, InteractionContext const& interaction_context)
+    {
+      g_layout_stats.frame_nodes_laid_out = 0;
+      root->Layout(c, interaction_context);
+
+      // widgets that had to wait for the concurrent part to be over
+      std::vector<std::pair<Widget*, LayoutConstraint>> deferred;
+      {
+        std::lock_guard<std::mutex> lock(g_deferred_layouts_mutex);
+        std::swap(deferred, g_deferred_layouts);
+      }
+      for (auto& [w, constraint] : deferred)
+      {
+        // only the widget is relaid out, its size doesn't depend on children
+        w->m_layout_dirty = true;
+        w->Layout(constraint, interaction_context);
+      }
+
+      int laid_out = g_layout_stats.frame_nodes_laid_out;
+      g_layout_stats.frames++;
+      g_layout_stats.total_nodes_laid_out += laid_out;
+      if (laid_out == 0)
+        g_layout_stats.idle_frames++;
+      logger::Debug("Layout: %d nodes", laid_out);
+    }
+
+    LayoutStats& GetLayoutStats()
+    {
+      return g_layout_stats;
+    }
+
+		Widget* FindId(WidgetId id)
 		{
-			if (id == root_widget->GetId())
-				return root_widget;
+			return FindId(NULL, id);
+		}
 
-			VerticalContainer* vert_ptr = dynamic_cast<VerticalContainer*>(root_widget);
-			Widget* ret = NULL;
+		Widget* FindId(std::string_view id)
+		{
+			return FindId(LookupId(id));
+		}
 
-			if (vert_ptr)
-			{
-				for (auto it = vert_ptr->m_children.begin(); it != vert_ptr->m_children.end(); ++it)
-				{
-					Widget* widget = it->get();
-					ret = FindId(widget, id);
-					if (ret) return ret;
-				}
-			}
+		Widget* FindId(Widget* root_widget, WidgetId id)
+		{
+			g_id_stats.lookups++;
+			Widget* w = NULL;
+			if (id != InvalidWidgetId && !(id & AnonymousWidgetIdBit))
+				w = g_id_owner[id - 1];
 
-			HorizontalContainer* hor_ptr = dynamic_cast<HorizontalContainer*>(root_widget);
-			if (hor_ptr)
-			{
-				for (auto it = hor_ptr->m_children.begin(); it != hor_ptr->m_children.end(); ++it)
-				{
-					Widget* widget = it->get();
-					ret = FindId(widget, id);
-					if (ret) return ret;
-				}
-			}
+			// ids are unique, the only candidate just has to be in the subtree
+			if (w && root_widget && !GetWidgetTree().IsAncestor(root_widget->m_node, w->m_node))
+				w = NULL;
 
-			Layers* layers_ptr = dynamic_cast<Layers*>(root_widget);
-			if (layers_ptr)
-			{
-				for (auto it = layers_ptr->m_layers.begin();
-					it != layers_ptr->m_layers.end();
-					++it)
-				{
-					ret = FindId(it->second.get(), id);
-					if (ret) return ret;
-				}
-			}
+			if (w)
+				g_id_stats.hits++;
+			else
+				g_id_stats.misses++;
+			return w;
+		}
 
-			return NULL;
+		Widget* FindId(Widget* root_widget, std::string_view id)
+		{
+			return FindId(root_widget, LookupId(id));
 		}
 
 		int FindMaxSize(WidgetSize size, int max_size)
@@ -102,42 +462,44 @@ namespace application
 
 		Widget::Widget(WidgetType type)
     : m_type { type },
-      m_id   { "" },
+      m_id   { (++g_next_anonymous_id & ~AnonymousWidgetIdBit) | AnonymousWidgetIdBit },
       m_width { WidgetSize::Type::Undefined, 0},
-      m_height { WidgetSize::Type::Undefined, 0},
-      m_layout {}
+      m_height { WidgetSize::Type::Undefined, 0}
 		{
       assert(type != WidgetType::InvalidType);
-			SetId();
+      m_node = GetWidgetTree().Allocate(this);
 		}
 
     Widget::Widget(const Widget& other)
     {
+      m_node = GetWidgetTree().Allocate(this);
     }
 
 		Widget::~Widget()
 		{
-      RemoveUniqueId(m_id);
+      DestroyChildren();
+      GetWidgetTree().Free(m_node);
+      RemoveUniqueId(m_id, this);
 		}
 
-		std::string const& Widget::GetId()
+		WidgetId Widget::GetId()
 		{
 			return m_id;
 		}
 
-		void Widget::SetId(std::string s)
+		void Widget::SetId(WidgetId id)
 		{
-      if (!m_id.empty())
-        RemoveUniqueId(m_id);
-			m_id = AddUniqueId(s);
-    }
+			if (id == m_id)
+				return;
+			AddUniqueId(id, this);
+			RemoveUniqueId(m_id, this);
+			m_id = id;
+		}
 
-    void Widget::SetId()
-    {
-      std::stringstream ss;
-      ss << m_type << ":" << this;
-      m_id = AddUniqueId(ss.rdbuf()->str());
-    }
+		void Widget::SetId(std::string_view id)
+		{
+			SetId(InternId(id));
+		}
 
 		WidgetType Widget::GetType()
 		{
@@ -147,16 +509,86 @@ namespace application
     void Widget::SetWidth(WidgetSize w)
     {
       m_width = w;
+      MarkLayoutDirty();
     }
 
     void Widget::SetHeight(WidgetSize h)
     {
       m_height = h;
+      MarkLayoutDirty();
     }
 
     LayoutInfo& Widget::GetLayout()
     {
-      return m_layout;
+      return GetWidgetTree().layout[m_node];
+    }
+
+    Widget* Widget::GetParent()
+    {
+      WidgetTree& tree = GetWidgetTree();
+      WidgetHandle p = tree.parent[m_node];
+      return p == InvalidWidgetHandle ? NULL : tree.widget[p];
+    }
+
+    void Widget::DestroyChildren()
+    {
+      WidgetTree& tree = GetWidgetTree();
+      // a child unlinks itself from the tree when it is destroyed
+      while (tree.first_child[m_node] != InvalidWidgetHandle)
+      {
+        delete tree.widget[tree.first_child[m_node]];
+      }
+    }
+
+    void Widget::MarkLayoutDirty()
+    {
+      WidgetTree& tree = GetWidgetTree();
+      // a dirty widget always has dirty ancestors, so we can stop early
+      for (WidgetHandle n = m_node; n != InvalidWidgetHandle && !tree.widget[n]->m_layout_dirty; n = tree.parent[n])
+      {
+        tree.widget[n]->m_layout_dirty = true;
+      }
+    }
+
+    bool Widget::IsLayoutDirty()
+    {
+      return m_layout_dirty;
+    }
+
+    void Widget::CommitLayout(LayoutInfo const& info)
+    {
+      GetWidgetTree().CommitLayout(m_node, info);
+    }
+
+    bool Widget::NeedsLayout(LayoutConstraint const& c, InteractionContext const& interaction_context)
+    {
+      // the dragged widget follows the mouse, its position is an input
+      // that isn't part of the constraint
+      bool dragged = interaction_context.dragging == this;
+
+      return m_layout_dirty || dragged || m_layout_dragged || !(c == m_last_constraint);
+    }
+
+    bool Widget::BeginLayout(LayoutConstraint const& c, InteractionContext const& interaction_context)
+    {
+      if (!NeedsLayout(c, interaction_context))
+        return false;
+
+      m_layout_dirty = false;
+      m_layout_dragged = interaction_context.dragging == this;
+      m_last_constraint = c;
+      g_layout_stats.frame_nodes_laid_out.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    bool Widget::MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width)
+    {
+      // leaves: the width only depends on the size, FindFixSize without
+      // the warning Layout will print
+      if (interaction_context.dragging == this)
+        return false;
+      width = m_width.type == WidgetSize::Type::Undefined ? 0 : FindFixSize(m_width, max_width);
+      return true;
     }
 
 		void Widget::OnClick()
@@ -167,6 +599,20 @@ namespace application
 		{
 		}
 
+		void Widget::OnKey(KeyboardEvent e)
+		{
+		}
+
+		void Widget::OnText(std::string_view text)
+		{
+		}
+
+		void Widget::OnMouseWheel(int delta)
+		{
+			if (Widget* parent = GetParent())
+				parent->OnMouseWheel(delta);
+		}
+
 
 
 		Rectangle::Rectangle(): 
@@ -184,8 +630,10 @@ namespace application
 			m_bg_active_color = c;
 		}
 
-		void Rectangle::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
+		void Rectangle::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
 		{
+			if (!BeginLayout(c, interaction_context)) return;
+
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -202,15 +650,16 @@ namespace application
 
 			logger::Debug("INFO (Rectangle): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
 
-			m_layout = info;
+			CommitLayout(info);
 		}
 
 		Widget* Rectangle::HitTest(int x, int y)
 		{
-			if (IsLayoutInfoValid(m_layout))
+			LayoutInfo const& layout = GetLayout();
+			if (IsLayoutInfoValid(layout))
 			{
-				if (x > m_layout.x && x < m_layout.x + m_layout.width &&
-					y > m_layout.y && y < m_layout.y + m_layout.height)
+				if (x > layout.x && x < layout.x + layout.width &&
+					y > layout.y && y < layout.y + layout.height)
 				{
 					return this;
 				}
@@ -226,20 +675,20 @@ namespace application
 
 		void VerticalContainer::PushBack(Widget* w)
 		{
-			m_children.push_back(std::shared_ptr<Widget>(w));
-		}
-		void VerticalContainer::PushBack(std::shared_ptr<Widget> w)
-		{
-			m_children.push_back(w);
+			GetWidgetTree().Append(m_node, w->m_node);
+			MarkLayoutDirty();
 		}
 
 		void VerticalContainer::Clear()
 		{
-			m_children.clear();
+			DestroyChildren();
+			MarkLayoutDirty();
 		}
 
-		void VerticalContainer::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
+		void VerticalContainer::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
 		{
+			if (!BeginLayout(c, interaction_context)) return;
+
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -252,10 +701,11 @@ namespace application
 			info.width = FindMaxSize(m_width, c.max_width);
 			info.height = FindMaxSize(m_height, c.max_height);
 
+			WidgetTree& tree = GetWidgetTree();
 			size_t i = 0;
-			for (auto it = m_children.begin(); it != m_children.end(); ++it)
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
 			{
-				Widget* w = it->get();
+				Widget* w = tree.widget[child];
 				LayoutConstraint child_constraint;
 				child_constraint.max_width = info.width;
 				child_constraint.max_height = info.height;
@@ -277,18 +727,28 @@ namespace application
 				info.height = y < info.height ? y : info.height;
 			logger::Debug("INFO (VerticalContainer): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
 
-			m_layout = info;
+			CommitLayout(info);
+		}
+
+		bool VerticalContainer::MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width)
+		{
+			if (m_width.type != WidgetSize::Type::Fixed)
+				return false;
+			width = FindMaxSize(m_width, max_width);
+			return true;
 		}
 
 		Widget* VerticalContainer::HitTest(int x, int y)
 		{
-			if (!IsLayoutInfoValid(m_layout))
+			WidgetTree& tree = GetWidgetTree();
+			LayoutInfo layout = tree.layout[m_node];
+			if (!IsLayoutInfoValid(layout))
 				return NULL;
 
 			Widget* hit = NULL;
 
-			if (x > m_layout.x && x < m_layout.x + m_layout.width &&
-				y > m_layout.y && y < m_layout.y + m_layout.height)
+			if (x > layout.x && x < layout.x + layout.width &&
+				y > layout.y && y < layout.y + layout.height)
 			{
 				hit = this;
 			}
@@ -296,14 +756,13 @@ namespace application
 
 
 			Widget* w = NULL;
-			x -= m_layout.x;
-			y -= m_layout.y;
-			for (auto it = m_children.begin(); it != m_children.end(); ++it)
+			x -= layout.x;
+			y -= layout.y;
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
 			{
-				Widget* widget = it->get();
-				if (IsLayoutInfoValid(widget->GetLayout()))
+				if (IsLayoutInfoValid(tree.layout[child]))
 				{
-					w = widget->HitTest(x, y);
+					w = tree.widget[child]->HitTest(x, y);
 					if (w) break;
 				}
 			}
@@ -322,16 +781,14 @@ namespace application
 
 		void HorizontalContainer::PushBack(Widget* w)
 		{
-			m_children.push_back(std::shared_ptr<Widget>(w));
+			GetWidgetTree().Append(m_node, w->m_node);
+			MarkLayoutDirty();
 		}
 
-		void HorizontalContainer::PushBack(std::shared_ptr<Widget> w)
+		void HorizontalContainer::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
 		{
-			m_children.push_back(w);
-		}
+			if (!BeginLayout(c, interaction_context)) return;
 
-		void HorizontalContainer::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
-		{
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -344,23 +801,37 @@ namespace application
 			info.width = FindMaxSize(m_width, c.max_width);
 			info.height = FindMaxSize(m_height, c.max_height);
 
-			int i = 0;
-			for (auto it = m_children.begin(); it != m_children.end(); ++it)
+			WidgetTree& tree = GetWidgetTree();
+
+			if (LayoutChildrenInParallel(info, interaction_context))
 			{
-				Widget* w = it->get();
-				LayoutConstraint child_constraint;
-				child_constraint.max_width = info.width;
-				child_constraint.max_height = info.height;
-				child_constraint.x = x;
-				child_constraint.y = 0;
+				for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
+				{
+					LayoutInfo child_layout = tree.layout[child];
+					x = child_layout.x + child_layout.width;
+					y = std::max(y, child_layout.y + child_layout.height);
+				}
+			}
+			else
+			{
+				int i = 0;
+				for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
+				{
+					Widget* w = tree.widget[child];
+					LayoutConstraint child_constraint;
+					child_constraint.max_width = info.width;
+					child_constraint.max_height = info.height;
+					child_constraint.x = x;
+					child_constraint.y = 0;
 
-				w->Layout(child_constraint, interaction_context);
-				LayoutInfo const& child_layout = w->GetLayout();
+					w->Layout(child_constraint, interaction_context);
+					LayoutInfo child_layout = w->GetLayout();
 
-				x = child_layout.x + child_layout.width;
-				y = std::max(y, child_layout.y + child_layout.height);
+					x = child_layout.x + child_layout.width;
+					y = std::max(y, child_layout.y + child_layout.height);
 
-				i++;
+					i++;
+				}
 			}
 
 			if (m_width.type != WidgetSize::Type::Fixed)
@@ -368,31 +839,81 @@ namespace application
 			if (m_height.type != WidgetSize::Type::Fixed)
 				info.height = y < info.height ? y : info.height;
 			logger::Debug("INFO (HorizontalContainer): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
-			m_layout = info;
+			CommitLayout(info);
+		}
+
+		bool HorizontalContainer::LayoutChildrenInParallel(LayoutInfo const& info, InteractionContext const& interaction_context)
+		{
+			WidgetTree& tree = GetWidgetTree();
+			if (!g_layout_pool || tree.subtree_size[m_node] < 2 * ParallelLayoutMinNodes)
+				return false;
+
+			// the x of a child is the end of the previous one, we can only
+			// start all of them at once when every width is known up front
+			std::vector<LayoutConstraint> constraints;
+			int x = 0;
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
+			{
+				int width = 0;
+				if (!tree.widget[child]->MeasureWidth(info.width, interaction_context, width))
+					return false;
+
+				LayoutConstraint child_constraint;
+				child_constraint.max_width = info.width;
+				child_constraint.max_height = info.height;
+				child_constraint.x = x;
+				child_constraint.y = 0;
+				constraints.push_back(child_constraint);
+
+				x += width;
+			}
+
+			std::vector<LayoutTask> tasks;
+			size_t i = 0;
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child], ++i)
+			{
+				if (ShouldLayoutInParallel(child, constraints[i], interaction_context))
+					tasks.push_back({ tree.widget[child], constraints[i] });
+				else
+					tree.widget[child]->Layout(constraints[i], interaction_context);
+			}
+			RunLayoutTasks(tasks, interaction_context);
+
+			return true;
+		}
+
+		bool HorizontalContainer::MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width)
+		{
+			// other sizes shrink to the children
+			if (m_width.type != WidgetSize::Type::Fixed)
+				return false;
+			width = FindMaxSize(m_width, max_width);
+			return true;
 		}
 
 		Widget* HorizontalContainer::HitTest(int x, int y)
 		{
-			if (!IsLayoutInfoValid(m_layout))
+			WidgetTree& tree = GetWidgetTree();
+			LayoutInfo layout = tree.layout[m_node];
+			if (!IsLayoutInfoValid(layout))
 				return NULL;
 
 			Widget* hit = NULL;
 
-			if (x > m_layout.x && x < m_layout.x + m_layout.width &&
-				y > m_layout.y && y < m_layout.y + m_layout.height)
+			if (x > layout.x && x < layout.x + layout.width &&
+				y > layout.y && y < layout.y + layout.height)
 			{
 				hit = this;
 			}
 
 			Widget* w = NULL;
-			x -= m_layout.x;
-			y -= m_layout.y;
-			for (auto it = m_children.begin(); it != m_children.end(); ++it)
+			x -= layout.x;
+			y -= layout.y;
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
 			{
-				Widget* widget = it->get();
-				if (IsLayoutInfoValid(widget->GetLayout()))
+				if (IsLayoutInfoValid(tree.layout[child]))
 				{
-					w = widget->HitTest(x, y);
+					w = tree.widget[child]->HitTest(x, y);
 					if (w) break;
 				}
 			}
@@ -434,6 +955,7 @@ namespace application
 		void Button::SetText(std::string text)
 		{
 			m_text = text;
+			MarkLayoutDirty();
 		}
 
 		std::string Button::GetText()
@@ -448,7 +970,8 @@ namespace application
 
 		void Button::OnClick()
 		{
-			m_on_clicked(this);
+			if (m_on_clicked)
+				m_on_clicked(this);
 		}
 
 		void Button::SetBorderColor(Color c)
@@ -456,8 +979,10 @@ namespace application
 			m_border_color = c;
 		}
 
-    void Button::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
+    void Button::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
     {
+			if (!BeginLayout(c, interaction_context)) return;
+
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -473,15 +998,16 @@ namespace application
 
 			logger::Debug("INFO (Button): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
 
-			m_layout = info;
+			CommitLayout(info);
     }
 
     Widget* Button::HitTest(int x, int y)
     {
-			if (IsLayoutInfoValid(m_layout))
+			LayoutInfo const& layout = GetLayout();
+			if (IsLayoutInfoValid(layout))
 			{
-				if (x > m_layout.x && x < m_layout.x + m_layout.width &&
-					y > m_layout.y && y < m_layout.y + m_layout.height)
+				if (x > layout.x && x < layout.x + layout.width &&
+					y > layout.y && y < layout.y + layout.height)
 				{
 					return this;
 				}
@@ -496,6 +1022,20 @@ namespace application
 			SetColor(Color(1.0, 1.0, 1.0, 1.0));
 			SetTextColor(Color(0.0, 0.0, 0.0, 1.0));
 			SetActiveColor(Color(1.0, 1.0, 1.0, 1.0));
+			SetTokenColor(TokenKind::Punctuation, Color(0.3f, 0.3f, 0.3f, 1.0f));
+			SetTokenColor(TokenKind::Key, Color(0.55f, 0.1f, 0.55f, 1.0f));
+			SetTokenColor(TokenKind::String, Color(0.0f, 0.45f, 0.1f, 1.0f));
+			SetTokenColor(TokenKind::Number, Color(0.05f, 0.35f, 0.7f, 1.0f));
+			SetTokenColor(TokenKind::Keyword, Color(0.0f, 0.2f, 0.8f, 1.0f));
+			SetTokenColor(TokenKind::Comment, Color(0.45f, 0.5f, 0.45f, 1.0f));
+			SetTokenColor(TokenKind::Invalid, Color(0.85f, 0.1f, 0.1f, 1.0f));
+
+			m_editor.m_on_lines_changed = [this](size_t line, size_t removed_lines, size_t inserted_lines) {
+				if (m_highlighter)
+					m_highlighter->LinesChanged(line, removed_lines, inserted_lines);
+				if (m_wrap)
+					m_wrap_index.LinesChanged(line, removed_lines, inserted_lines);
+			};
 		}
 
 		void TextBox::SetColor(Color c)
@@ -513,54 +1053,433 @@ namespace application
 			m_bg_active_color = c;
 		}
 
-		std::string const& TextBox::GetText()
+		void TextBox::SetTokenColor(TokenKind kind, Color c)
 		{
-			return m_text;
+			m_token_colors[(size_t) kind] = c;
+		}
+
+		Color TextBox::GetTokenColor(TokenKind kind)
+		{
+			if (kind == TokenKind::Text)
+				return m_fg_default_color;
+			return m_token_colors[(size_t) kind];
+		}
+
+		void TextBox::SetLexer(std::shared_ptr<Lexer const> lexer)
+		{
+			if (!lexer)
+				m_highlighter.reset();
+			else
+				m_highlighter = std::make_unique<SyntaxHighlighter>(std::move(lexer), m_editor.LineCount());
+		}
+
+		void TextBox::GetVisibleSpans(std::string_view visible, std::vector<TokenSpan>& spans)
+		{
+			if (!m_highlighter)
+				return;
+			if (!m_wrap)
+				return m_highlighter->Highlight(m_editor, m_scroll_line, visible, spans);
+
+			// a line is lexed from its start, its spans are cut at the rows
+			std::vector<TokenSpan> line_spans;
+			for (size_t first = 0; first < m_visible_rows.size(); )
+			{
+				size_t line = m_visible_rows[first].line;
+				size_t last = first;
+				while (last + 1 < m_visible_rows.size() && m_visible_rows[last + 1].line == line)
+					last++;
+
+				line_spans.clear();
+				m_highlighter->HighlightLine(m_editor, line, m_editor.Line(line, m_visible_rows[last].offset + m_visible_rows[last].length), line_spans);
+				for (TokenSpan const& span : line_spans)
+				{
+					for (size_t i = first; i <= last; ++i)
+					{
+						VisibleRow const& row = m_visible_rows[i];
+						size_t start = std::max<size_t>(span.offset, row.offset);
+						size_t end = std::min<size_t>(span.offset + span.length, row.offset + row.length);
+						if (start < end)
+							spans.push_back({ (uint32_t) (row.text_offset + start - row.offset), (uint32_t) (end - start), span.kind });
+					}
+				}
+				first = last + 1;
+			}
+		}
+
+		std::string TextBox::GetText()
+		{
+			return m_editor.Flush().Text();
 		}
 
 		void TextBox::SetText(std::string text)
 		{
-			m_text = text;
+			m_editor.SetText(std::move(text));
+			m_scroll_line = 0;
+			m_scroll_row = 0;
+			if (m_wrap)
+				m_wrap_index.Reset(m_editor.LineCount());
+			MarkLayoutDirty();
 		}
 
+		void TextBox::SetText(std::shared_ptr<const void> owner, std::string_view text)
+		{
+			m_editor.SetText(std::move(owner), text);
+			m_scroll_line = 0;
+			m_scroll_row = 0;
+			if (m_wrap)
+				m_wrap_index.Reset(m_editor.LineCount());
+			MarkLayoutDirty();
+		}
 
-		void TextBox::OnChar(KeyboardEvent e)
+		void TextBox::SetDocument(Document document, bool keep_position)
 		{
-			static int last_width = 1;
+			size_t caret = m_editor.Caret();
+			m_editor.SetDocument(std::move(document));
+			if (keep_position)
+			{
+				m_editor.SetCaret(std::min(caret, m_editor.Size()));
+				m_scroll_line = std::min(m_scroll_line, m_editor.LineCount() - 1);
+			}
+			else
+			{
+				m_scroll_line = 0;
+				m_scroll_row = 0;
+			}
+			if (m_wrap)
+				m_wrap_index.Reset(m_editor.LineCount());
+			MarkLayoutDirty();
+		}
 
-			printf("%s\n", m_text.data());
-			if (e.key_press == 8)
+		Document& TextBox::GetDocument()
+		{
+			return m_editor.Flush();
+		}
+
+		size_t TextBox::GetCaret()
+		{
+			return m_editor.Caret();
+		}
+
+		void TextBox::SetCaret(size_t offset, bool extend)
+		{
+			m_editor.SetCaret(offset, extend);
+			MarkLayoutDirty();
+		}
+
+		void TextBox::Insert(std::string_view text)
+		{
+			if (m_read_only)
+				return;
+			m_editor.Insert(text);
+			MarkLayoutDirty();
+		}
+
+		void TextBox::Replace(std::vector<DocumentRange> const& ranges, std::string_view text)
+		{
+			if (m_read_only)
+				return;
+			m_editor.Replace(ranges, text);
+			MarkLayoutDirty();
+			ScrollToCaret();
+		}
+
+		bool TextBox::Undo()
+		{
+			if (m_read_only || !m_editor.Undo())
+				return false;
+			MarkLayoutDirty();
+			return true;
+		}
+
+		bool TextBox::Redo()
+		{
+			if (m_read_only || !m_editor.Redo())
+				return false;
+			MarkLayoutDirty();
+			return true;
+		}
+
+		size_t TextBox::GetVisibleLineCount()
+		{
+			return std::max(GetLayout().height / std::max(m_line_height, 1), 1);
+		}
+
+		void TextBox::SetWrap(bool wrap)
+		{
+			if (wrap == m_wrap)
+				return;
+			m_wrap = wrap;
+			m_scroll_row = 0;
+			if (wrap)
+				m_wrap_index.Reset(m_editor.LineCount());
+			else
+				m_wrap_index.CancelJob();
+			MarkLayoutDirty();
+		}
+
+		size_t TextBox::GetWrapColumns()
+		{
+			return std::max<size_t>((size_t) (GetLayout().width / std::max(m_char_width, 1.0f)), 1);
+		}
+
+		void TextBox::UpdateWrap()
+		{
+			m_wrap_index.SetColumns(GetWrapColumns());
+			m_wrap_index.MergeJob();
+			if (!m_wrap_index.m_job && !m_wrap_index.m_complete)
+			{
+				if (!m_wrap_pool)
+					m_wrap_pool = std::make_unique<ThreadPool>(1);
+				// the lines on screen are wrapped when drawn, the job goes on
+				// from there
+				m_wrap_index.StartJob(*m_wrap_pool, m_editor.Flush().Snapshot(), m_scroll_line);
+			}
+		}
+
+		size_t TextBox::RowOfOffset(size_t line, size_t offset)
+		{
+			// a break depends on the next row at most
+			size_t columns = m_wrap_index.m_columns;
+			std::vector<uint32_t> breaks;
+			WrapLine(m_editor.Line(line, offset + columns * 4 + 4), columns, &breaks);
+			return std::upper_bound(breaks.begin(), breaks.end(), (uint32_t) offset) - breaks.begin();
+		}
+
+		void TextBox::ScrollBy(long long lines)
+		{
+			if (m_wrap)
 			{
+				UpdateWrap();
+				size_t line = std::min(m_scroll_line, m_editor.LineCount() - 1);
+				size_t row = m_scroll_row;
+				m_wrap_index.Scroll(m_editor, line, row, lines);
+				if (line == m_scroll_line && row == m_scroll_row) return;
+
+				m_scroll_line = line;
+				m_scroll_row = row;
+				MarkLayoutDirty();
+				return;
+			}
+
+			long long max_line = (long long) m_editor.LineCount() - 1;
+			long long line = std::clamp((long long) m_scroll_line + lines, 0LL, max_line);
+			if (line == (long long) m_scroll_line) return;
+
+			m_scroll_line = (size_t) line;
+			MarkLayoutDirty();
+		}
+
+		void TextBox::ScrollToCaret()
+		{
+			size_t line = m_editor.LineOf(m_editor.Caret());
+			size_t visible = GetVisibleLineCount();
+			if (m_wrap)
+			{
+				UpdateWrap();
+				size_t row = RowOfOffset(line, m_editor.Caret() - m_editor.LineOffset(line));
+				if (line < m_scroll_line || (line == m_scroll_line && row < m_scroll_row))
+				{
+					m_scroll_line = line;
+					m_scroll_row = row;
+					MarkLayoutDirty();
+					return;
+				}
+
+				// the top row that shows the caret on the last row
+				size_t top_line = line;
+				size_t top_row = row;
+				m_wrap_index.Scroll(m_editor, top_line, top_row, -(long long) (visible - 1));
+				if (top_line > m_scroll_line || (top_line == m_scroll_line && top_row > m_scroll_row))
+				{
+					m_scroll_line = top_line;
+					m_scroll_row = top_row;
+					MarkLayoutDirty();
+				}
+				return;
+			}
+
+			if (line < m_scroll_line)
+				ScrollBy((long long) line - (long long) m_scroll_line);
+			else if (line >= m_scroll_line + visible)
+				ScrollBy((long long) (line - visible + 1) - (long long) m_scroll_line);
+		}
+
+		std::string TextBox::GetVisibleText(size_t* caret)
+		{
+			if (m_wrap)
+				return GetVisibleRows(caret);
+
+			LayoutInfo const& layout = GetLayout();
+			// a partly visible line at the bottom is drawn too
+			size_t max_lines = layout.height / std::max(m_line_height, 1) + 1;
+			// a character is at least a pixel wide and at most 4 bytes
+			size_t max_line_bytes = (size_t) std::max(layout.width, 1) * 4;
+
+			// the text may have shrunk since the last scroll
+			m_scroll_line = std::min(m_scroll_line, m_editor.LineCount() - 1);
 
-				while (!m_text.empty())
+			std::string out;
+			size_t lines = 0;
+			size_t line_bytes = 0;
+			size_t offset = m_editor.LineOffset(m_scroll_line);
+			size_t caret_offset = m_editor.Caret();
+			if (caret)
+				*caret = std::string::npos;
+
+			m_editor.Read(offset, [&](std::string_view chunk) {
+				for (char c : chunk)
 				{
-					char c = m_text.back();
-					if (! (c & 0b10000000))
+					if (caret && offset == caret_offset && line_bytes <= max_line_bytes)
+						*caret = out.size();
+					offset++;
+
+					if (c == '\n')
 					{
-						m_text.pop_back();
-						return;
+						if (++lines == max_lines)
+							return false;
+						out.push_back(c);
+						line_bytes = 0;
 					}
-					else if (!(c &0b01000000))
+					else if (line_bytes < max_line_bytes)
 					{
-						m_text.pop_back();
+						out.push_back(c);
+						line_bytes++;
 					}
-					else if (c & 0b01000000)
+					else
 					{
-						m_text.pop_back();
-						return;
+						// past the right edge
+						line_bytes = max_line_bytes + 1;
 					}
+				}
+				return true;
+			});
+
+			if (caret && offset == caret_offset && lines < max_lines && line_bytes <= max_line_bytes)
+				*caret = out.size();
+			return out;
+		}
+
+		std::string TextBox::GetVisibleRows(size_t* caret)
+		{
+			UpdateWrap();
+			LayoutInfo const& layout = GetLayout();
+			size_t max_rows = layout.height / std::max(m_line_height, 1) + 1;
+			size_t columns = m_wrap_index.m_columns;
+
+			// the text may have shrunk or been wrapped anew since the last scroll
+			size_t line_count = m_editor.LineCount();
+			m_scroll_line = std::min(m_scroll_line, line_count - 1);
+			m_scroll_row = std::min(m_scroll_row, m_wrap_index.Rows(m_editor, m_scroll_line) - 1);
 
-					else assert(false);
+			std::string out;
+			m_visible_rows.clear();
+			size_t caret_offset = m_editor.Caret();
+			if (caret)
+				*caret = std::string::npos;
+
+			std::vector<uint32_t> breaks;
+			for (size_t line = m_scroll_line, first_row = m_scroll_row; line < line_count && m_visible_rows.size() < max_rows; ++line, first_row = 0)
+			{
+				// only the rows that fit are read, a character takes at most
+				// 4 bytes
+				size_t rows = first_row + max_rows - m_visible_rows.size();
+				std::string text = m_editor.Line(line, (rows + 1) * columns * 4);
+				breaks.assign(1, 0);
+				WrapLine(text, columns, &breaks, rows);
+				breaks.push_back((uint32_t) text.size());
+
+				size_t line_offset = m_editor.LineOffset(line);
+				for (size_t row = first_row; row + 1 < breaks.size() && m_visible_rows.size() < max_rows; ++row)
+				{
+					if (!m_visible_rows.empty())
+						out.push_back('\n');
+					size_t start = breaks[row];
+					size_t end = breaks[row + 1];
+					// the caret at a break is at the start of the next row
+					if (caret && caret_offset >= line_offset + start &&
+						(caret_offset < line_offset + end || (row + 2 == breaks.size() && caret_offset == line_offset + end)))
+						*caret = out.size() + caret_offset - line_offset - start;
+
+					m_visible_rows.push_back({ line, start, out.size(), end - start });
+					out.append(text, start, end - start);
 				}
+			}
+			return out;
+		}
+
+
+		void TextBox::OnChar(KeyboardEvent e)
+		{
+			if (m_read_only)
 				return;
+			MarkLayoutDirty();
+			if (e.key_press == 8)
+			{
+				m_editor.Backspace();
+			}
+			else if (e.key_press == 0x1a)
+			{
+				// ctrl+z
+				Undo();
+			}
+			else if (e.key_press == 0x19)
+			{
+				// ctrl+y
+				Redo();
+			}
+			else if (e.key_press == '\r')
+			{
+				m_editor.Insert("\n");
+			}
+			else
+			{
+				char* p = (char*)&e.key_press;
+				m_editor.Insert(std::string_view(p, e.key_length));
 			}
+			ScrollToCaret();
+		}
 
-			char* p = (char*)&e.key_press;
-			for (int i = 0; i < e.key_length; ++i)
+		void TextBox::OnKey(KeyboardEvent e)
+		{
+			MarkLayoutDirty();
+			bool extend = e.modifier & ShiftModifier;
+			bool control = e.modifier & ControlModifier;
+			switch (e.virtual_key)
 			{
-				m_text.push_back(p[i]);
+			case VirtualKey_Left:   m_editor.MoveLeft(extend); break;
+			case VirtualKey_Right:  m_editor.MoveRight(extend); break;
+			case VirtualKey_Up:     m_editor.MoveUp(extend); break;
+			case VirtualKey_Down:   m_editor.MoveDown(extend); break;
+			case VirtualKey_Delete:
+				if (!m_read_only)
+					m_editor.Delete();
+				break;
+			case VirtualKey_Home:
+				if (control)
+					m_editor.SetCaret(0, extend);
+				else
+					m_editor.MoveHome(extend);
+				break;
+			case VirtualKey_End:
+				if (control)
+					m_editor.SetCaret(m_editor.Size(), extend);
+				else
+					m_editor.MoveEnd(extend);
+				break;
 			}
-			last_width = e.key_length;
+			ScrollToCaret();
+		}
+
+		void TextBox::OnText(std::string_view text)
+		{
+			Insert(text);
+			ScrollToCaret();
+		}
+
+		void TextBox::OnMouseWheel(int delta)
+		{
+			// three lines per notch
+			ScrollBy(-delta * 3 / 120);
 		}
 
 
@@ -570,8 +1489,10 @@ namespace application
 			m_on_char_input_fn = fn;
 		}
 
-		void TextBox::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
+		void TextBox::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
 		{
+			if (!BeginLayout(c, interaction_context)) return;
+
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -588,15 +1509,16 @@ namespace application
 
 			logger::Debug("INFO (TextBox): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
 
-			m_layout = info;
+			CommitLayout(info);
 		}
 
     Widget* TextBox::HitTest(int x, int y)
     {
-			if (IsLayoutInfoValid(m_layout))
+			LayoutInfo const& layout = GetLayout();
+			if (IsLayoutInfoValid(layout))
 			{
-				if (x > m_layout.x && x < m_layout.x + m_layout.width &&
-					y > m_layout.y && y < m_layout.y + m_layout.height)
+				if (x > layout.x && x < layout.x + layout.width &&
+					y > layout.y && y < layout.y + layout.height)
 				{
 					return this;
 				}
@@ -612,8 +1534,10 @@ namespace application
 			m_type = WidgetType::LayersType;
 		}
 
-		void Layers::Layout(LayoutConstraint const& c, InteractionContext& interaction_context)
+		void Layers::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
 		{
+			if (!BeginLayout(c, interaction_context)) return;
+
 			LayoutInfo info = {};
 			info.x = c.x;
 			info.y = c.y;
@@ -633,40 +1557,80 @@ namespace application
 			  .y = c.y
 			};
 
-			for (auto i = m_layers.begin(); i != m_layers.end(); ++i)
+			// the layers don't depend on each other
+			WidgetTree& tree = GetWidgetTree();
+			std::vector<LayoutTask> tasks;
+			for (WidgetHandle layer = tree.first_child[m_node]; layer != InvalidWidgetHandle; layer = tree.next_sibling[layer])
 			{
-				i->second->Layout(layer_constraint, interaction_context);
+				if (ShouldLayoutInParallel(layer, layer_constraint, interaction_context))
+					tasks.push_back({ tree.widget[layer], layer_constraint });
+				else
+					tree.widget[layer]->Layout(layer_constraint, interaction_context);
 			}
+			RunLayoutTasks(tasks, interaction_context);
 
 			logger::Debug("INFO (Layers): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
 
-			m_layout = info;
+			CommitLayout(info);
+		}
+
+		bool Layers::MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width)
+		{
+			width = FindMaxSize(m_width, max_width);
+			return true;
 		}
 
-		void Layers::SetLayer(int layer, std::shared_ptr<Widget> w)
+		void Layers::SetLayer(int layer, Widget* w)
 		{
-			m_layers[layer] = w;
+			WidgetTree& tree = GetWidgetTree();
+
+			auto it = std::lower_bound(m_levels.begin(), m_levels.end(), layer);
+			WidgetHandle before = tree.first_child[m_node];
+			for (auto i = m_levels.begin(); i != it; ++i)
+				before = tree.next_sibling[before];
+
+			if (it != m_levels.end() && *it == layer)
+			{
+				WidgetHandle replaced = before;
+				before = tree.next_sibling[replaced];
+				delete tree.widget[replaced];
+				it = m_levels.erase(it);
+			}
+
+			tree.Insert(m_node, before, w->m_node);
+			m_levels.insert(it, layer);
+			MarkLayoutDirty();
 		}
 
 		void Layers::PopLayer()
 		{
-			if (m_layers.size() <= 1) return;
-			auto nit = m_layers.begin();
-			nit++;
-			m_layers.erase(nit, m_layers.end());
+			if (m_levels.size() <= 1) return;
+			RemoveLayersFrom(1);
+		}
+
+		void Layers::RemoveLayersFrom(size_t index)
+		{
+			WidgetTree& tree = GetWidgetTree();
+			while (m_levels.size() > index)
+			{
+				delete tree.widget[tree.last_child[m_node]];
+				m_levels.pop_back();
+			}
+			MarkLayoutDirty();
 		}
 
 		int Layers::GetLevel()
 		{
-			return m_layers.rbegin()->first;
+			return m_levels.back();
 		}
 
 		Widget* Layers::HitTest(int x, int y)
 		{
-			int number_of_layers = m_layers.size();
-			if (number_of_layers > 0)
+			WidgetTree& tree = GetWidgetTree();
+			WidgetHandle top = tree.last_child[m_node];
+			if (top != InvalidWidgetHandle)
 			{
-				Widget* hit = m_layers.rbegin()->second->HitTest(x, y);
+				Widget* hit = tree.widget[top]->HitTest(x, y);
 				if (hit) return hit;
 			}
 
@@ -675,40 +1639,259 @@ namespace application
 
 		void Layers::OnClick()
 		{
-			auto it = m_layers.lower_bound(1);
-			m_layers.erase(it, m_layers.end());
+			auto it = std::lower_bound(m_levels.begin(), m_levels.end(), 1);
+			RemoveLayersFrom(it - m_levels.begin());
+		}
+
+		VirtualList::VirtualList()
+    : Widget(WidgetType::VirtualListType)
+		{
+		}
+
+		void VirtualList::SetDataSource(std::function<size_t()> count, std::function<std::string(size_t)> item_at)
+		{
+			m_item_count_fn = count;
+			m_item_at_fn = item_at;
+			Reset();
+		}
+
+		void VirtualList::SetOnItemClicked(std::function<void(void*, size_t)> fn)
+		{
+			m_on_item_clicked_fn = fn;
+		}
+
+		void VirtualList::SetRowHeight(int h)
+		{
+			m_row_height = std::max(h, 1);
+			Reset();
+		}
+
+		void VirtualList::SetSelected(size_t index)
+		{
+			size_t previous = m_selected;
+			m_selected = index;
+
+			// only the rows showing the old and the new selection change
+			for (size_t item : { previous, index })
+			{
+				if (item == SIZE_MAX || m_rows.empty()) continue;
+				size_t row = item % m_rows.size();
+				if (m_row_items[row] == item)
+					BindRow(row, item);
+			}
+		}
+
+		void VirtualList::Reset()
+		{
+			std::fill(m_row_items.begin(), m_row_items.end(), SIZE_MAX);
+			m_scroll_offset = 0;
+			m_selected = SIZE_MAX;
+			MarkLayoutDirty();
+		}
+
+		void VirtualList::ScrollBy(int dy)
+		{
+			size_t count = m_item_count_fn ? m_item_count_fn() : 0;
+			long long content = (long long) count * m_row_height;
+			long long max_offset = std::max(0LL, content - GetLayout().height);
+
+			long long offset = std::clamp((long long) m_scroll_offset + dy, 0LL, max_offset);
+			if (offset == m_scroll_offset) return;
+
+			m_scroll_offset = (int) offset;
+			MarkLayoutDirty();
+		}
+
+		void VirtualList::OnMouseWheel(int delta)
+		{
+			// three rows per notch
+			ScrollBy(-delta * 3 * m_row_height / 120);
+		}
+
+		bool VirtualList::UpdateRows(int viewport_height)
+		{
+			size_t count = m_item_count_fn ? m_item_count_fn() : 0;
+			size_t visible = viewport_height / m_row_height + 2;
+			size_t wanted = std::min(count, visible + 2 * m_overscan);
+			bool resized = true;
+
+			if (m_rows.size() != wanted && IsParallelLayoutActive())
+			{
+				// creating widgets grows the tree storage under the other
+				// layout tasks, bind what we have and come back later
+				resized = false;
+			}
+			else if (m_rows.size() != wanted)
+			{
+				// the item -> row mapping depends on the pool size
+				DestroyChildren();
+				m_rows.clear();
+				m_row_items.clear();
+
+				WidgetTree& tree = GetWidgetTree();
+				for (size_t i = 0; i < wanted; ++i)
+				{
+					auto btn = dynamic_cast<Button*>(platform::NewWidget(WidgetType::ButtonType));
+					btn->SetHeight(WidgetSize(WidgetSize::Type::Fixed, m_row_height));
+					btn->SetWidth(WidgetSize(WidgetSize::Type::Percent, 100));
+					btn->SetOnClicked(std::bind(&VirtualList::RowClicked, this, btn, std::placeholders::_1));
+					tree.Append(m_node, btn->m_node);
+
+					m_rows.push_back(btn);
+					m_row_items.push_back(SIZE_MAX);
+				}
+			}
+
+			if (m_rows.empty()) return resized;
+
+			size_t first = FirstRowItem();
+			for (size_t item = first; item < first + m_rows.size() && item < count; ++item)
+			{
+				size_t row = item % m_rows.size();
+				if (m_row_items[row] != item)
+					BindRow(row, item);
+			}
+			return resized;
+		}
+
+		size_t VirtualList::FirstRowItem()
+		{
+			size_t top = m_scroll_offset / m_row_height;
+			return top > (size_t) m_overscan ? top - m_overscan : 0;
+		}
+
+		void VirtualList::BindRow(size_t row, size_t item)
+		{
+			auto btn = dynamic_cast<Button*>(m_rows[row]);
+			m_row_items[row] = item;
+
+			btn->SetText(m_item_at_fn(item));
+			btn->SetColor(item == m_selected ? m_row_selected_color : m_row_color);
+			btn->SetTextColor(m_row_text_color);
+			btn->SetBorderColor(m_row_border_color);
+		}
+
+		void VirtualList::RowClicked(Widget* w, void*)
+		{
+			auto it = std::find(m_rows.begin(), m_rows.end(), w);
+			if (it == m_rows.end()) return;
+
+			size_t item = m_row_items[it - m_rows.begin()];
+			if (item != SIZE_MAX && m_on_item_clicked_fn)
+				m_on_item_clicked_fn(this, item);
+		}
+
+		void VirtualList::Layout(LayoutConstraint const& c, InteractionContext const& interaction_context)
+		{
+			if (!m_layout_dirty && c == m_last_constraint && interaction_context.dragging != this)
+				return;
+
+			LayoutInfo info = {};
+			info.x = c.x;
+			info.y = c.y;
+			info.width = FindMaxSize(m_width, c.max_width);
+			info.height = FindMaxSize(m_height, c.max_height);
+
+			// we are about to be laid out, binding the rows only needs to
+			// invalidate the rows and not our ancestors
+			m_layout_dirty = true;
+			if (!UpdateRows(info.height))
+				DeferLayout(this, c);
+
+			BeginLayout(c, interaction_context);
+
+			size_t count = m_item_count_fn ? m_item_count_fn() : 0;
+			size_t first = FirstRowItem();
+			for (size_t row = 0; row < m_rows.size(); ++row)
+			{
+				size_t item = m_row_items[row];
+				if (item == SIZE_MAX || item >= count || item < first || item >= first + m_rows.size())
+				{
+					m_rows[row]->CommitLayout({});
+					// laid out again once it shows, even at the same place and
+					// with the same item
+					m_rows[row]->m_last_constraint = {};
+					continue;
+				}
+
+				LayoutConstraint row_constraint;
+				row_constraint.max_width = info.width;
+				row_constraint.max_height = m_row_height;
+				row_constraint.x = 0;
+				row_constraint.y = (int) ((long long) item * m_row_height - m_scroll_offset);
+				m_rows[row]->Layout(row_constraint, interaction_context);
+			}
+
+			logger::Debug("INFO (VirtualList): x=%d, y=%d, width=%d, height=%d", info.x, info.y, info.width, info.height);
+			CommitLayout(info);
+		}
+
+		bool VirtualList::MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width)
+		{
+			width = FindMaxSize(m_width, max_width);
+			return true;
+		}
+
+		Widget* VirtualList::HitTest(int x, int y)
+		{
+			WidgetTree& tree = GetWidgetTree();
+			LayoutInfo layout = tree.layout[m_node];
+			if (!IsLayoutInfoValid(layout))
+				return NULL;
+
+			// rows in the overscan are outside of the list, clip them
+			if (!(x > layout.x && x < layout.x + layout.width &&
+				y > layout.y && y < layout.y + layout.height))
+				return NULL;
+
+			x -= layout.x;
+			y -= layout.y;
+			for (WidgetHandle child = tree.first_child[m_node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
+			{
+				if (IsLayoutInfoValid(tree.layout[child]))
+				{
+					Widget* w = tree.widget[child]->HitTest(x, y);
+					if (w) return w;
+				}
+			}
+
+			return this;
 		}
 
 		FileSelector::FileSelector()
     : Widget(WidgetType::FileSelectorType)
 		{
-      m_file_list = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::VerticalContainerType));
-      auto file_list = dynamic_cast<VerticalContainer*>(m_file_list.get());
-      file_list->SetId(GetId() + ":FileList");
+      m_file_list = platform::NewWidget(WidgetType::VirtualListType);
+      auto file_list = dynamic_cast<VirtualList*>(m_file_list);
+      file_list->SetDataSource(
+        [this]() { return m_file_names.size(); },
+        [this](size_t i) { return m_file_names[i]; });
+      file_list->SetOnItemClicked(std::bind(&FileSelector::PathItemSelect, this, std::placeholders::_1, std::placeholders::_2));
+
+      m_action_row = platform::NewWidget(WidgetType::HorizontalContainerType);
+      auto action_row = dynamic_cast<HorizontalContainer*>(m_action_row);
 
-      m_action_row = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::HorizontalContainerType));
-      auto action_row = dynamic_cast<HorizontalContainer*>(m_action_row.get());
-      action_row->SetId(GetId() + ":ActionRow");
+      WidgetTree& tree = GetWidgetTree();
+      tree.Append(m_node, m_file_list->m_node);
+      tree.Append(m_node, m_action_row->m_node);
 
-      auto filepath_textbox_ptr = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::TextBoxType));
-      auto confirm_button_ptr = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::ButtonType));
-      auto cancel_button_ptr = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::ButtonType));
+      auto filepath_textbox_ptr = platform::NewWidget(WidgetType::TextBoxType);
+      auto confirm_button_ptr = platform::NewWidget(WidgetType::ButtonType);
+      auto cancel_button_ptr = platform::NewWidget(WidgetType::ButtonType);
 
 
-      filepath_textbox_ptr->SetId(m_action_row->GetId() + "::FileNameTextBox");
+      m_file_name_textbox = filepath_textbox_ptr;
       filepath_textbox_ptr->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 0.8));
       filepath_textbox_ptr->SetHeight(WidgetSize(WidgetSize::Type::Fixed, 1));
 
 
-      auto confirm_button = dynamic_cast<Button*>(confirm_button_ptr.get());
-      confirm_button->SetId(m_action_row->GetId() + "::ConfirmButton");
+      auto confirm_button = dynamic_cast<Button*>(confirm_button_ptr);
       confirm_button->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 0.1));
       confirm_button->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0));
       confirm_button->SetText("Open");
 
 
-      auto cancel_button = dynamic_cast<Button*>(cancel_button_ptr.get());
-      cancel_button->SetId(m_action_row->GetId() + ":CancelButton");
+      auto cancel_button = dynamic_cast<Button*>(cancel_button_ptr);
       cancel_button->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 0.1));
       cancel_button->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1));
       cancel_button->SetText("Cancel");
@@ -721,50 +1904,37 @@ namespace application
 
 		void FileSelector::SetPath(std::string path)
 		{
-      auto file_path_textbox = dynamic_cast<TextBox*>(FindId(m_action_row.get(), m_action_row->GetId() + "::FileNameTextBox"));
+      auto file_path_textbox = dynamic_cast<TextBox*>(m_file_name_textbox);
       assert(file_path_textbox);
 
 			if (m_current_path != path)
 			{
-				auto file_list = dynamic_cast<VerticalContainer*>(m_file_list.get());
-				file_list->Clear();
-
 				m_current_path = path;
 				m_file_names = ReadPath(m_current_path);
 				std::sort(m_file_names.begin(), m_file_names.end());
 
-				for (auto item : m_file_names)
-				{
-					auto btnw = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::ButtonType));
-					auto btn = dynamic_cast<Button*>(btnw.get());
-					btn->SetText(item);
-					btn->SetId(file_path_textbox->GetId() + "::" + item);
-					btn->SetHeight(WidgetSize(WidgetSize::Type::Fixed, 30));
-					btn->SetWidth(WidgetSize(WidgetSize::Type::Percent, 100));
-					btn->SetColor(Color(1.0, 1.0, 1.0, 1.0));
-					btn->SetTextColor(Color(0.0, 0.0, 0.0, 1.0));
-					btn->SetBorderColor(Color(0.7, 0.7, 0.7, 1.0));
-					btn->SetOnClicked(std::bind(&FileSelector::PathButtonSelect, this, btn, std::placeholders::_1));
-
-					file_list->PushBack(btnw);
-				}
+					dynamic_cast<VirtualList*>(m_file_list)->Reset();
 			}
 
       file_path_textbox->SetText(path);
 		}
 
-		void FileSelector::Layout(LayoutConstraint const& layout, InteractionContext& interaction_context)
+		void FileSelector::Layout(LayoutConstraint const& layout, InteractionContext const& interaction_context)
 		{
-			m_layout.x = layout.x;
-			m_layout.y = layout.y;
-			m_layout.width = FindFixSize(m_width, layout.max_width);
-			m_layout.height = FindFixSize(m_height, layout.max_height);
+			if (!BeginLayout(layout, interaction_context)) return;
+
+			LayoutInfo info = {};
+			info.x = layout.x;
+			info.y = layout.y;
+			info.width = FindFixSize(m_width, layout.max_width);
+			info.height = FindFixSize(m_height, layout.max_height);
+			CommitLayout(info);
 
 
 			// get some space for padding
-			int child_max_width = m_layout.width * 0.6;
-			int child_max_height = m_layout.height;
-			int x = (m_layout.width - child_max_width) / 2;
+			int child_max_width = info.width * 0.6;
+			int child_max_height = info.height;
+			int x = (info.width - child_max_width) / 2;
 			int y = 0;
 
 			LayoutConstraint constraint{
@@ -792,16 +1962,17 @@ namespace application
 
 		Widget* FileSelector::HitTest(int x, int y)
 		{
-			if (IsLayoutInfoValid(m_layout))
+			LayoutInfo layout = GetLayout();
+			if (IsLayoutInfoValid(layout))
 			{
-				if (x < m_layout.x || x >(m_layout.x + m_layout.width) ||
-					y < m_layout.y || y >(m_layout.y + m_layout.height))
+				if (x < layout.x || x >(layout.x + layout.width) ||
+					y < layout.y || y >(layout.y + layout.height))
 					return NULL;
 
 				else
 				{
-					x -= m_layout.x;
-					y -= m_layout.y;
+					x -= layout.x;
+					y -= layout.y;
 					Widget* child_hit = m_file_list->HitTest(x, y);
           if (child_hit) return child_hit;
 
@@ -826,29 +1997,16 @@ namespace application
 			OnDestroyed("");
 		}
 
-		void FileSelector::PathButtonSelect(Widget* w, void*)
+		void FileSelector::PathItemSelect(void*, size_t index)
 		{
-			if (!w) return;
-			auto widget = (Widget*)w;
-
-			auto& button = dynamic_cast<Button&>(*widget);
+			if (index >= m_file_names.size()) return;
 
-			std::string filename = button.GetText();
+			std::string filename = m_file_names[index];
 			std::string newpath = platform::AppendSegment(m_current_path, filename);
 
 			if (platform::IsFile(newpath))
 			{
-				VerticalContainer* container = dynamic_cast<VerticalContainer*>(m_file_list.get());
-				for (auto it = container->m_children.begin();
-					it != container->m_children.end();
-					it++)
-				{
-					auto btn = dynamic_cast<Button*>(it->get());
-					if (!btn) continue;
-
-					btn->SetColor(Color(1.0, 1.0, 1.0, 1.0));
-				}
-				button.SetColor(Color(0.0, 0.3, 0.6, 1.));
+				dynamic_cast<VirtualList*>(m_file_list)->SetSelected(index);
 			}
 			else if (platform::IsDirectory(newpath))
 			{
@@ -870,12 +2028,38 @@ namespace application
 
 		Application::Application()
 		{
+			unsigned workers = std::thread::hardware_concurrency();
+			if (workers > 1)
+			{
+				m_layout_pool = std::make_unique<ThreadPool>(workers - 1);
+				SetLayoutThreadPool(m_layout_pool.get());
+			}
+			m_io_pool = std::make_unique<ThreadPool>(1);
+			m_search_pool = std::make_unique<ThreadPool>(1);
+			m_replace_pool = std::make_unique<ThreadPool>(1);
+			m_load_pool = std::make_unique<ThreadPool>(1);
+
 			InitLayout();
 			LoadFile();
 
 			m_application_path = platform::CurrentPath();
 		}
 
+		Application::~Application()
+		{
+			// finishes the saves in progress while what they use is alive
+			m_io_pool.reset();
+			CancelFind();
+			m_search_pool.reset();
+			CancelReplaceAll();
+			m_replace_pool.reset();
+			CancelOpen();
+			m_load_pool.reset();
+			if (m_layout_pool)
+				SetLayoutThreadPool(NULL);
+			delete m_widget;
+		}
+
 		void Application::InitLayout()
 		{
 
@@ -929,11 +2113,51 @@ namespace application
 
 
 
-			layers->SetLayer(0, std::shared_ptr<Widget>(vertical_container));
+			layers->SetLayer(0, vertical_container);
+		}
+
+		void Application::InsertText(std::string_view text)
+		{
+			UserEvent event {
+				.type = UserEvent::Type::TextInputEventType,
+				.text_input_event = { text.data(), text.size() }
+			};
+			ProcessEvent(&event);
+		}
+
+		void Application::FlushPendingText()
+		{
+			if (m_pending_text.empty())
+				return;
+
+			std::string text = std::move(m_pending_text);
+			m_pending_text.clear();
+			if (m_interaction_context.active)
+				m_interaction_context.active->OnText(text);
 		}
 
 		void Application::ProcessEvent(UserEvent* event)
 		{
+			platform::Timestamp event_start = platform::CurrentTimestamp();
+
+			// printable characters wait for the end of the frame and go in
+			// one edit, anything else sees the text typed before it
+			if (event->type == UserEvent::Type::KeyboardEventType && event->keyboard_event.virtual_key < 0)
+			{
+				KeyboardEvent const& e = event->keyboard_event;
+				unsigned char lead = e.key_press & 0xff;
+				if (lead >= 0x20 || lead == '\t' || lead == '\r')
+				{
+					if (lead == '\r')
+						m_pending_text.push_back('\n');
+					else
+						m_pending_text.append((char const*) &e.key_press, e.key_length);
+					m_frame_stats.AddSince(ProcessEventsPhase, event_start);
+					return;
+				}
+			}
+			FlushPendingText();
+
 			bool mouse_click = false;
 			bool mouse_moving = false;
 			bool mouse_dragged = false;
@@ -978,7 +2202,7 @@ namespace application
 					mouse_down = true;
 					if (mouse_dragged == false)
 					{
-						printf("start_x:%d, now_x: %d\n", m_mouse_drag_start_x, e.x);
+						logger::Debug("start_x:%d, now_x: %d", m_mouse_drag_start_x, e.x);
 						if (!m_last_mouse_dragged)
 						{
 							m_mouse_drag_start_x = e.x;
@@ -998,31 +2222,51 @@ namespace application
 					mouse_moving = true;
 				}
 
-				interacting_widget = m_widget->HitTest(e.x, e.y);
+				// the index is stale when the tree changed since the last frame
+				if (m_hit_index.IsValid(m_widget))
+					interacting_widget = m_hit_index.HitTest(e.x, e.y);
+				else
+					interacting_widget = m_widget->HitTest(e.x, e.y);
 				m_interaction_context.active = interacting_widget;
 			}
+			else if (event->type == UserEvent::Type::MouseWheelEventType)
+			{
+				MouseWheelEvent e = event->mouse_wheel_event;
+				Widget* w = m_hit_index.IsValid(m_widget) ? m_hit_index.HitTest(e.x, e.y) : m_widget->HitTest(e.x, e.y);
+				if (w)
+					w->OnMouseWheel(e.delta);
+			}
+			else if (event->type == UserEvent::Type::TextInputEventType)
+			{
+				TextInputEvent e = event->text_input_event;
+				if (m_interaction_context.active)
+					m_interaction_context.active->OnText(std::string_view(e.text, e.length));
+			}
 			else if (event->type == UserEvent::Type::KeyboardEventType)
 			{
 				key_pressed = true;
 				KeyboardEvent e = event->keyboard_event;
 				if (key_pressed && m_interaction_context.active)
 				{
-					m_interaction_context.active->OnChar(e);
+					if (e.virtual_key >= 0)
+						m_interaction_context.active->OnKey(e);
+					else
+						m_interaction_context.active->OnChar(e);
 				}
 			}
 
 			// mouse_click: check duration < hold_duration
 			// mouse_drag: check_duration
 			// mouse_double_click: save last click timestamp and check
-			printf("move: %d, down: %d, click: %d, dclick: %d, drag: %d\n", mouse_moving, mouse_down, mouse_click, mouse_double_clicked, mouse_dragged);
-			printf("%s\n", interacting_widget ? interacting_widget->GetId().c_str() : "NULL");
+			logger::Debug("move: %d, down: %d, click: %d, dclick: %d, drag: %d", mouse_moving, mouse_down, mouse_click, mouse_double_clicked, mouse_dragged);
+			logger::Debug("%s", interacting_widget ? IdString(interacting_widget->GetId()).c_str() : "NULL");
 
 			if (mouse_click && interacting_widget)
 			{
 				interacting_widget->OnClick();
 			}
 
-
+			m_frame_stats.AddSince(ProcessEventsPhase, event_start);
 		}
 
 		void Application::SaveFileSuccessfullyCallback()
@@ -1047,18 +2291,53 @@ namespace application
 
 		void Application::Render(LayoutConstraint* constraint, platform::RenderContext* render_context)
 		{
+			RunUiTasks();
+			FlushPendingText();
 			if (m_widget)
 			{
-				m_widget->Layout(*constraint, m_interaction_context);
+				platform::Timestamp start = platform::CurrentTimestamp();
+				RunLayout(m_widget, *constraint, m_interaction_context);
+
+				m_hit_index.Update(m_widget);
+				GetWidgetTree().NumberPreOrder();
+				start = m_frame_stats.AddSince(LayoutPhase, start);
+
 				m_widget->Draw(render_context, m_interaction_context);
+				m_frame_stats.AddSince(DrawPhase, start);
 			}
 		}
 
 
-		void Application::SaveToFile(std::string const& content, std::function<void()> callback)
+		void Application::PostToUi(std::function<void()> fn)
+		{
+			std::lock_guard<std::mutex> lock(m_ui_tasks_mutex);
+			m_ui_tasks.push_back(std::move(fn));
+		}
+
+		void Application::RunUiTasks()
+		{
+			std::vector<std::function<void()>> tasks;
+			{
+				std::lock_guard<std::mutex> lock(m_ui_tasks_mutex);
+				tasks.swap(m_ui_tasks);
+			}
+			for (auto& task : tasks)
+				task();
+		}
+
+		void Application::SaveToFile(std::string filename, DocumentSnapshot snapshot, std::function<void()> callback)
 		{
-			if (platform::WriteFile("test.txt", content))
-				callback();
+			m_io_pool->Submit([this, filename = std::move(filename), snapshot = std::move(snapshot), callback = std::move(callback)] {
+				// the chunks point into the document storage, nothing is copied
+				DocumentChunkIterator chunks = snapshot.Chunks();
+				if (!platform::WriteFileAtomic(filename, [&](std::string_view& chunk) { return chunks.Next(chunk); }))
+				{
+					logger::Error("Unable to save file");
+					return;
+				}
+				if (callback)
+					PostToUi(callback);
+			});
 		}
 
 		void Application::LoadFile()
@@ -1070,16 +2349,198 @@ namespace application
 
 			if (filename.empty()) return;
 
+			OpenFile(filename);
+		}
+
+		void Application::OpenFile(std::string filename)
+		{
+			CancelOpen();
+			auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+			if (!textbox) return;
+
+			auto show_progress = [this](std::string text) {
+				if (auto button = dynamic_cast<Button*>(FindId(m_widget, "OpenButton")))
+					button->SetText(text);
+			};
+			show_progress("Opening");
+
+			// mapping, indexing and checking the file all run on the pool, the
+			// UI thread only swaps the texts in
+			unsigned generation = m_load_generation;
+			LoadJob::Callbacks callbacks;
+			callbacks.on_preview = [this, generation](std::shared_ptr<const void> owner, std::string_view preview) {
+				PostToUi([this, generation, owner, preview] {
+					auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+					if (generation != m_load_generation || !textbox) return;
+					textbox->SetText(owner, preview);
+					textbox->m_read_only = true;
+				});
+			};
+			callbacks.on_progress = [this, generation, show_progress](double progress) {
+				PostToUi([this, generation, show_progress, progress] {
+					if (generation == m_load_generation)
+						show_progress("Opening " + std::to_string((int) (progress * 100)) + "%");
+				});
+			};
+			callbacks.on_done = [this, generation, show_progress](Document document, bool opened, bool valid_utf8) {
+				PostToUi([this, generation, show_progress, document = std::move(document), opened, valid_utf8] {
+					if (generation != m_load_generation) return;
+					m_load = NULL;
+					show_progress("Open");
+					auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+					if (!textbox) return;
+
+					if (!opened)
+					{
+						logger::Error("Unable to open file");
+						return;
+					}
+					if (!valid_utf8)
+						logger::Warning("File is not valid UTF-8");
+					// the preview is the start of the document, what it showed stays
+					textbox->SetDocument(document, textbox->m_read_only);
+					textbox->m_read_only = false;
+				});
+			};
+			m_load = LoadJob::Start(*m_load_pool, std::move(filename), std::move(callbacks));
+		}
+
+		void Application::CancelOpen()
+		{
+			if (m_load)
+			{
+				m_load->Cancel();
+				if (auto button = dynamic_cast<Button*>(FindId(m_widget, "OpenButton")))
+					button->SetText("Open");
+			}
+			m_load = NULL;
+			m_load_generation++;
+
+			// the start of a file can't be edited or saved on its own
+			auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+			if (textbox && textbox->m_read_only)
+			{
+				textbox->SetText("");
+				textbox->m_read_only = false;
+			}
+		}
 
-			std::string s = platform::ReadFile(filename);
+		void Application::Find(std::string pattern, SearchOptions options, SearchResultFn on_matches)
+		{
+			CancelFind();
 			auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
 			if (!textbox) return;
 
-			textbox->SetText(s);
+			unsigned generation = m_search_generation;
+			m_search = SearchJob::Start(*m_search_pool, textbox->GetDocument().Snapshot(), std::move(pattern), options,
+				[this, generation, on_matches = std::move(on_matches)](std::vector<DocumentRange> matches, bool done) {
+					PostToUi([this, generation, on_matches, matches = std::move(matches), done] {
+						if (generation == m_search_generation)
+							on_matches(matches, done);
+					});
+				});
+		}
+
+		void Application::CancelFind()
+		{
+			if (m_search)
+				m_search->Cancel();
+			m_search = NULL;
+			m_search_generation++;
+		}
+
+		void Application::ReplaceAll(std::string pattern, SearchOptions options, std::string replacement,
+		                             std::function<void(bool replaced)> on_done)
+		{
+			CancelReplaceAll();
+			m_replace_done = std::move(on_done);
+			try
+			{
+				StartReplaceAll(std::move(pattern), options, std::move(replacement), true);
+			}
+			catch (...)
+			{
+				m_replace_done = NULL;
+				throw;
+			}
+		}
+
+		void Application::CancelReplaceAll()
+		{
+			if (m_replace)
+				m_replace->Cancel();
+			m_replace = NULL;
+			m_replace_generation++;
+			FinishReplaceAll(false);
+		}
+
+		void Application::StartReplaceAll(std::string pattern, SearchOptions options, std::string replacement, bool retry)
+		{
+			auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+			if (!textbox) return FinishReplaceAll(false);
+			// the text box only holds the start of the file being opened
+			if (m_load || textbox->m_read_only)
+			{
+				logger::Warning("Unable to replace while a file is opening");
+				return FinishReplaceAll(false);
+			}
+
+			// the matches are offsets in this version of the text
+			DocumentNodePtr root = textbox->GetDocument().m_root;
+			auto matches = std::make_shared<std::vector<DocumentRange>>();
+			unsigned generation = m_replace_generation;
+			m_replace = SearchJob::Start(*m_replace_pool, textbox->GetDocument().Snapshot(), pattern, options,
+				[=, this](std::vector<DocumentRange> batch, bool done) {
+					PostToUi([=, this, batch = std::move(batch)] {
+						if (generation != m_replace_generation) return;
+						matches->insert(matches->end(), batch.begin(), batch.end());
+						if (!done)
+							return;
+
+						m_replace = NULL;
+						auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+						if (textbox && textbox->GetDocument().m_root != root)
+						{
+							if (retry)
+								return StartReplaceAll(pattern, options, replacement, false);
+							logger::Warning("Unable to replace, the text keeps changing");
+							return FinishReplaceAll(false);
+						}
+						if (!textbox) return FinishReplaceAll(false);
+						textbox->Replace(*matches, replacement);
+						FinishReplaceAll(true);
+					});
+				});
+		}
+
+		void Application::FinishReplaceAll(bool replaced)
+		{
+			// taken first, `on_done` may start another replace-all
+			auto on_done = std::move(m_replace_done);
+			m_replace_done = NULL;
+			if (on_done)
+				on_done(replaced);
 		}
 
 		void Application::SaveButtonClicked(Widget*, void*)
 		{
+			auto textbox = dynamic_cast<TextBox*>(FindId(m_widget, "TextBox"));
+			if (!textbox) return;
+			// saving the start of the file would truncate it
+			if (m_load || textbox->m_read_only)
+			{
+				logger::Warning("Unable to save while a file is opening");
+				return;
+			}
+
+			std::string filename = "test.txt";
+			if (auto filename_box = dynamic_cast<TextBox*>(FindId(m_widget, "FilenameBox")))
+			{
+				if (!filename_box->GetText().empty())
+					filename = filename_box->GetText();
+			}
+
+			SaveToFile(filename, textbox->GetDocument().Snapshot(), std::bind(&Application::SaveFileSuccessfullyCallback, this));
 		}
 
 		void Application::OpenButtonClicked(Widget*, void*)
@@ -1089,14 +2550,14 @@ namespace application
 			Layers& layers = *dynamic_cast<Layers*>(m_widget);
 			int level = layers.GetLevel();
 
-			auto file_opener = std::shared_ptr<Widget>(platform::NewWidget(WidgetType::FileSelectorType));
-			auto& fo = *dynamic_cast<FileSelector*>(file_opener.get());
+			auto file_opener = platform::NewWidget(WidgetType::FileSelectorType);
+			auto& fo = *dynamic_cast<FileSelector*>(file_opener);
 
 			fo.SetWidth(WidgetSize(WidgetSize::Type::Ratio, 0.8));
 			fo.SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0));
 			fo.SetPath(m_application_path);
 			fo.SetId("FileSelector");
-			fo.SetOnDestroyed(std::bind(&Application::FileSelectionFinished, this, file_opener.get(), std::placeholders::_1, std::placeholders::_2));
+			fo.SetOnDestroyed(std::bind(&Application::FileSelectionFinished, this, file_opener, std::placeholders::_1, std::placeholders::_2));
 
 
 			layers.SetLayer(level + 1, file_opener);
@@ -1105,10 +2566,12 @@ namespace application
 
 		void Application::FileSelectionFinished(Widget*, void*, std::string file)
 		{
-			printf("FIle open : %s\n", file.c_str());
+			logger::Info("File open: %s", file.c_str());
 
 			Layers& layers = *dynamic_cast<Layers*>(m_widget);
 			layers.PopLayer();
+			if (!file.empty())
+				OpenFile(file);
 		}
 
 	} // namespace gui
@@ -2,11 +2,24 @@
 
 #include <utility>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
+#include <climits>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "logger.hh"
 #include "platform.hh"
+#include "thread_pool.hh"
+#include "frame_stats.hh"
+#include "document.hh"
+#include "text_layout_cache.hh"
+#include "search.hh"
+#include "load.hh"
+#include "syntax.hh"
+#include "wrap.hh"
 #include <functional>
-#include <map>
 #include <iostream>
 
 
@@ -47,14 +60,28 @@ namespace application
       VirtualKey_w,
       VirtualKey_x,
       VirtualKey_y,
-      VirtualKey_z
+      VirtualKey_z,
+      // keys without a character
+      VirtualKey_Left,
+      VirtualKey_Right,
+      VirtualKey_Up,
+      VirtualKey_Down,
+      VirtualKey_Home,
+      VirtualKey_End,
+      VirtualKey_Delete,
+    };
+
+    enum KeyModifier {
+      ShiftModifier   = 1 << 0,
+      ControlModifier = 1 << 1,
     };
 
 		struct KeyboardEvent
 		{
 			int key_press;
-			int modifier;
+			int modifier; // KeyModifier bits
 			int key_length; // utf-8 can be 1, 2, 3, 4 bytes in length
+			int virtual_key; // a Virtual_KeyCode for keys without a character, -1 for characters
 		};
 		enum WidgetType
 		{
@@ -65,7 +92,8 @@ namespace application
 			ButtonType,
 			TextBoxType,
 			LayersType,
-			FileSelectorType
+			FileSelectorType,
+			VirtualListType
 		};
 
 		struct Color
@@ -150,6 +178,8 @@ namespace application
 
       bool reverse_horizontally = false;
       bool reverse_vertically = false;
+
+      bool operator==(LayoutConstraint const&) const = default;
 		};
 
 		struct LayoutInfo
@@ -160,6 +190,167 @@ namespace application
 			int height = 0;
 		};
 
+		// Widget ids are atoms: names are interned once and compared, hashed
+		// and stored as integers. Widgets without a name get an anonymous id
+		// that never touches the atom table.
+		using WidgetId = uint32_t;
+		constexpr WidgetId InvalidWidgetId = 0;
+		constexpr WidgetId AnonymousWidgetIdBit = 0x80000000;
+
+		// Returns the atom of `name`, adding it to the table the first time
+		WidgetId InternId(std::string_view name);
+		// InvalidWidgetId when `name` was never interned, the table is unchanged
+		WidgetId LookupId(std::string_view name);
+		// The name of an atom or "#<n>" for anonymous ids, for logs and debugging
+		std::string IdString(WidgetId id);
+
+		using WidgetHandle = uint32_t;
+		constexpr WidgetHandle InvalidWidgetHandle = UINT32_MAX;
+
+		// Storage of the widget tree. Every widget owns one node, addressed by
+		// its handle. The links and the committed layout live in parallel
+		// arrays so that layout and hit-test passes walk contiguous memory
+		// instead of chasing pointers between separately allocated widgets.
+		struct WidgetTree
+		{
+			std::vector<Widget*>      widget;
+			std::vector<WidgetHandle> parent;
+			std::vector<WidgetHandle> first_child;
+			std::vector<WidgetHandle> last_child;
+			std::vector<WidgetHandle> next_sibling;
+			std::vector<WidgetHandle> prev_sibling;
+			std::vector<LayoutInfo>   layout;
+			// number of nodes in the subtree, the node included
+			std::vector<uint32_t>     subtree_size;
+
+			std::vector<WidgetHandle> free_list;
+
+			// Bumped by every link change. Nodes whose committed layout changed
+			// are collected in layout_changed until a consumer takes them, when
+			// the list would grow past the tree size it is dropped and
+			// layout_changed_overflow is set instead.
+			uint64_t structure_version = 0;
+			std::vector<WidgetHandle> layout_changed;
+			bool layout_changed_overflow = false;
+
+			// Position of every node in a pre-order walk of all the trees, the
+			// subtree of a node is [pre_order, pre_order + subtree_size). Only
+			// valid while pre_order_version is structure_version, see
+			// NumberPreOrder.
+			std::vector<uint32_t> pre_order;
+			uint64_t pre_order_version = UINT64_MAX;
+
+			WidgetHandle Allocate(Widget* w);
+			void Free(WidgetHandle node);
+
+			// Links `child` under `parent` before `before`, or at the end when
+			// `before` is InvalidWidgetHandle. The child must be detached.
+			void Insert(WidgetHandle parent, WidgetHandle before, WidgetHandle child);
+			void Append(WidgetHandle parent, WidgetHandle child);
+			void Detach(WidgetHandle child);
+
+			// O(1) while the pre-order numbering is current, otherwise walks up
+			// from `node`
+			bool IsAncestor(WidgetHandle ancestor, WidgetHandle node);
+			// Renumbers the nodes when the structure changed since the last time,
+			// O(n). Application does it once per frame.
+			void NumberPreOrder();
+			size_t Size();
+
+			// Safe to call concurrently for different nodes during a layout
+			// pass, see RunLayout.
+			void CommitLayout(WidgetHandle node, LayoutInfo const& info);
+			void AddLayoutChanged(std::vector<WidgetHandle> const& nodes);
+		};
+
+		WidgetTree& GetWidgetTree();
+
+		// Bounding volume hierarchy over the rectangles of the committed
+		// layout, in window coordinates. Application rebuilds or refits it
+		// after each layout pass so that hit testing a mouse event costs
+		// O(log n) instead of a walk over every widget.
+		//
+		// The result is the same widget Widget::HitTest would return: the
+		// index replays the rules of the widgets (exclusive bounds, Layers
+		// only testing its top layer, FileSelector and VirtualList clipping
+		// their children).
+		struct HitTestIndex
+		{
+			struct Entry
+			{
+				// inclusive bounds, empty when x0 > x1 or y0 > y1
+				int x0 = 0;
+				int y0 = 0;
+				int x1 = -1;
+				int y1 = -1;
+
+				// origin of the coordinate space the widget layout is in, and the
+				// clip inherited from the ancestors
+				int ox = 0;
+				int oy = 0;
+				int clip_x0 = INT_MIN;
+				int clip_y0 = INT_MIN;
+				int clip_x1 = INT_MAX;
+				int clip_y1 = INT_MAX;
+
+				WidgetHandle node = InvalidWidgetHandle;
+				uint32_t parent_entry = UINT32_MAX;
+				// entries are stored in pre-order, the subtree of an entry is
+				// [index, index + subtree_size)
+				uint32_t subtree_size = 1;
+			};
+
+			struct BvhNode
+			{
+				int x0 = 0;
+				int y0 = 0;
+				int x1 = -1;
+				int y1 = -1;
+
+				uint32_t parent = UINT32_MAX;
+				// inner nodes: the left child is the next node, `right` the other
+				// leaves: m_refs[first, first + count) are the entries
+				uint32_t right = 0;
+				uint32_t first = 0;
+				uint32_t count = 0;
+				// smallest and largest entry below the node, they don't change
+				// when the node is refitted
+				uint32_t min_entry = UINT32_MAX;
+				uint32_t max_entry = 0;
+			};
+
+			std::vector<Entry>    m_entries;
+			std::vector<BvhNode>  m_nodes;
+			std::vector<uint32_t> m_refs;
+			std::vector<uint32_t> m_leaf_of_entry;
+			// widget node -> entry, UINT32_MAX when the widget isn't indexed
+			std::vector<uint32_t> m_entry_of_node;
+
+			Widget*  m_root = NULL;
+			uint64_t m_structure_version = 0;
+			bool     m_valid = false;
+
+			int m_rebuilds = 0;
+			int m_refits = 0;
+
+			// Brings the index up to date with the committed layout of the
+			// tree under `root`, refitting when only rectangles moved.
+			void Update(Widget* root);
+			void Build(Widget* root);
+			bool IsValid(Widget* root);
+
+			Widget* HitTest(int x, int y);
+
+		private:
+			void AddSubtree(WidgetHandle node, uint32_t parent_entry);
+			void ComputeRect(uint32_t entry);
+			uint32_t BuildNode(uint32_t first, uint32_t count, uint32_t parent);
+			void RefitLeaf(uint32_t leaf);
+			// The first entry in pre-order within [lo, hi) containing the point,
+			// UINT32_MAX when there is none
+			uint32_t FirstHit(int x, int y, uint32_t lo, uint32_t hi);
+		};
+
 		struct InteractionContext
 		{
 			Widget* active = NULL;
@@ -172,6 +363,52 @@ namespace application
 
 			std::vector<wchar_t> keys_pressed;
 		};
+
+		// Counters of the incremental layout pass. A node counts as laid out
+		// when it actually recomputes its LayoutInfo instead of reusing the
+		// result of the previous frame.
+		struct LayoutStats
+		{
+			std::atomic<int> frame_nodes_laid_out = 0;
+			unsigned long long total_nodes_laid_out = 0;
+			unsigned long long frames = 0;
+			unsigned long long idle_frames = 0;
+		};
+
+		LayoutStats& GetLayoutStats();
+
+		// Named widgets are registered by atom, FindId does not walk the tree
+		struct IdRegistryStats
+		{
+			size_t ids = 0;
+			size_t atoms = 0;
+			unsigned long long lookups = 0;
+			unsigned long long hits = 0;
+			unsigned long long misses = 0;
+		};
+
+		IdRegistryStats& GetIdRegistryStats();
+		Widget* FindId(WidgetId id);
+		Widget* FindId(std::string_view id);
+		// Only finds `id` when it belongs to `root` or one of its descendants,
+		// a NULL root finds it anywhere
+		Widget* FindId(Widget* root, WidgetId id);
+		Widget* FindId(Widget* root, std::string_view id);
+
+		// Independent subtrees of at least this many nodes are laid out as
+		// tasks of the layout thread pool.
+		constexpr uint32_t ParallelLayoutMinNodes = 1024;
+
+		// NULL lays out everything on the calling thread
+		void SetLayoutThreadPool(ThreadPool* pool);
+		// True while subtrees are laid out concurrently. The widget tree must
+		// not be restructured then, see DeferLayout.
+		bool IsParallelLayoutActive();
+		// Asks for `w` to be laid out again with `c` once the concurrent part
+		// of the pass is over, for widgets that need to create children.
+		void DeferLayout(Widget* w, LayoutConstraint const& c);
+		// Lays out the tree under `root` and updates the LayoutStats
+		void RunLayout(Widget* root, LayoutConstraint const& c, InteractionContext const& interaction_context);
 		inline bool IsLayoutInfoValid(LayoutInfo info)
 		{
 			return info.x != 0 ||
@@ -186,26 +423,55 @@ namespace application
 			explicit Widget(WidgetType);
       explicit Widget(Widget const& other);
 			virtual ~Widget();
-			virtual void Layout(LayoutConstraint const&, InteractionContext&) = 0;
+			virtual void Layout(LayoutConstraint const&, InteractionContext const&) = 0;
 			virtual void Draw(platform::RenderContext*, InteractionContext) = 0;
 			virtual Widget* HitTest(int, int) = 0;
+			// Pure measure step: computes the width Layout would commit for
+			// `max_width` without laying out the children or mutating anything.
+			// Returns false when the width depends on the children.
+			virtual bool MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width);
 
 			virtual void OnClick();
       virtual void OnChar(KeyboardEvent);
-			virtual std::string const& GetId();
-			void SetId(std::string id);
-      void SetId();
+      // Keys without a character, see Virtual_KeyCode
+      virtual void OnKey(KeyboardEvent);
+      // Text typed or pasted at once, see TextInputEvent
+      virtual void OnText(std::string_view text);
+      // Positive delta scrolls up. The default passes the event to the parent.
+      virtual void OnMouseWheel(int delta);
+			WidgetId GetId();
+			void SetId(WidgetId id);
+			void SetId(std::string_view id);
 			WidgetType GetType();
 
       virtual void SetWidth(WidgetSize w);
       virtual void SetHeight(WidgetSize h);
+      // The reference points into the widget tree storage and is only valid
+      // until the next widget is created.
       virtual LayoutInfo& GetLayout();
+      Widget* GetParent();
+      // Destroys all the children owned by this widget.
+      void DestroyChildren();
+
+      // Invalidates the cached layout of this widget and all of its
+      // ancestors, the next Layout pass recomputes them.
+      void MarkLayoutDirty();
+      bool IsLayoutDirty();
+      bool NeedsLayout(LayoutConstraint const& c, InteractionContext const& interaction_context);
+      // Returns false when the cached layout is still valid for `c`, in that
+      // case the caller must skip the whole subtree.
+      bool BeginLayout(LayoutConstraint const& c, InteractionContext const& interaction_context);
+      void CommitLayout(LayoutInfo const& info);
 
 			WidgetType m_type = WidgetType::InvalidType;
-			std::string m_id = "Invalid";
+			WidgetId m_id = InvalidWidgetId;
       WidgetSize m_width = {};
       WidgetSize m_height = {};
-      LayoutInfo m_layout = {};
+
+      WidgetHandle m_node = InvalidWidgetHandle;
+      bool m_layout_dirty = true;
+      bool m_layout_dragged = false;
+      LayoutConstraint m_last_constraint = {};
 		};
 
 
@@ -218,33 +484,34 @@ namespace application
 			Rectangle();
 			void SetColor(Color c);
 			void SetActiveColor(Color c);
-			virtual void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
+			virtual void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
 			virtual Widget* HitTest(int x, int y) override;
 		};
 
 		struct VerticalContainer : public Widget
 		{
-			std::vector<std::shared_ptr<Widget>> m_children;
-
 			VerticalContainer();
 
+			// The container takes ownership of `w`
 			void PushBack(Widget* w);
-			void PushBack(std::shared_ptr<Widget> w);
 			void Clear();
-			virtual void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
+			virtual void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
 			virtual Widget* HitTest(int x, int y) override;
+			bool MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width) override;
 
 		};
 
 		struct HorizontalContainer : public Widget
 		{
-      std::vector<std::shared_ptr<Widget>> m_children;
-
 			HorizontalContainer();
-			virtual void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
+			virtual void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
 		  Widget* HitTest(int x, int y) override;
+			bool MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width) override;
+			// The container takes ownership of `w`
 			void PushBack(Widget* w);
-      void PushBack(std::shared_ptr<Widget> w);
+			// Lays out the children as tasks when their widths are known up
+			// front, returns false when they have to be laid out in order
+			bool LayoutChildrenInParallel(LayoutInfo const& info, InteractionContext const& interaction_context);
 
 		};
 
@@ -271,17 +538,51 @@ namespace application
 			void SetBorderColor(Color c);
 			Widget* HitTest(int, int) override;
 
-			virtual void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
+			virtual void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
 		};
 
 		struct TextBox : public Widget
 		{
-			std::string m_text;
+			DocumentEditor m_editor;
+			// only the lines from m_scroll_line down to the bottom of the
+			// layout are drawn, whatever the size of the text
+			int m_line_height = 19;
+			size_t m_scroll_line = 0;
+			// set while the text is the start of a file still loading, the
+			// edits, from the keyboard or from Insert, Replace, Undo and Redo,
+			// are ignored since the whole file replaces it
+			bool m_read_only = false;
+			// soft wrap, see SetWrap: the rows of m_scroll_line before this
+			// one are scrolled past
+			bool m_wrap = false;
+			size_t m_scroll_row = 0;
+			// advance of a character, the platform sets it from its font
+			float m_char_width = 8;
+			// declared before the index, whose job it runs, so that the job is
+			// cancelled before the pool waits for it
+			std::unique_ptr<ThreadPool> m_wrap_pool;
+			WrapIndex m_wrap_index;
+			// where each row GetVisibleText returned comes from when wrapping:
+			// its line, its offset in the line, its offset in the visible text
+			// and its length
+			struct VisibleRow
+			{
+				size_t line;
+				size_t offset;
+				size_t text_offset;
+				size_t length;
+			};
+			std::vector<VisibleRow> m_visible_rows;
 			Color m_bg_default_color;
 			Color m_fg_default_color;
 			Color m_bg_active_color;
 			Color m_fg_active_color;
 			Color m_border_color;
+			// colours of the tokens when the text is lexed, Text spans have
+			// m_fg_default_color
+			Color m_token_colors[(size_t) TokenKind::Count];
+			// NULL for plain text, see SetLexer
+			std::unique_ptr<SyntaxHighlighter> m_highlighter;
 
       std::function<void(void*, int)> m_on_char_input_fn;
 
@@ -290,49 +591,165 @@ namespace application
 			void SetColor(Color c);
 			void SetTextColor(Color c);
 			void SetActiveColor(Color c);
-			std::string const& GetText();
+			// Copies the whole text, use GetDocument for large texts
+			std::string GetText();
 			void SetText(std::string text);
+			// Shows `text` without copying it, `owner` keeps it alive
+			void SetText(std::shared_ptr<const void> owner, std::string_view text);
+			// Shows a text built elsewhere, see DocumentEditor::SetDocument.
+			// `keep_position` keeps the caret and the scroll position, for a
+			// text that starts with the one shown.
+			void SetDocument(Document document, bool keep_position = false);
+			// Applies the pending edits, the caret and the selection are kept
+			Document& GetDocument();
+			size_t GetCaret();
+			void SetCaret(size_t offset, bool extend = false);
+			// Replaces the selection
+			void Insert(std::string_view text);
+			// Replaces all of `ranges` with `text` as one edit
+			void Replace(std::vector<DocumentRange> const& ranges, std::string_view text);
+			// False when there is nothing to undo or redo
+			bool Undo();
+			bool Redo();
+			// Breaks the lines longer than the width into rows. The rows are
+			// kept per line and only the edited lines are wrapped again, after
+			// a change of width the visible lines are wrapped first and the
+			// others in the background.
+			void SetWrap(bool wrap);
+			// Characters a row holds at the width of the layout
+			size_t GetWrapColumns();
+			// Lines, or rows when wrapping, that fit in the layout, at least
+			// one
+			size_t GetVisibleLineCount();
+			// By rows when wrapping
+			void ScrollBy(long long lines);
+			// Scrolls just enough for the line, or the row, of the caret to be
+			// visible
+			void ScrollToCaret();
+			// The text of the visible lines, each cut at what the layout width
+			// can show, so Draw never copies more than a screenful. When
+			// wrapping, the visible rows one per line instead. `caret`
+			// receives the index of the caret in it, or npos when it isn't
+			// visible.
+			std::string GetVisibleText(size_t* caret = NULL);
+			// Colours the text with `lexer` from now on, NULL for plain text
+			void SetLexer(std::shared_ptr<Lexer const> lexer);
+			void SetTokenColor(TokenKind kind, Color c);
+			Color GetTokenColor(TokenKind kind);
+			// Appends the coloured spans of `visible`, the text GetVisibleText
+			// returned. Only the visible lines are lexed, from the states the
+			// highlighter keeps for each line. Nothing without a lexer.
+			void GetVisibleSpans(std::string_view visible, std::vector<TokenSpan>& spans);
       void OnChar(KeyboardEvent e) override;
+      void OnKey(KeyboardEvent e) override;
+      void OnText(std::string_view text) override;
+      void OnMouseWheel(int delta) override;
       void SetOnChar(std::function<void(void*, int)> fn);
-			virtual void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
-      virtual Widget* TextBox::HitTest(int, int) override;
+			virtual void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
+      virtual Widget* HitTest(int, int) override;
+
+		private:
+			// Takes in the width of the layout and what the background job
+			// wrapped, starts it again when the lines have to be wrapped anew
+			void UpdateWrap();
+			std::string GetVisibleRows(size_t* caret);
+			// Row of `offset` in its line
+			size_t RowOfOffset(size_t line, size_t offset);
 		};
 
 
 		struct Layers : public Widget
 		{
-			std::map<int, std::shared_ptr<Widget>> m_layers;
+			// level of each child node, in the same (ascending) order as the
+			// children in the widget tree
+			std::vector<int> m_levels;
 
 			Layers();
 
-			void Layout(LayoutConstraint const& c, InteractionContext& interaction_context) override;
+			void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
 			Widget* HitTest(int x, int y) override;
+			bool MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width) override;
 			void OnClick() override;
 
-			void SetLayer(int layer, std::shared_ptr<Widget> w);
+			// Layers takes ownership of `w`, a widget already at `layer` is destroyed
+			void SetLayer(int layer, Widget* w);
 			void PopLayer();
+			void RemoveLayersFrom(size_t index);
 			int GetLevel();
 		};
 
+		// Vertical list whose rows come from a data source instead of one
+		// widget per item. Only the rows intersecting the viewport, plus
+		// m_overscan rows on each side, exist as Button widgets; they are
+		// recycled as the list scrolls, so layout, hit test and draw cost
+		// depends on the viewport height and not on the item count.
+		struct VirtualList : public Widget
+		{
+			std::function<size_t()> m_item_count_fn;
+			std::function<std::string(size_t)> m_item_at_fn;
+			std::function<void(void*, size_t)> m_on_item_clicked_fn;
+
+			int m_row_height = 30;
+			int m_overscan = 4;
+			int m_scroll_offset = 0;
+			size_t m_selected = SIZE_MAX;
+
+			Color m_row_color = Color(1.0, 1.0, 1.0, 1.0);
+			Color m_row_selected_color = Color(0.0, 0.3, 0.6, 1.0);
+			Color m_row_text_color = Color(0.0, 0.0, 0.0, 1.0);
+			Color m_row_border_color = Color(0.7, 0.7, 0.7, 1.0);
+
+			// item shown by each row, SIZE_MAX for an unbound row. The row of
+			// item i is m_rows[i % m_rows.size()], so scrolling only rebinds
+			// the rows entering the viewport.
+			std::vector<Widget*> m_rows;
+			std::vector<size_t> m_row_items;
+
+			VirtualList();
+
+			void SetDataSource(std::function<size_t()> count, std::function<std::string(size_t)> item_at);
+			void SetOnItemClicked(std::function<void(void*, size_t)> fn);
+			void SetRowHeight(int h);
+			void SetSelected(size_t index);
+			// The items changed, rebinds every row and scrolls back to the top
+			void Reset();
+			void ScrollBy(int dy);
+
+			void Layout(LayoutConstraint const& c, InteractionContext const& interaction_context) override;
+			Widget* HitTest(int x, int y) override;
+			bool MeasureWidth(int max_width, InteractionContext const& interaction_context, int& width) override;
+			void OnMouseWheel(int delta) override;
+
+			// Returns false when the row pool needs to change size but can't
+			// because the tree is being laid out concurrently
+			bool UpdateRows(int viewport_height);
+			size_t FirstRowItem();
+			void BindRow(size_t row, size_t item);
+			void RowClicked(Widget* w, void*);
+		};
+
 		struct FileSelector : public Widget
 		{
 			std::string m_current_path;
 			std::vector<std::string> m_file_names;
 
-			std::shared_ptr<Widget> m_file_list;
-      std::shared_ptr<Widget> m_action_row;
+			// both are children of the file selector in the widget tree
+			Widget* m_file_list = NULL;
+      Widget* m_action_row = NULL;
+      // child of m_action_row
+      Widget* m_file_name_textbox = NULL;
 
 			std::function<void(void*, std::string)> m_on_destroyed_fn;
 
       FileSelector();
 
-			void Layout(LayoutConstraint const& layout, InteractionContext& interaction_context) override;
+			void Layout(LayoutConstraint const& layout, InteractionContext const& interaction_context) override;
 			Widget* HitTest(int x, int y) override;
 			void OnClick() override;
 
 			void SetPath(std::string path);
 			std::vector<std::string> ReadPath(std::string p);
-			void PathButtonSelect(Widget* w, void*);
+			void PathItemSelect(void*, size_t index);
 			void OnDestroyed(std::string s);
 			void SetOnDestroyed(std::function<void(void*, std::string)> fn);
 		};
@@ -355,17 +772,36 @@ namespace application
 			platform::Timestamp timestamp;
 		};
 
+		struct MouseWheelEvent
+		{
+			int x;
+			int y;
+			int delta; // multiple of 120 per notch, positive away from the user
+		};
+
+		// A whole utf-8 text typed at once, a paste or a burst of characters.
+		// The bytes belong to the sender and only live during ProcessEvent.
+		struct TextInputEvent
+		{
+			char const* text;
+			size_t length;
+		};
+
 		struct UserEvent
 		{
 			enum Type {
 				KeyboardEventType,
 				MouseEventType,
+				MouseWheelEventType,
+				TextInputEventType,
 			};
 			Type type;
 
 			union {
-				KeyboardEvent keyboard_event;
-				MouseEvent    mouse_event;
+				KeyboardEvent   keyboard_event;
+				MouseEvent      mouse_event;
+				MouseWheelEvent mouse_wheel_event;
+				TextInputEvent  text_input_event;
 			};
 
 		};
@@ -384,6 +820,37 @@ namespace application
 		{
 			Widget* m_widget = NULL;
 			InteractionContext m_interaction_context;
+			HitTestIndex m_hit_index;
+			std::unique_ptr<ThreadPool> m_layout_pool;
+			// saves run there, one at a time and in order
+			std::unique_ptr<ThreadPool> m_io_pool;
+			// searches run there, a new one cancels the previous one
+			std::unique_ptr<ThreadPool> m_search_pool;
+			std::shared_ptr<SearchJob> m_search;
+			// batches of a cancelled search still queued for the UI thread
+			// are dropped when they don't belong to this one
+			unsigned m_search_generation = 0;
+			// replace-alls scan there, apart from the finds of the user so
+			// that neither waits for or cancels the other
+			std::unique_ptr<ThreadPool> m_replace_pool;
+			std::shared_ptr<SearchJob> m_replace;
+			// same as m_search_generation for the replace-all in progress
+			unsigned m_replace_generation = 0;
+			std::function<void(bool replaced)> m_replace_done;
+			// opens run there, a new one cancels the previous one
+			std::unique_ptr<ThreadPool> m_load_pool;
+			std::shared_ptr<LoadJob> m_load;
+			// same as m_search_generation for the open in progress
+			unsigned m_load_generation = 0;
+			// characters sent since the last frame, inserted as one text by
+			// the next frame or before the next event that isn't one
+			std::string m_pending_text;
+			// queued by other threads, run by Render on the UI thread
+			std::mutex m_ui_tasks_mutex;
+			std::vector<std::function<void()>> m_ui_tasks;
+			// filled by Render and ProcessEvent, the platform times the rest
+			// of the frame
+			FrameStats m_frame_stats;
 
 			MouseEvent m_last_mouse_event = {
 			  .state = MouseState::Up,
@@ -401,14 +868,55 @@ namespace application
 
 
 			Application();
+			~Application();
 
 			void InitLayout();
 
 			void ProcessEvent(UserEvent*);
+			// Sends `text` to the active widget as one TextInputEvent
+			void InsertText(std::string_view text);
+			void FlushPendingText();
 			void Render(LayoutConstraint*, platform::RenderContext*);
 
-			void SaveToFile(std::string const& content, std::function<void()>);
+			// Queues `fn` to run on the UI thread before the next frame, from
+			// any thread
+			void PostToUi(std::function<void()> fn);
+			void RunUiTasks();
+
+			// Streams `snapshot` to `filename` in the background, the text
+			// can be edited meanwhile. `callback` runs on the UI thread once
+			// the file is saved.
+			void SaveToFile(std::string filename, DocumentSnapshot snapshot, std::function<void()>);
+
+			// Searches the text box in the background, cancelling the search
+			// in progress. `on_matches` runs on the UI thread with every batch
+			// of matches, in order, until `done`. Throws std::invalid_argument
+			// for a regex that doesn't compile.
+			using SearchResultFn = std::function<void(std::vector<DocumentRange> const& matches, bool done)>;
+			void Find(std::string pattern, SearchOptions options, SearchResultFn on_matches);
+			void CancelFind();
+			// Replaces every match in the text box as one edit once the search
+			// is done, cancelling the replace-all in progress but not the find.
+			// When the text changed meanwhile it is searched once more, and
+			// nothing is replaced if it changed again. `on_done` runs on the
+			// UI thread with whether the text was replaced, also when the
+			// replace-all is cancelled. Throws like Find.
+			void ReplaceAll(std::string pattern, SearchOptions options, std::string replacement,
+			                std::function<void(bool replaced)> on_done = NULL);
+			void CancelReplaceAll();
+			// `retry` is whether an edit during the scan starts it over
+			void StartReplaceAll(std::string pattern, SearchOptions options, std::string replacement, bool retry);
+			void FinishReplaceAll(bool replaced);
 			void SaveFileSuccessfullyCallback();
+			// Opens `filename` in the text box in the background, cancelling
+			// the open in progress. The start of a large file is shown
+			// read-only as soon as it is read and the whole text, editable,
+			// once its lines are indexed. The Open button shows the progress.
+			void OpenFile(std::string filename);
+			// Stops the open in progress, the start of the file it showed is
+			// cleared
+			void CancelOpen();
+			// Opens the file named in the filename box
 			void LoadFile();
 
 			void SaveButtonClicked(Widget*, void*);
@@ -0,0 +1,185 @@
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.hh"
+#include "platform_headless.hh"
+#include "application.hh"
+
+// Drives the background find and replace-all of a headless Application:
+// batches and completion, cancellation by a newer find, a replace-all as
+// one undo step and a replace-all racing edits. Exits with 1 when a check
+// fails.
+
+using application::DocumentRange;
+using application::SearchOptions;
+using application::gui::Application;
+using application::gui::FindId;
+using application::gui::TextBox;
+
+static int failures = 0;
+
+static void Check(bool ok, char const* what)
+{
+  if (!ok)
+  {
+    std::printf("failed: %s\n", what);
+    ++failures;
+  }
+}
+
+// Runs frames, and with them the tasks posted to the UI thread, until
+// `done` or a few seconds passed. `each_frame` runs before every frame.
+static bool RunUntil(platform::HeadlessWindow& window, std::function<bool()> const& done,
+                     std::function<void()> const& each_frame = NULL)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!done())
+  {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    if (each_frame)
+      each_frame();
+    window.Frame();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+static std::string Repeat(std::string_view text, size_t count)
+{
+  std::string result;
+  for (size_t i = 0; i < count; ++i)
+    result += text;
+  return result;
+}
+
+static size_t Count(std::string const& text, std::string_view pattern)
+{
+  size_t count = 0;
+  for (size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + pattern.size()))
+    ++count;
+  return count;
+}
+
+static void TestFindBatches(platform::HeadlessWindow& window, TextBox& textbox)
+{
+  size_t matches = 3 * application::SearchJob::BatchMatches;
+  textbox.SetText(Repeat("ab ", matches));
+
+  size_t found = 0;
+  size_t batches = 0;
+  size_t dones = 0;
+  bool ordered = true;
+  size_t last = 0;
+  window.m_app->Find("ab", {}, [&](std::vector<DocumentRange> const& batch, bool done) {
+    for (DocumentRange const& match : batch)
+    {
+      ordered &= found == 0 || match.offset > last;
+      last = match.offset;
+    }
+    found += batch.size();
+    batches++;
+    dones += done;
+  });
+  Check(RunUntil(window, [&]() { return dones > 0; }), "find completes");
+  Check(found == matches, "find reports every match");
+  Check(batches > 1, "find streams batches");
+  Check(ordered, "find reports matches in order");
+  Check(dones == 1, "find is done once");
+}
+
+static void TestFindCancelsFind(platform::HeadlessWindow& window, TextBox& textbox)
+{
+  textbox.SetText(Repeat("ab ", 100000));
+
+  size_t first_calls = 0;
+  bool second_done = false;
+  size_t second_found = 0;
+  window.m_app->Find("ab", {}, [&](std::vector<DocumentRange> const&, bool) { first_calls++; });
+  window.m_app->Find("b ", {}, [&](std::vector<DocumentRange> const& batch, bool done) {
+    second_found += batch.size();
+    second_done |= done;
+  });
+  Check(RunUntil(window, [&]() { return second_done; }), "second find completes");
+  Check(first_calls == 0, "a cancelled find reports nothing");
+  Check(second_found == 100000, "second find reports every match");
+}
+
+static void TestReplaceAll(platform::HeadlessWindow& window, TextBox& textbox)
+{
+  std::string text = Repeat("a-", 10000);
+  textbox.SetText(text);
+
+  // a find running meanwhile is neither cancelled nor cancels it
+  bool find_done = false;
+  window.m_app->Find("-", {}, [&](std::vector<DocumentRange> const&, bool done) { find_done |= done; });
+
+  int replaced = -1;
+  window.m_app->ReplaceAll("a", {}, "bb", [&](bool ok) { replaced = ok; });
+  window.m_app->CancelFind();
+  window.m_app->Find("-", {}, [&](std::vector<DocumentRange> const&, bool done) { find_done |= done; });
+  Check(RunUntil(window, [&]() { return replaced != -1 && find_done; }), "replace-all and find complete");
+  Check(replaced == 1, "replace-all reports the replace");
+  Check(textbox.GetText() == Repeat("bb-", 10000), "replace-all replaces every match");
+
+  Check(textbox.Undo(), "replace-all can be undone");
+  Check(textbox.GetText() == text, "replace-all is one undo step");
+}
+
+static void TestReplaceAllRacingEdits(platform::HeadlessWindow& window, TextBox& textbox)
+{
+  // an edit during the scan searches the text once more
+  textbox.SetText(Repeat("a-", 10000));
+  textbox.SetCaret(0);
+  int replaced = -1;
+  window.m_app->ReplaceAll("a", {}, "bb", [&](bool ok) { replaced = ok; });
+  textbox.Insert("a");
+  Check(RunUntil(window, [&]() { return replaced != -1; }), "replace-all after an edit completes");
+  Check(replaced == 1, "replace-all after an edit reports the replace");
+  Check(textbox.GetText() == "bb" + Repeat("bb-", 10000), "replace-all after an edit replaces the new text");
+
+  // edits during every scan give up instead of searching forever
+  std::string text = Repeat("a-", 10000);
+  textbox.SetText(text);
+  textbox.SetCaret(0);
+  replaced = -1;
+  window.m_app->ReplaceAll("a", {}, "bb", [&](bool ok) { replaced = ok; });
+  Check(RunUntil(window, [&]() { return replaced != -1; }, [&]() {
+    textbox.Insert("-");
+  }), "replace-all during edits completes");
+  Check(replaced == 0, "replace-all during edits reports the failure");
+  Check(Count(textbox.GetText(), "a") == 10000 && Count(textbox.GetText(), "bb") == 0,
+        "replace-all during edits leaves the text alone");
+
+  // a newer replace-all cancels it, and tells
+  replaced = -1;
+  int newer = -1;
+  window.m_app->ReplaceAll("a", {}, "bb", [&](bool ok) { replaced = ok; });
+  window.m_app->ReplaceAll("a", {}, "c", [&](bool ok) { newer = ok; });
+  Check(replaced == 0, "a cancelled replace-all reports the failure");
+  Check(RunUntil(window, [&]() { return newer != -1; }), "newer replace-all completes");
+  Check(newer == 1 && Count(textbox.GetText(), "c") == 10000, "newer replace-all replaces");
+}
+
+int main()
+{
+  logger::Init();
+
+  platform::HeadlessWindow window(1280, 720);
+  window.Frame();
+  auto textbox = dynamic_cast<TextBox*>(FindId(window.m_app->m_widget, "TextBox"));
+  if (!textbox)
+  {
+    std::printf("failed: no text box\n");
+    return 1;
+  }
+
+  TestFindBatches(window, *textbox);
+  TestFindCancelsFind(window, *textbox);
+  TestReplaceAll(window, *textbox);
+  TestReplaceAllRacingEdits(window, *textbox);
+  return failures ? 1 : 0;
+}
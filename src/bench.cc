@@ -0,0 +1,698 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+#include "logger.hh"
+#include "platform_headless.hh"
+#include "application.hh"
+#include "utf8.hh"
+#include "json/lexer.hh"
+
+// Times the core operations for every size and prints the results as JSON.
+// The groups, each sized by the same n:
+//
+//   - widget trees of n nodes: layout, hit testing, FindId, events, render
+//   - opening a file of n lines
+//   - editing and scrolling a text box of n lines
+//   - colouring its syntax
+//   - wrapping its lines
+//   - searching it for literals
+//   - searching it for regular expressions
+//   - transcoding n bytes of UTF-8 with every instruction set of the CPU
+//
+// Usage:
+//
+//   bench [--sizes 1000,10000,100000,1000000] [--warmup 3] [--reps 30]
+//         [--sample-ms 2] [--seed 1] [--out results.json]
+//
+// Build with optimizations (CMAKE_BUILD_TYPE=Release) for meaningful numbers,
+// the JSON records whether the binary was optimized.
+//
+// Every sample runs a batch of operations sized so a sample takes about
+// --sample-ms, the reported numbers are nanoseconds per operation.
+
+using namespace application::gui;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  struct Options
+  {
+    std::vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+    int warmup = 3;
+    int reps = 30;
+    double sample_ms = 2.0;
+    unsigned seed = 1;
+    char const* out = NULL;
+  };
+
+  struct Result
+  {
+    std::string name;
+    size_t nodes = 0;
+    size_t batch = 0;
+    std::vector<double> samples; // ns per operation
+  };
+
+  double Percentile(std::vector<double> const& sorted, double p)
+  {
+    // nearest rank
+    size_t rank = (size_t) (p / 100.0 * sorted.size() + 0.999999);
+    rank = std::clamp<size_t>(rank, 1, sorted.size());
+    return sorted[rank - 1];
+  }
+
+  // Builds a tree of exactly `budget` widgets under the returned widget
+  struct TreeGenerator
+  {
+    std::mt19937 m_rng;
+    size_t m_count = 0;
+    std::vector<Widget*> m_widgets;
+
+    explicit TreeGenerator(unsigned seed)
+      : m_rng { seed }
+    {}
+
+    Widget* Leaf()
+    {
+      bool button = m_rng() % 2;
+      Widget* w = platform::NewWidget(button ? ButtonType : TextBoxType);
+      std::string text = "item " + std::to_string(m_count);
+      if (button)
+        dynamic_cast<Button*>(w)->SetText(text);
+      else
+        dynamic_cast<TextBox*>(w)->SetText(text);
+      return w;
+    }
+
+    Widget* Make(size_t budget)
+    {
+      m_count++;
+      if (budget == 1)
+      {
+        Widget* w = Leaf();
+        m_widgets.push_back(w);
+        return w;
+      }
+
+      size_t remaining = budget - 1;
+      size_t fanout = std::min<size_t>(remaining, 2 + m_rng() % 7);
+      // split the remaining nodes evenly, the first children take the rest
+      std::vector<size_t> budgets(fanout, remaining / fanout);
+      for (size_t i = 0; i < remaining % fanout; ++i)
+        budgets[i]++;
+
+      Widget* w = NULL;
+      unsigned kind = m_rng() % 16;
+      if (kind == 0 && fanout >= 2)
+      {
+        auto layers = dynamic_cast<Layers*>(platform::NewWidget(LayersType));
+        w = layers;
+        m_widgets.push_back(w);
+        for (size_t i = 0; i < fanout; ++i)
+        {
+          Widget* child = Make(budgets[i]);
+          child->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+          child->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+          layers->SetLayer(i, child);
+        }
+      }
+      else if (kind < 9)
+      {
+        auto container = dynamic_cast<VerticalContainer*>(platform::NewWidget(VerticalContainerType));
+        w = container;
+        m_widgets.push_back(w);
+        for (size_t i = 0; i < fanout; ++i)
+        {
+          Widget* child = Make(budgets[i]);
+          child->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+          child->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0f / fanout));
+          container->PushBack(child);
+        }
+      }
+      else
+      {
+        auto container = dynamic_cast<HorizontalContainer*>(platform::NewWidget(HorizontalContainerType));
+        w = container;
+        m_widgets.push_back(w);
+        for (size_t i = 0; i < fanout; ++i)
+        {
+          Widget* child = Make(budgets[i]);
+          child->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 1.0f / fanout));
+          child->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+          container->PushBack(child);
+        }
+      }
+      return w;
+    }
+  };
+
+  struct Bench
+  {
+    Options m_options;
+    std::vector<Result> m_results;
+
+    // Runs `op` in batches and records the time per call
+    void Measure(char const* name, size_t nodes, std::function<void()> const& op)
+    {
+      for (int i = 0; i < m_options.warmup; ++i)
+        op();
+
+      // size the batch from one timed call
+      auto t0 = Clock::now();
+      op();
+      double one_ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+      size_t batch = std::max<size_t>(1, (size_t) (m_options.sample_ms * 1e6 / std::max(one_ns, 1.0)));
+
+      Result result { name, nodes, batch, {} };
+      for (int r = 0; r < m_options.reps; ++r)
+      {
+        auto start = Clock::now();
+        for (size_t i = 0; i < batch; ++i)
+          op();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        result.samples.push_back(ns / batch);
+      }
+
+      std::vector<double> sorted = result.samples;
+      std::sort(sorted.begin(), sorted.end());
+      fprintf(stderr, "%-22s %8zu nodes  p50 %12.1f ns  p99 %12.1f ns\n",
+        name, nodes, Percentile(sorted, 50), Percentile(sorted, 99));
+      m_results.push_back(std::move(result));
+    }
+
+    void Run(size_t nodes)
+    {
+      platform::HeadlessWindow window(1920, 1080);
+      Application* app = window.m_app;
+
+      // replace the default window content with the synthetic tree
+      auto build_start = Clock::now();
+      TreeGenerator generator(m_options.seed + (unsigned) nodes);
+      Widget* root = generator.Make(nodes);
+      root->SetWidth(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+      root->SetHeight(WidgetSize(WidgetSize::Type::Ratio, 1.0f));
+      double build_ns = std::chrono::duration<double, std::nano>(Clock::now() - build_start).count();
+      m_results.push_back(Result { "build_tree", nodes, 1, { build_ns / nodes } });
+
+      delete app->m_widget;
+      app->m_widget = root;
+
+      // name every widget, FindId looks them up among all of them
+      std::vector<std::string> names;
+      names.reserve(generator.m_widgets.size());
+      for (size_t i = 0; i < generator.m_widgets.size(); ++i)
+      {
+        names.push_back("w" + std::to_string(i));
+        generator.m_widgets[i]->SetId(names.back());
+      }
+
+      std::mt19937 rng { m_options.seed };
+      auto random_x = [&]() { return (int) (rng() % window.m_width); };
+      auto random_y = [&]() { return (int) (rng() % window.m_height); };
+
+      InteractionContext interaction_context;
+      LayoutConstraint constraints[2] = {
+        { .max_width = window.m_width, .max_height = window.m_height },
+        { .max_width = window.m_width * 2 / 3, .max_height = window.m_height * 2 / 3 },
+      };
+      int flip = 0;
+
+      // resizing the window between two sizes changes the constraint of
+      // nearly every widget, unchanged subtrees are still skipped
+      Measure("layout_resize", nodes, [&]() {
+        flip ^= 1;
+        RunLayout(root, constraints[flip], interaction_context);
+      });
+      RunLayout(root, constraints[0], interaction_context);
+
+      Measure("layout_incremental", nodes, [&]() {
+        generator.m_widgets[rng() % generator.m_widgets.size()]->MarkLayoutDirty();
+        RunLayout(root, constraints[0], interaction_context);
+      });
+
+      Measure("layout_clean", nodes, [&]() {
+        RunLayout(root, constraints[0], interaction_context);
+      });
+
+      window.Frame();
+
+      Measure("hit_test_tree", nodes, [&]() {
+        root->HitTest(random_x(), random_y());
+      });
+
+      Measure("hit_test_index", nodes, [&]() {
+        app->m_hit_index.HitTest(random_x(), random_y());
+      });
+
+      Measure("find_id", nodes, [&]() {
+        FindId(names[rng() % names.size()]);
+      });
+
+      Measure("find_id_in_subtree", nodes, [&]() {
+        FindId(root, names[rng() % names.size()]);
+      });
+
+      Measure("process_event_move", nodes, [&]() {
+        window.MouseMove(random_x(), random_y());
+      });
+
+      Measure("process_event_click", nodes, [&]() {
+        int x = random_x();
+        int y = random_y();
+        window.MouseDown(x, y);
+        window.MouseUp(x, y);
+      });
+
+      Measure("render", nodes, [&]() {
+        window.Frame();
+      });
+    }
+
+    // The text box of the default window holding `lines` lines, the cost
+    // of drawing it must not depend on the size of the text
+    void RunText(size_t lines)
+    {
+      platform::HeadlessWindow window(1920, 1080);
+      TextBox* text_box = dynamic_cast<TextBox*>(FindId("TextBox"));
+      if (!text_box)
+        return;
+
+      std::string text;
+      text.reserve(lines * 81);
+      for (size_t i = 0; i < lines; ++i)
+      {
+        text.append(80, 'a' + i % 26);
+        text.push_back('\n');
+      }
+      text_box->SetText(std::move(text));
+      window.Frame();
+
+      std::mt19937 rng { m_options.seed };
+
+      Measure("text_scroll", lines, [&]() {
+        text_box->ScrollBy((long long) (rng() % lines) - (long long) text_box->m_scroll_line);
+        text_box->GetVisibleText();
+      });
+
+      Measure("text_type", lines, [&]() {
+        text_box->SetCaret(text_box->GetDocument().LineOffset(rng() % lines));
+        text_box->Insert("x");
+        text_box->ScrollToCaret();
+        text_box->GetVisibleText();
+      });
+
+      // a frame of fast typing, the characters go in as one edit
+      window.m_app->m_interaction_context.active = text_box;
+      Measure("text_burst", lines, [&]() {
+        for (int i = 0; i < 64; ++i)
+          window.Char('a' + i % 26);
+        window.Frame();
+      });
+
+      std::string paste(64 * 1024, 'p');
+      for (size_t i = 80; i < paste.size(); i += 81)
+        paste[i] = '\n';
+      Measure("text_paste", lines, [&]() {
+        text_box->SetCaret(text_box->GetDocument().LineOffset(rng() % lines));
+        window.Text(paste);
+        window.Frame();
+      });
+    }
+
+    // A JSON text box of `lines` lines, the lexer states are cached per line
+    // so an edit re-lexes the lines on screen and not the whole text
+    void RunSyntax(size_t lines)
+    {
+      platform::HeadlessWindow window(1920, 1080);
+      TextBox* text_box = dynamic_cast<TextBox*>(FindId("TextBox"));
+      if (!text_box)
+        return;
+
+      std::string text = "[\n";
+      text.reserve(lines * 64);
+      for (size_t i = 0; i < lines; ++i)
+        text += "  { \"id\": " + std::to_string(i) + ", \"name\": \"item\", \"tags\": [true, null] }, // entry\n";
+      text += "]\n";
+      text_box->SetText(std::move(text));
+      text_box->SetLexer(std::make_shared<json::Lexer>());
+      window.Frame();
+
+      std::mt19937 rng { m_options.seed };
+      std::vector<application::TokenSpan> spans;
+      auto draw = [&]() {
+        spans.clear();
+        text_box->GetVisibleSpans(text_box->GetVisibleText(), spans);
+      };
+
+      Measure("syntax_scroll", lines, [&]() {
+        text_box->ScrollBy((long long) (rng() % lines) - (long long) text_box->m_scroll_line);
+        draw();
+      });
+
+      Measure("syntax_type", lines, [&]() {
+        text_box->SetCaret(text_box->GetDocument().LineOffset(rng() % lines));
+        text_box->Insert("x");
+        text_box->ScrollToCaret();
+        draw();
+      });
+
+      // changes the state of every line after it until it is undone
+      Measure("syntax_comment", lines, [&]() {
+        text_box->SetCaret(text_box->GetDocument().LineOffset(rng() % lines));
+        text_box->Insert("/*");
+        text_box->ScrollToCaret();
+        draw();
+        text_box->m_editor.Undo();
+        draw();
+      });
+    }
+
+    // A text box wrapping `lines` lines of two to three rows each: the rows
+    // are kept per line, so resizing, scrolling and typing only wrap the
+    // lines on screen and the background job does the others
+    void RunWrap(size_t lines)
+    {
+      platform::HeadlessWindow window(1920, 1080);
+      TextBox* text_box = dynamic_cast<TextBox*>(FindId("TextBox"));
+      if (!text_box)
+        return;
+
+      std::string text;
+      text.reserve(lines * 321);
+      for (size_t i = 0; i < lines; ++i)
+      {
+        for (size_t word = 0; word < 40; ++word)
+          text.append(7, 'a' + (i + word) % 26).push_back(' ');
+        text.push_back('\n');
+      }
+      text_box->SetText(std::move(text));
+      text_box->SetWrap(true);
+      window.Frame();
+
+      std::mt19937 rng { m_options.seed };
+      size_t visible = text_box->GetVisibleLineCount();
+
+      int width = 1920;
+      Measure("wrap_resize", lines, [&]() {
+        width = width == 1920 ? 1900 : 1920;
+        window.Resize(width, 1080);
+        window.Frame();
+      });
+
+      Measure("wrap_scroll", lines, [&]() {
+        text_box->ScrollBy((long long) (rng() % (2 * visible)) - (long long) visible);
+        text_box->GetVisibleText();
+      });
+
+      Measure("wrap_jump", lines, [&]() {
+        text_box->ScrollBy((long long) (rng() % (2 * lines)) - (long long) lines);
+        text_box->GetVisibleText();
+      });
+
+      Measure("wrap_type", lines, [&]() {
+        text_box->SetCaret(text_box->GetDocument().LineOffset(rng() % lines));
+        text_box->Insert("x");
+        text_box->ScrollToCaret();
+        text_box->GetVisibleText();
+      });
+    }
+
+    // Opens a file of `lines` lines: the frame that starts the open, which
+    // shouldn't depend on the size of the file, the frames until its start
+    // shows and until the whole of it does
+    void RunOpen(size_t lines)
+    {
+      platform::HeadlessWindow window(1920, 1080);
+      TextBox* text_box = dynamic_cast<TextBox*>(FindId("TextBox"));
+      if (!text_box)
+        return;
+
+      std::string filename = (std::filesystem::temp_directory_path() / "bench_open.txt").string();
+      {
+        std::ofstream file(filename, std::ios::binary);
+        std::string line(80, 'a');
+        line.push_back('\n');
+        for (size_t i = 0; i < lines; ++i)
+          file << line;
+      }
+
+      Application& app = *window.m_app;
+      Measure("open_frame", lines, [&]() {
+        app.OpenFile(filename);
+        window.Frame();
+      });
+
+      Measure("open_first_screen", lines, [&]() {
+        text_box->SetText("");
+        app.OpenFile(filename);
+        while (text_box->GetDocument().Empty())
+          window.Frame();
+      });
+
+      Measure("open_whole", lines, [&]() {
+        app.OpenFile(filename);
+        while (app.m_load)
+          window.Frame();
+      });
+
+      app.CancelOpen();
+      std::filesystem::remove(filename);
+    }
+
+    // A log of `lines` lines edited in many places, with an error every
+    // hundred lines
+    application::Document MakeLog(size_t lines)
+    {
+      std::mt19937 rng { m_options.seed };
+      std::string text;
+      text.reserve(lines * 64);
+      for (size_t i = 0; i < lines; ++i)
+      {
+        text += i % 100 == 0 ? "2024-01-01 ERROR connection reset by peer\n" : "2024-01-01 INFO request served in 12ms\n";
+      }
+
+      application::Document document(text);
+      for (size_t i = 0; i < lines / 100; ++i)
+        document.Insert(rng() % document.Size(), "INFO ");
+      return document;
+    }
+
+    // Literal searches of the errors of MakeLog. std::string::find over a
+    // flat copy is the baseline.
+    void RunSearch(size_t lines)
+    {
+      application::Document document = MakeLog(lines);
+      std::string flat = document.Text();
+      application::DocumentSnapshot snapshot = document.Snapshot();
+
+      size_t found = 0;
+      application::LiteralMatcher matcher("connection reset");
+      Measure("search_literal", lines, [&]() {
+        application::FindAll(snapshot, matcher, [&](application::DocumentRange) { found++; return true; });
+      });
+
+      application::LiteralMatcher folded("CONNECTION RESET", { .case_insensitive = true });
+      Measure("search_literal_nocase", lines, [&]() {
+        application::FindAll(snapshot, folded, [&](application::DocumentRange) { found++; return true; });
+      });
+
+      Measure("search_std_find", lines, [&]() {
+        for (size_t i = flat.find("connection reset"); i != std::string::npos; i = flat.find("connection reset", i + 16))
+          found++;
+      });
+
+      std::vector<application::DocumentRange> matches;
+      application::FindAll(snapshot, matcher, [&](application::DocumentRange r) { matches.push_back(r); return true; });
+      Measure("replace_all", lines, [&]() {
+        application::DocumentEditor editor;
+        editor.m_document = document;
+        editor.Replace(matches, "timeout");
+      });
+    }
+
+    // Regex searches of the errors of MakeLog, std::regex_search over a
+    // flat copy is the baseline. It is left out past 100000 lines, where a
+    // single search takes seconds.
+    void RunRegex(size_t lines)
+    {
+      application::Document document = MakeLog(lines);
+      application::DocumentSnapshot snapshot = document.Snapshot();
+      size_t found = 0;
+      auto measure = [&](char const* name, char const* pattern, application::RegexOptions options = {}) {
+        application::Regex regex(pattern, options);
+        Measure(name, lines, [&]() {
+          application::FindAll(snapshot, regex, [&](application::DocumentRange) { found++; return true; });
+        });
+      };
+
+      measure("regex_literal", "connection reset");
+      measure("regex_class", "ERROR [a-z ]+ by \\w+$");
+      measure("regex_alternation", "(?:timeout|reset|refused) by (?:peer|host)");
+      measure("regex_nocase", "^\\d+-\\d+-\\d+ error", { .case_insensitive = true });
+      // a cache too small for any state, every search runs the NFA
+      measure("regex_nfa", "ERROR [a-z ]+ by \\w+$", { .max_cache_bytes = 1 });
+
+      if (lines > 100000)
+        return;
+      std::string flat = document.Text();
+      std::regex regex("ERROR [a-z ]+ by \\w+$", std::regex::ECMAScript | std::regex::multiline);
+      Measure("regex_std", lines, [&]() {
+        for (std::sregex_iterator it(flat.begin(), flat.end(), regex), end; it != end; ++it)
+          found++;
+      });
+    }
+
+    // `bytes` of ASCII and of mixed text, the mixed one has 1 to 4 bytes
+    // characters
+    void RunUtf8(size_t bytes)
+    {
+      static char const* const Mixed[] = { "text ", "caf\xc3\xa9 ", "\xe6\x96\x87\xe5\xad\x97 ", "\xf0\x9f\x98\x80 " };
+      std::mt19937 rng { m_options.seed };
+
+      std::string ascii;
+      std::string mixed;
+      while (ascii.size() < bytes)
+        ascii.push_back('a' + rng() % 26);
+      while (mixed.size() < bytes)
+        mixed += Mixed[rng() % 4];
+
+      static char const* const IsaNames[] = { "scalar", "sse2", "avx2" };
+      std::u16string out(bytes + 4, u'\0');
+      for (int isa = 0; isa <= (int) utf8::DetectedIsa(); ++isa)
+      {
+        utf8::LimitIsa((utf8::Isa) isa);
+        std::string suffix = std::string("_") + IsaNames[isa];
+        for (std::string const* text : { &ascii, &mixed })
+        {
+          std::string kind = text == &ascii ? "_ascii" : "_mixed";
+          std::u16string utf16 = utf8::ToUtf16(*text);
+
+          Measure(("utf8_validate" + kind + suffix).c_str(), bytes, [&]() {
+            utf8::Validate(*text);
+          });
+          Measure(("utf8_count" + kind + suffix).c_str(), bytes, [&]() {
+            utf8::CountCodepoints(*text);
+          });
+          Measure(("utf8_to_utf16" + kind + suffix).c_str(), bytes, [&]() {
+            utf8::ToUtf16(*text, out.data());
+          });
+          Measure(("utf8_from_utf16" + kind + suffix).c_str(), bytes, [&]() {
+            utf8::FromUtf16(utf16);
+          });
+        }
+      }
+      utf8::LimitIsa(utf8::DetectedIsa());
+    }
+
+    void Write(FILE* f)
+    {
+#ifdef __OPTIMIZE__
+      bool optimized = true;
+#else
+      bool optimized = false;
+#endif
+      fprintf(f, "{\n  \"unit\": \"ns\",\n  \"optimized\": %s,\n  \"seed\": %u,\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"benchmarks\": [",
+        optimized ? "true" : "false", m_options.seed, m_options.warmup, m_options.reps);
+      for (size_t i = 0; i < m_results.size(); ++i)
+      {
+        Result const& r = m_results[i];
+        std::vector<double> sorted = r.samples;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0;
+        for (double s : sorted) mean += s;
+        mean /= sorted.size();
+
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"nodes\": %zu, \"batch\": %zu, \"samples\": %zu, "
+          "\"mean\": %.1f, \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+          i ? "," : "",
+          r.name.c_str(), r.nodes, r.batch, sorted.size(),
+          mean, sorted.front(), Percentile(sorted, 50), Percentile(sorted, 90), Percentile(sorted, 99), sorted.back());
+      }
+      fprintf(f, "\n  ]\n}\n");
+    }
+  };
+
+  bool ParseOptions(int argc, char** argv, Options& options)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      char const* arg = argv[i];
+      char const* value = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!value)
+        return false;
+
+      if (std::strcmp(arg, "--sizes") == 0)
+      {
+        options.sizes.clear();
+        for (char const* p = value; *p; )
+        {
+          char* end;
+          size_t n = std::strtoull(p, &end, 10);
+          if (end == p || n == 0)
+            return false;
+          options.sizes.push_back(n);
+          p = *end == ',' ? end + 1 : end;
+        }
+      }
+      else if (std::strcmp(arg, "--warmup") == 0)
+        options.warmup = std::atoi(value);
+      else if (std::strcmp(arg, "--reps") == 0)
+        options.reps = std::max(1, std::atoi(value));
+      else if (std::strcmp(arg, "--sample-ms") == 0)
+        options.sample_ms = std::atof(value);
+      else if (std::strcmp(arg, "--seed") == 0)
+        options.seed = std::strtoul(value, NULL, 10);
+      else if (std::strcmp(arg, "--out") == 0)
+        options.out = value;
+      else
+        return false;
+      ++i;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  logger::Init();
+
+  Bench bench;
+  if (!ParseOptions(argc, argv, bench.m_options))
+  {
+    fprintf(stderr, "usage: bench [--sizes n,n,...] [--warmup n] [--reps n] [--sample-ms ms] [--seed n] [--out file]\n");
+    return 1;
+  }
+
+  for (size_t nodes : bench.m_options.sizes)
+  {
+    bench.Run(nodes);
+    bench.RunOpen(nodes);
+    bench.RunText(nodes);
+    bench.RunSyntax(nodes);
+    bench.RunWrap(nodes);
+    bench.RunSearch(nodes);
+    bench.RunRegex(nodes);
+    bench.RunUtf8(nodes);
+  }
+
+  FILE* f = bench.m_options.out ? fopen(bench.m_options.out, "w") : stdout;
+  if (!f)
+  {
+    fprintf(stderr, "can't open %s\n", bench.m_options.out);
+    return 1;
+  }
+  bench.Write(f);
+  if (f != stdout)
+    fclose(f);
+  return 0;
+}
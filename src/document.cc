@@ -0,0 +1,1281 @@
+#include "document.hh"
+#include "utf8.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace application
+{
+  namespace
+  {
+    uint32_t NextPriority()
+    {
+      // xorshift32, the treap only needs the priorities to look random
+      thread_local uint32_t state = 0x9e3779b9u;
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return state;
+    }
+
+    size_t LengthOf(DocumentNodePtr const& n)
+    {
+      return n ? n->subtree_length : 0;
+    }
+
+    size_t PiecesOf(DocumentNodePtr const& n)
+    {
+      return n ? n->subtree_pieces : 0;
+    }
+
+    size_t NewlinesOf(DocumentNodePtr const& n)
+    {
+      return n ? n->subtree_newlines : 0;
+    }
+
+    struct Piece
+    {
+      DocumentBuffer const* buffer;
+      char const* data;
+      size_t length;
+      size_t newlines;
+    };
+
+    Piece PieceOf(DocumentNode const& n)
+    {
+      return { n.buffer, n.data, n.length, n.newlines };
+    }
+
+    DocumentNodePtr MakeNode(Piece const& piece, uint32_t priority, DocumentNodePtr left, DocumentNodePtr right)
+    {
+      auto n = std::make_shared<DocumentNode>();
+      n->buffer = piece.buffer;
+      n->data = piece.data;
+      n->length = piece.length;
+      n->newlines = piece.newlines;
+      n->priority = priority;
+      n->subtree_length = LengthOf(left) + piece.length + LengthOf(right);
+      n->subtree_pieces = PiecesOf(left) + 1 + PiecesOf(right);
+      n->subtree_newlines = NewlinesOf(left) + piece.newlines + NewlinesOf(right);
+      n->left = std::move(left);
+      n->right = std::move(right);
+      return n;
+    }
+
+    DocumentNodePtr Merge(DocumentNodePtr const& a, DocumentNodePtr const& b)
+    {
+      if (!a) return b;
+      if (!b) return a;
+
+      if (a->priority > b->priority)
+        return MakeNode(PieceOf(*a), a->priority, a->left, Merge(a->right, b));
+      return MakeNode(PieceOf(*b), b->priority, Merge(a, b->left), b->right);
+    }
+
+    // Splits `t` into the first `offset` bytes and the rest, a piece
+    // straddling the offset is cut in two
+    std::pair<DocumentNodePtr, DocumentNodePtr> Split(DocumentNodePtr const& t, size_t offset)
+    {
+      if (!t) return { NULL, NULL };
+
+      size_t left_length = LengthOf(t->left);
+      if (offset <= left_length)
+      {
+        auto [l, r] = Split(t->left, offset);
+        return { l, MakeNode(PieceOf(*t), t->priority, r, t->right) };
+      }
+
+      offset -= left_length;
+      if (offset >= t->length)
+      {
+        auto [l, r] = Split(t->right, offset - t->length);
+        return { MakeNode(PieceOf(*t), t->priority, t->left, l), r };
+      }
+
+      Piece head = { t->buffer, t->data, offset, t->buffer->Newlines(t->data, t->data + offset) };
+      Piece tail = { t->buffer, t->data + offset, t->length - offset, t->newlines - head.newlines };
+      // the tail gets a priority of its own, pieces cut over and over from
+      // the same one would otherwise all share it and pile up in a list
+      return {
+        MakeNode(head, t->priority, t->left, NULL),
+        Merge(MakeNode(tail, NextPriority(), NULL, NULL), t->right)
+      };
+    }
+
+    template<typename Fn>
+    void ForEachPiece(DocumentNode const* n, Fn const& fn)
+    {
+      while (n)
+      {
+        ForEachPiece(n->left.get(), fn);
+        fn(PieceOf(*n));
+        n = n->right.get();
+      }
+    }
+
+    // Balanced tree over [begin, end), each level gets priorities below
+    // those of the level above so that it is a valid treap
+    DocumentNodePtr Build(std::vector<Piece> const& pieces, size_t begin, size_t end, unsigned depth)
+    {
+      if (begin == end)
+        return NULL;
+
+      constexpr unsigned LevelBits = 26;
+      uint32_t priority = UINT32_MAX - (depth << LevelBits) - (NextPriority() & ((1u << LevelBits) - 1));
+      size_t middle = begin + (end - begin) / 2;
+      DocumentNodePtr left = Build(pieces, begin, middle, depth + 1);
+      DocumentNodePtr right = Build(pieces, middle + 1, end, depth + 1);
+      return MakeNode(pieces[middle], priority, std::move(left), std::move(right));
+    }
+
+    DocumentNode const* Rightmost(DocumentNodePtr const& t)
+    {
+      DocumentNode const* n = t.get();
+      while (n && n->right)
+        n = n->right.get();
+      return n;
+    }
+
+    bool IsContinuation(char c)
+    {
+      return (c & 0b11000000) == 0b10000000;
+    }
+
+    size_t CountCodepoints(DocumentSnapshot const& document, size_t from, size_t to)
+    {
+      size_t n = 0;
+      DocumentChunkIterator it = document.Chunks(from, to);
+      std::string_view chunk;
+      while (it.Next(chunk))
+        n += utf8::CountCodepoints(chunk);
+      return n;
+    }
+
+    // Offset of the codepoint `n` codepoints after `from`, stopping at the
+    // end of the line
+    size_t AdvanceCodepoints(DocumentSnapshot const& document, size_t from, size_t n)
+    {
+      size_t offset = from;
+      DocumentChunkIterator it = document.Chunks(from);
+      std::string_view chunk;
+      while (it.Next(chunk))
+      {
+        for (char c : chunk)
+        {
+          if (c == '\n')
+            return offset;
+          if (!IsContinuation(c) && n-- == 0)
+            return offset;
+          offset++;
+        }
+      }
+      return offset;
+    }
+
+    // Grows the last piece of `t` by `length` bytes holding `newlines`
+    DocumentNodePtr ExtendRightmost(DocumentNodePtr const& t, size_t length, size_t newlines)
+    {
+      if (!t->right)
+      {
+        Piece piece = PieceOf(*t);
+        piece.length += length;
+        piece.newlines += newlines;
+        return MakeNode(piece, t->priority, t->left, NULL);
+      }
+      return MakeNode(PieceOf(*t), t->priority, t->left, ExtendRightmost(t->right, length, newlines));
+    }
+  }
+
+  size_t CountNewlines(char const* data, size_t length)
+  {
+    size_t n = 0;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i const newline = _mm_set1_epi8('\n');
+    while (i + 16 <= length)
+    {
+      // matches are 0xff, subtracting them counts per byte lane, which
+      // holds 255 of them before they are summed up
+      __m128i counts = _mm_setzero_si128();
+      size_t end = std::min(length & ~(size_t) 15, i + 255 * 16);
+      for (; i < end; i += 16)
+      {
+        __m128i bytes = _mm_loadu_si128((__m128i const*) (data + i));
+        counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(bytes, newline));
+      }
+      __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+      n += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+    }
+#endif
+    for (; i < length; ++i)
+      n += data[i] == '\n';
+    return n;
+  }
+
+  char const* DocumentBuffer::Write(std::string_view text)
+  {
+    char* out = m_bytes.data() + m_size;
+    std::memcpy(out, text.data(), text.size());
+
+    // counted block by block so that every started block has its prefix
+    size_t offset = m_size;
+    size_t end = m_size + text.size();
+    while (offset < end)
+    {
+      size_t block_end = std::min(end, (offset / BlockSize + 1) * BlockSize);
+      m_newlines += CountNewlines(m_bytes.data() + offset, block_end - offset);
+      if (block_end % BlockSize == 0)
+        m_block_newlines.push_back(m_newlines);
+      offset = block_end;
+    }
+    m_size = end;
+    return out;
+  }
+
+  size_t DocumentBuffer::NewlinesBefore(size_t offset) const
+  {
+    size_t block = offset / BlockSize;
+    return m_block_newlines[block] + CountNewlines(Data() + block * BlockSize, offset - block * BlockSize);
+  }
+
+  size_t DocumentBuffer::Newlines(char const* begin, char const* end) const
+  {
+    // short pieces are cheaper to count directly
+    if (end - begin <= (ptrdiff_t) BlockSize)
+      return CountNewlines(begin, end - begin);
+    return NewlinesBefore(end - Data()) - NewlinesBefore(begin - Data());
+  }
+
+  size_t DocumentBuffer::FindNewline(size_t n) const
+  {
+    // the last block with fewer than n newlines before it holds the newline
+    size_t block = std::lower_bound(m_block_newlines.begin(), m_block_newlines.end(), n) - m_block_newlines.begin() - 1;
+    size_t left = n - m_block_newlines[block];
+    char const* p = Data() + block * BlockSize;
+    char const* end = Data() + m_size;
+    for (;;)
+    {
+      p = (char const*) std::memchr(p, '\n', end - p);
+      if (--left == 0)
+        return p - Data();
+      p++;
+    }
+  }
+
+  void DocumentBuffer::IndexWritten(size_t size)
+  {
+    // the last block counted may have been partial, it is counted again
+    size_t first = m_size / BlockSize;
+    size_t blocks = size / BlockSize;
+    m_newlines = m_block_newlines[first];
+    m_block_newlines.resize(blocks + 1);
+    for (size_t i = first; i < blocks; ++i)
+    {
+      m_newlines += CountNewlines(Data() + i * BlockSize, BlockSize);
+      m_block_newlines[i + 1] = m_newlines;
+    }
+    m_newlines += CountNewlines(Data() + blocks * BlockSize, size - blocks * BlockSize);
+    m_size = size;
+  }
+
+  DocumentBuffer* DocumentStorage::SetOriginal(std::string text)
+  {
+    DocumentBuffer& buffer = m_buffers.emplace_back();
+    buffer.m_bytes = std::move(text);
+    buffer.m_data = buffer.m_bytes.data();
+    buffer.IndexWritten(buffer.m_bytes.size());
+    return &buffer;
+  }
+
+  DocumentBuffer* DocumentStorage::SetOriginal(std::shared_ptr<const void> owner, std::string_view text, std::function<bool(size_t)> const& progress)
+  {
+    DocumentBuffer& buffer = m_buffers.emplace_back();
+    buffer.m_owner = std::move(owner);
+    buffer.m_data = text.data();
+    if (!progress)
+    {
+      buffer.IndexWritten(text.size());
+      return &buffer;
+    }
+
+    for (size_t indexed = 0; indexed < text.size(); )
+    {
+      indexed = std::min(text.size(), indexed + IndexSection);
+      buffer.IndexWritten(indexed);
+      if (!progress(indexed))
+      {
+        m_buffers.pop_back();
+        return NULL;
+      }
+    }
+    return &buffer;
+  }
+
+  char const* DocumentStorage::NextWrite(size_t length)
+  {
+    if (!m_current || length > m_current->Left())
+      return NULL;
+    return m_current->Data() + m_current->m_size;
+  }
+
+  char const* DocumentStorage::Append(std::string_view text, DocumentBuffer** buffer)
+  {
+    if (!m_current || text.size() > m_current->Left())
+    {
+      m_current = &m_buffers.emplace_back();
+      m_current->m_bytes.resize(std::max(ChunkSize, text.size()));
+      m_current->m_data = m_current->m_bytes.data();
+    }
+
+    *buffer = m_current;
+    return m_current->Write(text);
+  }
+
+  bool DocumentChunkIterator::Next(std::string_view& chunk)
+  {
+    if (m_stack.empty() || m_left == 0)
+      return false;
+
+    DocumentNode const* n = m_stack.back();
+    m_stack.pop_back();
+
+    size_t length = std::min(n->length - m_skip, m_left);
+    chunk = std::string_view(n->data + m_skip, length);
+    m_skip = 0;
+    m_left -= length;
+
+    for (DocumentNode const* c = n->right.get(); c; c = c->left.get())
+      m_stack.push_back(c);
+    return true;
+  }
+
+  size_t DocumentSnapshot::Size() const
+  {
+    return LengthOf(m_root);
+  }
+
+  size_t DocumentSnapshot::PieceCount() const
+  {
+    return PiecesOf(m_root);
+  }
+
+  bool DocumentSnapshot::Empty() const
+  {
+    return Size() == 0;
+  }
+
+  DocumentChunkIterator DocumentSnapshot::Chunks(size_t from, size_t to) const
+  {
+    DocumentChunkIterator it;
+    it.m_root = m_root;
+    it.m_storage = m_storage;
+
+    to = std::min(to, Size());
+    if (from >= to)
+      return it;
+    it.m_left = to - from;
+
+    DocumentNode const* n = m_root.get();
+    while (n)
+    {
+      size_t left_length = LengthOf(n->left);
+      if (from < left_length)
+      {
+        it.m_stack.push_back(n);
+        n = n->left.get();
+      }
+      else if (from < left_length + n->length)
+      {
+        it.m_stack.push_back(n);
+        it.m_skip = from - left_length;
+        break;
+      }
+      else
+      {
+        from -= left_length + n->length;
+        n = n->right.get();
+      }
+    }
+    return it;
+  }
+
+  char DocumentSnapshot::At(size_t offset) const
+  {
+    if (offset >= Size())
+      throw std::out_of_range("Document offset out of range");
+
+    DocumentNode const* n = m_root.get();
+    for (;;)
+    {
+      size_t left_length = LengthOf(n->left);
+      if (offset < left_length)
+      {
+        n = n->left.get();
+      }
+      else if (offset < left_length + n->length)
+      {
+        return n->data[offset - left_length];
+      }
+      else
+      {
+        offset -= left_length + n->length;
+        n = n->right.get();
+      }
+    }
+  }
+
+  std::string DocumentSnapshot::Substr(size_t offset, size_t length) const
+  {
+    std::string out;
+    if (offset >= Size())
+      return out;
+    out.reserve(std::min(length, Size() - offset));
+
+    DocumentChunkIterator it = Chunks(offset, length > SIZE_MAX - offset ? SIZE_MAX : offset + length);
+    std::string_view chunk;
+    while (it.Next(chunk))
+      out.append(chunk);
+    return out;
+  }
+
+  std::string DocumentSnapshot::Text() const
+  {
+    return Substr(0, Size());
+  }
+
+  size_t DocumentSnapshot::LineCount() const
+  {
+    return NewlinesOf(m_root) + 1;
+  }
+
+  size_t DocumentSnapshot::LineOf(size_t offset) const
+  {
+    size_t line = 0;
+    DocumentNode const* n = m_root.get();
+    while (n)
+    {
+      size_t left_length = LengthOf(n->left);
+      if (offset < left_length)
+      {
+        n = n->left.get();
+      }
+      else if (offset < left_length + n->length)
+      {
+        offset -= left_length;
+        return line + NewlinesOf(n->left) + n->buffer->Newlines(n->data, n->data + offset);
+      }
+      else
+      {
+        offset -= left_length + n->length;
+        line += NewlinesOf(n->left) + n->newlines;
+        n = n->right.get();
+      }
+    }
+    return line;
+  }
+
+  size_t DocumentSnapshot::LineOffset(size_t line) const
+  {
+    if (line == 0)
+      return 0;
+    if (line > NewlinesOf(m_root))
+      return Size();
+
+    // the line starts after its `line`th newline
+    size_t offset = 0;
+    DocumentNode const* n = m_root.get();
+    for (;;)
+    {
+      size_t left_newlines = NewlinesOf(n->left);
+      if (line <= left_newlines)
+      {
+        n = n->left.get();
+      }
+      else if (line <= left_newlines + n->newlines)
+      {
+        line -= left_newlines;
+        size_t piece_start = n->data - n->buffer->Data();
+        size_t newline = n->buffer->FindNewline(n->buffer->NewlinesBefore(piece_start) + line);
+        return offset + LengthOf(n->left) + newline - piece_start + 1;
+      }
+      else
+      {
+        line -= left_newlines + n->newlines;
+        offset += LengthOf(n->left) + n->length;
+        n = n->right.get();
+      }
+    }
+  }
+
+  size_t DocumentSnapshot::LineStart(size_t offset) const
+  {
+    return LineOffset(LineOf(offset));
+  }
+
+  size_t DocumentSnapshot::LineEnd(size_t offset) const
+  {
+    size_t line = LineOf(offset);
+    if (line == NewlinesOf(m_root))
+      return Size();
+    return LineOffset(line + 1) - 1;
+  }
+
+  Document::Document()
+  {
+    m_storage = std::make_shared<DocumentStorage>();
+  }
+
+  Document::Document(std::string text)
+  {
+    SetText(std::move(text));
+  }
+
+  void Document::SetText(std::string text)
+  {
+    // snapshots keep the previous storage alive
+    m_storage = std::make_shared<DocumentStorage>();
+    m_root = NULL;
+    if (text.empty())
+      return;
+
+    DocumentBuffer* original = m_storage->SetOriginal(std::move(text));
+    m_root = MakeNode({ original, original->Data(), original->m_size, original->m_newlines }, NextPriority(), NULL, NULL);
+  }
+
+  bool Document::SetText(std::shared_ptr<const void> owner, std::string_view text, std::function<bool(size_t)> const& progress)
+  {
+    m_storage = std::make_shared<DocumentStorage>();
+    m_root = NULL;
+    if (text.empty())
+      return true;
+
+    DocumentBuffer* original = m_storage->SetOriginal(std::move(owner), text, progress);
+    if (!original)
+      return false;
+    m_root = MakeNode({ original, original->Data(), original->m_size, original->m_newlines }, NextPriority(), NULL, NULL);
+    return true;
+  }
+
+  void Document::Clear()
+  {
+    SetText({});
+  }
+
+  void Document::Insert(size_t offset, std::string_view text)
+  {
+    if (offset > Size())
+      throw std::out_of_range("Document offset out of range");
+    if (text.empty())
+      return;
+
+    // typing appends right after the previous insertion, the piece ending
+    // there grows instead of a new one being added
+    char const* write = m_storage->NextWrite(text.size());
+    DocumentBuffer* buffer;
+    char const* data = m_storage->Append(text, &buffer);
+    size_t newlines = buffer->Newlines(data, data + text.size());
+
+    auto [left, right] = Split(m_root, offset);
+    DocumentNode const* last = Rightmost(left);
+    if (write && last && last->data + last->length == write)
+      left = ExtendRightmost(left, text.size(), newlines);
+    else
+      left = Merge(left, MakeNode({ buffer, data, text.size(), newlines }, NextPriority(), NULL, NULL));
+
+    m_root = Merge(left, right);
+  }
+
+  void Document::Erase(size_t offset, size_t length)
+  {
+    if (offset > Size())
+      throw std::out_of_range("Document offset out of range");
+    length = std::min(length, Size() - offset);
+    if (length == 0)
+      return;
+
+    auto [left, rest] = Split(m_root, offset);
+    auto [erased, right] = Split(rest, length);
+    m_root = Merge(left, right);
+  }
+
+  void Document::Replace(std::vector<DocumentRange> const& ranges, std::string_view text)
+  {
+    if (ranges.empty())
+      return;
+    if (ranges.back().offset > Size())
+      throw std::out_of_range("Document offset out of range");
+
+    Piece replacement = {};
+    if (!text.empty())
+    {
+      DocumentBuffer* buffer;
+      char const* data = m_storage->Append(text, &buffer);
+      replacement = { buffer, data, text.size(), buffer->Newlines(data, data + text.size()) };
+    }
+
+    std::vector<Piece> pieces;
+    pieces.reserve(PieceCount() + 2 * ranges.size());
+    auto keep = [&](Piece const& piece, size_t from, size_t to) {
+      if (from == to)
+        return;
+      if (from == 0 && to == piece.length)
+        return pieces.push_back(piece);
+      char const* data = piece.data + from;
+      pieces.push_back({ piece.buffer, data, to - from, piece.buffer->Newlines(data, piece.data + to) });
+    };
+
+    // `offset` is where the piece starts, the current range is replaced
+    // once its start is reached and skipped up to its end
+    size_t offset = 0;
+    size_t range = 0;
+    ForEachPiece(m_root.get(), [&](Piece const& piece) {
+      size_t from = 0;
+      while (range < ranges.size() && ranges[range].offset < offset + piece.length)
+      {
+        DocumentRange const& r = ranges[range];
+        if (r.offset >= offset + from)
+        {
+          keep(piece, from, r.offset - offset);
+          if (replacement.length)
+            pieces.push_back(replacement);
+        }
+
+        size_t end = r.offset + r.length;
+        if (end > offset + piece.length)
+        {
+          from = piece.length;
+          break;
+        }
+        from = std::max(from, end - offset);
+        range++;
+      }
+      keep(piece, from, piece.length);
+      offset += piece.length;
+    });
+
+    // empty ranges at the very end
+    if (range < ranges.size() && replacement.length)
+      pieces.push_back(replacement);
+
+    m_root = Build(pieces, 0, pieces.size(), 0);
+  }
+
+  DocumentSnapshot Document::Snapshot() const
+  {
+    return DocumentSnapshot { m_root, m_storage };
+  }
+
+  size_t DocumentEditor::Size() const
+  {
+    return m_document.Size() - (m_end - m_start) + m_before.size() + m_after.size();
+  }
+
+  size_t DocumentEditor::Caret() const
+  {
+    return m_start + m_before.size();
+  }
+
+  bool DocumentEditor::HasSelection() const
+  {
+    return m_anchor != Caret();
+  }
+
+  void DocumentEditor::Selection(size_t& start, size_t& end) const
+  {
+    start = std::min(m_anchor, Caret());
+    end = std::max(m_anchor, Caret());
+  }
+
+  void DocumentEditor::Read(size_t from, std::function<bool(std::string_view)> const& fn) const
+  {
+    std::string_view chunk;
+    DocumentChunkIterator before = m_document.Chunks(from, m_start);
+    while (before.Next(chunk))
+    {
+      if (!fn(chunk))
+        return;
+    }
+
+    size_t gap = m_before.size() + m_after.size();
+    size_t skip = from > m_start ? from - m_start : 0;
+    if (skip < m_before.size() && !fn(std::string_view(m_before).substr(skip)))
+      return;
+    if (skip < gap && !m_after.empty())
+    {
+      std::string after(m_after.rbegin(), m_after.rend());
+      if (!fn(std::string_view(after).substr(skip > m_before.size() ? skip - m_before.size() : 0)))
+        return;
+    }
+
+    DocumentChunkIterator after = m_document.Chunks(m_end + (skip > gap ? skip - gap : 0));
+    while (after.Next(chunk))
+    {
+      if (!fn(chunk))
+        return;
+    }
+  }
+
+  char DocumentEditor::GapAt(size_t i) const
+  {
+    return i < m_before.size() ? m_before[i] : m_after[m_after.size() - 1 - (i - m_before.size())];
+  }
+
+  size_t DocumentEditor::GapNewlines() const
+  {
+    return CountNewlines(m_before.data(), m_before.size()) + CountNewlines(m_after.data(), m_after.size());
+  }
+
+  size_t DocumentEditor::LineCount() const
+  {
+    return m_document.LineCount() - (m_document.LineOf(m_end) - m_document.LineOf(m_start)) + GapNewlines();
+  }
+
+  size_t DocumentEditor::LineOf(size_t offset) const
+  {
+    if (offset <= m_start)
+      return m_document.LineOf(offset);
+
+    size_t gap = m_before.size() + m_after.size();
+    if (offset <= m_start + gap)
+    {
+      size_t line = m_document.LineOf(m_start);
+      for (size_t i = 0; i < offset - m_start; ++i)
+        line += GapAt(i) == '\n';
+      return line;
+    }
+
+    size_t removed = m_document.LineOf(m_end) - m_document.LineOf(m_start);
+    return m_document.LineOf(offset - gap + m_end - m_start) - removed + GapNewlines();
+  }
+
+  size_t DocumentEditor::LineOffset(size_t line) const
+  {
+    size_t first = m_document.LineOf(m_start);
+    if (line <= first)
+      return m_document.LineOffset(line);
+
+    size_t gap = m_before.size() + m_after.size();
+    size_t gap_newlines = GapNewlines();
+    if (line <= first + gap_newlines)
+    {
+      // after the (line - first)th newline of the gap
+      size_t n = line - first;
+      for (size_t i = 0; ; ++i)
+      {
+        if (GapAt(i) == '\n' && --n == 0)
+          return m_start + i + 1;
+      }
+    }
+
+    size_t removed = m_document.LineOf(m_end) - first;
+    return m_document.LineOffset(line - gap_newlines + removed) - (m_end - m_start) + gap;
+  }
+
+  std::string DocumentEditor::Line(size_t line, size_t max_bytes) const
+  {
+    std::string text;
+    Read(LineOffset(line), [&](std::string_view chunk) {
+      size_t newline = chunk.find('\n');
+      text.append(chunk.substr(0, std::min(newline, max_bytes - text.size())));
+      return newline == std::string_view::npos && text.size() < max_bytes;
+    });
+    return text;
+  }
+
+  Document& DocumentEditor::Flush()
+  {
+    if (m_modified)
+    {
+      std::string text;
+      text.reserve(m_before.size() + m_after.size());
+      text.append(m_before);
+      text.append(m_after.rbegin(), m_after.rend());
+      m_document.Erase(m_start, m_end - m_start);
+      m_document.Insert(m_start, text);
+    }
+
+    m_start = Caret();
+    m_end = m_start;
+    m_before.clear();
+    m_after.clear();
+    m_modified = false;
+    return m_document;
+  }
+
+  void EditHistory::Record(EditOperation operation)
+  {
+    if (operation.removed.empty() && operation.inserted.empty())
+      return;
+
+    for (EditTransaction const& transaction : m_redo)
+      m_bytes -= transaction.bytes;
+    m_redo.clear();
+
+    EditOperation* last = m_open && !m_undo.empty() ? &m_undo.back().operations.back() : NULL;
+    size_t added = operation.removed.size() + operation.inserted.size();
+    if (last && last->removed.size() + last->inserted.size() + added <= MaxMergedBytes)
+    {
+      if (operation.removed.empty() && operation.offset == last->offset + last->inserted.size())
+      {
+        // typing after the previous insertion, or replacing a selection
+        last->inserted += operation.inserted;
+        operation.inserted.clear();
+      }
+      else if (last->inserted.empty() && operation.inserted.empty() && operation.offset + operation.removed.size() == last->offset)
+      {
+        // backspace
+        last->removed.insert(0, operation.removed);
+        last->offset = operation.offset;
+        operation.removed.clear();
+      }
+      else if (last->inserted.empty() && operation.inserted.empty() && operation.offset == last->offset)
+      {
+        // delete
+        last->removed += operation.removed;
+        operation.removed.clear();
+      }
+
+      if (operation.removed.empty() && operation.inserted.empty())
+      {
+        m_undo.back().bytes += added;
+        m_bytes += added;
+        return Evict();
+      }
+    }
+
+    EditTransaction& transaction = m_undo.emplace_back();
+    transaction.bytes = sizeof(EditTransaction) + sizeof(EditOperation) + added;
+    transaction.operations.push_back(std::move(operation));
+    m_bytes += transaction.bytes;
+    m_open = true;
+    Evict();
+  }
+
+  void EditHistory::Record(EditTransaction transaction)
+  {
+    if (transaction.operations.empty())
+      return;
+
+    for (EditTransaction const& redo : m_redo)
+      m_bytes -= redo.bytes;
+    m_redo.clear();
+
+    transaction.bytes = sizeof(EditTransaction);
+    for (EditOperation const& operation : transaction.operations)
+      transaction.bytes += sizeof(EditOperation) + operation.removed.size() + operation.inserted.size();
+    m_bytes += transaction.bytes;
+    m_undo.push_back(std::move(transaction));
+    m_open = false;
+    Evict();
+  }
+
+  void EditHistory::Evict()
+  {
+    while (m_bytes > m_max_bytes && !m_undo.empty())
+    {
+      m_bytes -= m_undo.front().bytes;
+      m_undo.pop_front();
+    }
+    if (m_undo.empty())
+      m_open = false;
+  }
+
+  void EditHistory::SetMaxBytes(size_t bytes)
+  {
+    m_max_bytes = bytes;
+    Evict();
+  }
+
+  void EditHistory::Clear()
+  {
+    m_undo.clear();
+    m_redo.clear();
+    m_bytes = 0;
+    m_open = false;
+  }
+
+  EditTransaction const* EditHistory::PopUndo()
+  {
+    m_open = false;
+    if (m_undo.empty())
+      return NULL;
+    m_redo.push_back(std::move(m_undo.back()));
+    m_undo.pop_back();
+    return &m_redo.back();
+  }
+
+  EditTransaction const* EditHistory::PopRedo()
+  {
+    m_open = false;
+    if (m_redo.empty())
+      return NULL;
+    m_undo.push_back(std::move(m_redo.back()));
+    m_redo.pop_back();
+    return &m_undo.back();
+  }
+
+  void DocumentEditor::SetText(std::string text)
+  {
+    size_t lines = LineCount();
+    m_document.SetText(std::move(text));
+    Reset();
+    if (m_on_lines_changed)
+      m_on_lines_changed(0, lines - 1, LineCount() - 1);
+  }
+
+  void DocumentEditor::SetText(std::shared_ptr<const void> owner, std::string_view text)
+  {
+    size_t lines = LineCount();
+    m_document.SetText(std::move(owner), text);
+    Reset();
+    if (m_on_lines_changed)
+      m_on_lines_changed(0, lines - 1, LineCount() - 1);
+  }
+
+  void DocumentEditor::SetDocument(Document document)
+  {
+    size_t lines = LineCount();
+    m_document = std::move(document);
+    Reset();
+    if (m_on_lines_changed)
+      m_on_lines_changed(0, lines - 1, LineCount() - 1);
+  }
+
+  void DocumentEditor::LinesChanged(size_t offset, std::string_view removed, std::string_view inserted)
+  {
+    if (m_on_lines_changed)
+      m_on_lines_changed(LineOf(offset), CountNewlines(removed.data(), removed.size()), CountNewlines(inserted.data(), inserted.size()));
+  }
+
+  void DocumentEditor::Reset()
+  {
+    m_start = 0;
+    m_end = 0;
+    m_before.clear();
+    m_after.clear();
+    m_modified = false;
+    m_anchor = 0;
+    m_column = SIZE_MAX;
+    m_history.Clear();
+  }
+
+  bool DocumentEditor::PullBefore()
+  {
+    if (m_start == 0)
+      return false;
+
+    // starts on a lead byte so that whole characters are pulled
+    size_t length = std::min(PullSize, m_start);
+    while (length < m_start && IsContinuation(m_document.At(m_start - length)))
+      length++;
+
+    m_before = m_document.Substr(m_start - length, length);
+    m_start -= length;
+    return true;
+  }
+
+  bool DocumentEditor::PullAfter()
+  {
+    size_t size = m_document.Size();
+    if (m_end == size)
+      return false;
+
+    size_t length = std::min(PullSize, size - m_end);
+    while (m_end + length < size && IsContinuation(m_document.At(m_end + length)))
+      length++;
+
+    std::string block = m_document.Substr(m_end, length);
+    m_after.assign(block.rbegin(), block.rend());
+    m_end += length;
+    return true;
+  }
+
+  void DocumentEditor::Select(bool extend)
+  {
+    m_history.Close();
+    if (m_before.size() + m_after.size() > MaxGapSize)
+      Flush();
+    if (!extend)
+      m_anchor = Caret();
+  }
+
+  void DocumentEditor::SetCaret(size_t offset, bool extend)
+  {
+    offset = std::min(offset, Size());
+    m_column = SIZE_MAX;
+
+    if (offset >= m_start && offset <= m_start + m_before.size() + m_after.size())
+    {
+      while (Caret() > offset)
+      {
+        m_after.push_back(m_before.back());
+        m_before.pop_back();
+      }
+      while (Caret() < offset)
+      {
+        m_before.push_back(m_after.back());
+        m_after.pop_back();
+      }
+    }
+    else
+    {
+      Flush();
+      m_start = offset;
+      m_end = offset;
+    }
+    Select(extend);
+  }
+
+  void DocumentEditor::MoveLeft(bool extend)
+  {
+    size_t start, end;
+    Selection(start, end);
+    if (!extend && start != end)
+      return SetCaret(start);
+
+    m_column = SIZE_MAX;
+    if (m_before.empty() && !PullBefore())
+      return Select(extend);
+
+    char c;
+    do
+    {
+      c = m_before.back();
+      m_before.pop_back();
+      m_after.push_back(c);
+    } while (IsContinuation(c) && !m_before.empty());
+    Select(extend);
+  }
+
+  void DocumentEditor::MoveRight(bool extend)
+  {
+    size_t start, end;
+    Selection(start, end);
+    if (!extend && start != end)
+      return SetCaret(end);
+
+    m_column = SIZE_MAX;
+    if (m_after.empty() && !PullAfter())
+      return Select(extend);
+
+    do
+    {
+      m_before.push_back(m_after.back());
+      m_after.pop_back();
+    } while (!m_after.empty() && IsContinuation(m_after.back()));
+    Select(extend);
+  }
+
+  void DocumentEditor::MoveUp(bool extend)
+  {
+    Flush();
+    size_t caret = Caret();
+    size_t line_start = m_document.LineStart(caret);
+    size_t column = m_column != SIZE_MAX ? m_column : CountCodepoints(m_document, line_start, caret);
+
+    size_t target = 0;
+    if (line_start > 0)
+      target = AdvanceCodepoints(m_document, m_document.LineStart(line_start - 1), column);
+    SetCaret(target, extend);
+    m_column = column;
+  }
+
+  void DocumentEditor::MoveDown(bool extend)
+  {
+    Flush();
+    size_t caret = Caret();
+    size_t line_end = m_document.LineEnd(caret);
+    size_t column = m_column != SIZE_MAX ? m_column : CountCodepoints(m_document, m_document.LineStart(caret), caret);
+
+    size_t target = m_document.Size();
+    if (line_end < target)
+      target = AdvanceCodepoints(m_document, line_end + 1, column);
+    SetCaret(target, extend);
+    m_column = column;
+  }
+
+  void DocumentEditor::MoveHome(bool extend)
+  {
+    size_t newline = m_before.rfind('\n');
+    if (newline != std::string::npos)
+      return SetCaret(m_start + newline + 1, extend);
+    Flush();
+    SetCaret(m_document.LineStart(Caret()), extend);
+  }
+
+  void DocumentEditor::MoveEnd(bool extend)
+  {
+    // m_after is reversed, the closest newline is the last one
+    size_t newline = m_after.rfind('\n');
+    if (newline != std::string::npos)
+      return SetCaret(Caret() + m_after.size() - 1 - newline, extend);
+    Flush();
+    SetCaret(m_document.LineEnd(Caret()), extend);
+  }
+
+  void DocumentEditor::DeleteSelection()
+  {
+    size_t start, end;
+    Selection(start, end);
+    if (start == end)
+      return;
+
+    Flush();
+    std::string removed = m_document.Substr(start, end - start);
+    m_document.Erase(start, end - start);
+    m_start = start;
+    m_end = start;
+    m_anchor = start;
+    LinesChanged(start, removed, {});
+    m_history.Record({ start, std::move(removed), {} });
+  }
+
+  void DocumentEditor::Insert(std::string_view text)
+  {
+    DeleteSelection();
+    m_column = SIZE_MAX;
+    size_t caret = Caret();
+    m_history.Record({ caret, {}, std::string(text) });
+
+    if (m_before.size() + m_after.size() + text.size() > MaxGapSize)
+    {
+      // pasting a large text goes straight to the document
+      Flush();
+      m_document.Insert(m_start, text);
+      m_start += text.size();
+      m_end = m_start;
+    }
+    else
+    {
+      m_before.append(text);
+      m_modified = true;
+    }
+    m_anchor = Caret();
+    LinesChanged(caret, {}, text);
+  }
+
+  void DocumentEditor::Replace(std::vector<DocumentRange> const& ranges, std::string_view text)
+  {
+    if (ranges.empty())
+      return;
+
+    Flush();
+    EditTransaction transaction;
+    transaction.operations.reserve(ranges.size());
+    long long shift = 0;
+    for (DocumentRange const& r : ranges)
+    {
+      transaction.operations.push_back({ (size_t) (r.offset + shift), m_document.Substr(r.offset, r.length), std::string(text) });
+      shift += (long long) text.size() - (long long) r.length;
+    }
+    m_document.Replace(ranges, text);
+    // in order, each one at its place after the ones before
+    for (EditOperation const& op : transaction.operations)
+      LinesChanged(op.offset, op.removed, op.inserted);
+    m_history.Record(std::move(transaction));
+
+    // the caret keeps its place in the text before it
+    size_t caret = Caret();
+    shift = 0;
+    for (DocumentRange const& r : ranges)
+    {
+      if (r.offset + r.length > caret)
+      {
+        if (r.offset < caret)
+          shift += (long long) r.offset + (long long) text.size() - (long long) caret;
+        break;
+      }
+      shift += (long long) text.size() - (long long) r.length;
+    }
+    m_start = m_end = m_anchor = std::min<size_t>(caret + shift, m_document.Size());
+    m_column = SIZE_MAX;
+  }
+
+  void DocumentEditor::Backspace()
+  {
+    m_column = SIZE_MAX;
+    if (HasSelection())
+      return DeleteSelection();
+    if (m_before.empty() && !PullBefore())
+      return;
+
+    size_t length = 0;
+    char c;
+    do
+    {
+      c = m_before[m_before.size() - ++length];
+    } while (IsContinuation(c) && length < m_before.size());
+    std::string removed = m_before.substr(m_before.size() - length);
+    m_before.resize(m_before.size() - length);
+    m_modified = true;
+    m_anchor = Caret();
+    LinesChanged(Caret(), removed, {});
+    m_history.Record({ Caret(), std::move(removed), {} });
+  }
+
+  void DocumentEditor::Delete()
+  {
+    m_column = SIZE_MAX;
+    if (HasSelection())
+      return DeleteSelection();
+    if (m_after.empty() && !PullAfter())
+      return;
+
+    std::string removed;
+    do
+    {
+      removed.push_back(m_after.back());
+      m_after.pop_back();
+    } while (!m_after.empty() && IsContinuation(m_after.back()));
+    m_modified = true;
+    m_anchor = Caret();
+    LinesChanged(Caret(), removed, {});
+    m_history.Record({ Caret(), std::move(removed), {} });
+  }
+
+  bool DocumentEditor::Undo()
+  {
+    Flush();
+    EditTransaction const* transaction = m_history.PopUndo();
+    if (!transaction)
+      return false;
+
+    size_t caret = 0;
+    for (auto op = transaction->operations.rbegin(); op != transaction->operations.rend(); ++op)
+    {
+      m_document.Erase(op->offset, op->inserted.size());
+      m_document.Insert(op->offset, op->removed);
+      LinesChanged(op->offset, op->inserted, op->removed);
+      caret = op->offset + op->removed.size();
+    }
+    m_start = m_end = m_anchor = caret;
+    m_column = SIZE_MAX;
+    return true;
+  }
+
+  bool DocumentEditor::Redo()
+  {
+    Flush();
+    EditTransaction const* transaction = m_history.PopRedo();
+    if (!transaction)
+      return false;
+
+    size_t caret = 0;
+    for (EditOperation const& op : transaction->operations)
+    {
+      m_document.Erase(op.offset, op.removed.size());
+      m_document.Insert(op.offset, op.inserted);
+      LinesChanged(op.offset, op.removed, op.inserted);
+      caret = op.offset + op.inserted.size();
+    }
+    m_start = m_end = m_anchor = caret;
+    m_column = SIZE_MAX;
+    return true;
+  }
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace application
+{
+  // Counts the newlines in [data, data + length), vectorized where the
+  // target has SSE2
+  size_t CountNewlines(char const* data, size_t length);
+
+  // A buffer the pieces point into, with the number of newlines before each
+  // block of it so that the newlines of any piece are counted reading at
+  // most one block. Written bytes never move or change.
+  struct DocumentBuffer
+  {
+    static constexpr size_t BlockSize = 4096;
+
+    // sized once, only the first m_size bytes are written
+    std::string m_bytes;
+    // m_bytes, or bytes kept alive by m_owner such as a mapped file
+    char const* m_data = NULL;
+    std::shared_ptr<const void> m_owner;
+    size_t m_size = 0;
+    // newlines in [0, i * BlockSize) for every block up to m_size
+    std::vector<size_t> m_block_newlines = { 0 };
+    size_t m_newlines = 0;
+
+    char const* Data() const { return m_data; }
+    size_t Left() const { return m_owner ? 0 : m_bytes.size() - m_size; }
+    // Copies `text` after the written bytes, it must fit
+    char const* Write(std::string_view text);
+    // Counts the newlines of the `size` bytes already at Data(), picking up
+    // from the last block counted so a text can be indexed in sections
+    void IndexWritten(size_t size);
+
+    size_t NewlinesBefore(size_t offset) const;
+    size_t Newlines(char const* begin, char const* end) const;
+    // Offset of the `n`th newline of the buffer, counting from 1
+    size_t FindNewline(size_t n) const;
+  };
+
+  // Bytes the pieces point into. The original text and the appended chunks
+  // never move or change once written, so every snapshot sharing the
+  // storage stays valid while the document is edited.
+  struct DocumentStorage
+  {
+    static constexpr size_t ChunkSize = 64 * 1024;
+    // bytes of the original text indexed between two progress calls
+    static constexpr size_t IndexSection = 1024 * 1024;
+
+    // the first buffer holds the original text, deque keeps them in place
+    std::deque<DocumentBuffer> m_buffers;
+    DocumentBuffer* m_current = NULL;
+
+    DocumentBuffer* SetOriginal(std::string text);
+    // The original text is not copied, `owner` keeps it alive as long as a
+    // snapshot points into it. `progress`, when set, is called with the
+    // bytes indexed after every IndexSection, the original is dropped and
+    // NULL returned as soon as it returns false.
+    DocumentBuffer* SetOriginal(std::shared_ptr<const void> owner, std::string_view text, std::function<bool(size_t indexed)> const& progress = {});
+    // Where Append would copy `length` bytes, NULL when a new chunk is needed
+    char const* NextWrite(size_t length);
+    // Copies `text` after the previous appends, in a new chunk when it
+    // doesn't fit in the current one
+    char const* Append(std::string_view text, DocumentBuffer** buffer);
+  };
+
+  // Node of the piece tree: a treap ordered by document position. Nodes are
+  // immutable and shared between snapshots, an edit copies the O(log n)
+  // nodes on the paths it changes.
+  struct DocumentNode
+  {
+    DocumentBuffer const* buffer = NULL;
+    char const* data = NULL;
+    size_t length = 0;
+    size_t newlines = 0;
+
+    size_t subtree_length = 0;
+    size_t subtree_pieces = 0;
+    size_t subtree_newlines = 0;
+    uint32_t priority = 0;
+
+    std::shared_ptr<const DocumentNode> left;
+    std::shared_ptr<const DocumentNode> right;
+  };
+
+  using DocumentNodePtr = std::shared_ptr<const DocumentNode>;
+
+  // [offset, offset + length) of a document
+  struct DocumentRange
+  {
+    size_t offset = 0;
+    size_t length = 0;
+  };
+
+  // Walks the text of a snapshot one piece at a time
+  struct DocumentChunkIterator
+  {
+    DocumentNodePtr m_root;
+    std::shared_ptr<DocumentStorage> m_storage;
+    // nodes whose piece and right subtree are still to be visited
+    std::vector<DocumentNode const*> m_stack;
+    size_t m_skip = 0;
+    size_t m_left = 0;
+
+    // The next piece of at most the remaining length, false at the end
+    bool Next(std::string_view& chunk);
+  };
+
+  // Immutable view of a document, copying one is O(1). Its text can be
+  // read from any thread, but the line queries read the block index of the
+  // chunk the document keeps appending to: they are only safe on the thread
+  // that edits the document.
+  struct DocumentSnapshot
+  {
+    DocumentNodePtr m_root;
+    std::shared_ptr<DocumentStorage> m_storage;
+
+    size_t Size() const;
+    size_t PieceCount() const;
+    bool Empty() const;
+
+    // Chunks of the text in [from, to)
+    DocumentChunkIterator Chunks(size_t from = 0, size_t to = SIZE_MAX) const;
+    char At(size_t offset) const;
+    std::string Substr(size_t offset, size_t length) const;
+    std::string Text() const;
+
+    // Lines are counted from 0 and end after their newline, a text with n
+    // newlines has n + 1 lines. All of these are O(log n).
+    size_t LineCount() const;
+    // Line holding `offset`
+    size_t LineOf(size_t offset) const;
+    // Offset of the first byte of `line`, Size() past the last line
+    size_t LineOffset(size_t line) const;
+    // Offset of the first byte of the line holding `offset`
+    size_t LineStart(size_t offset) const;
+    // Offset of the newline ending the line holding `offset`, Size() for
+    // the last line
+    size_t LineEnd(size_t offset) const;
+  };
+
+  // Piece table: the text is a sequence of pieces pointing into the
+  // original text or into append-only chunks, kept in a balanced tree so
+  // that inserting and erasing at any offset costs O(log n) in the number
+  // of pieces whatever the size of the text.
+  struct Document : public DocumentSnapshot
+  {
+    Document();
+    explicit Document(std::string text);
+
+    // Replaces the whole text, `text` becomes the original buffer
+    void SetText(std::string text);
+    // Same without copying `text`, which `owner` keeps alive. Edits only
+    // copy the bytes they insert, the original is never written to. With
+    // `progress`, see DocumentStorage::SetOriginal, the text is left empty
+    // and false returned when it stops the indexing.
+    bool SetText(std::shared_ptr<const void> owner, std::string_view text, std::function<bool(size_t indexed)> const& progress = {});
+    void Clear();
+
+    void Insert(size_t offset, std::string_view text);
+    void Erase(size_t offset, size_t length);
+    // Replaces all of `ranges`, sorted and not overlapping, with `text` in
+    // one pass over the pieces. `text` is stored once whatever the number
+    // of ranges and the tree is rebuilt balanced, in O(pieces + ranges).
+    void Replace(std::vector<DocumentRange> const& ranges, std::string_view text);
+
+    DocumentSnapshot Snapshot() const;
+  };
+
+  // `removed` at `offset` replaced by `inserted`, undoing or redoing it
+  // costs the size of the edit whatever the size of the document
+  struct EditOperation
+  {
+    size_t offset = 0;
+    std::string removed;
+    std::string inserted;
+  };
+
+  // Operations undone and redone together
+  struct EditTransaction
+  {
+    std::vector<EditOperation> operations;
+    size_t bytes = 0;
+  };
+
+  // Undo and redo stacks of edit operations. Consecutive typing, backspaces
+  // or deletes are merged into one operation until the caret moves. The
+  // oldest transactions are dropped when the history holds more than
+  // m_max_bytes.
+  struct EditHistory
+  {
+    static constexpr size_t DefaultMaxBytes = 64 * 1024 * 1024;
+    // an operation stops taking more typing past this size
+    static constexpr size_t MaxMergedBytes = 4096;
+
+    std::deque<EditTransaction> m_undo;
+    std::vector<EditTransaction> m_redo;
+    // held by both stacks
+    size_t m_bytes = 0;
+    size_t m_max_bytes = DefaultMaxBytes;
+    // the last operation can take the next one
+    bool m_open = false;
+
+    bool CanUndo() const { return !m_undo.empty(); }
+    bool CanRedo() const { return !m_redo.empty(); }
+
+    // Adds `operation` to the history and drops what can't be redone
+    // anymore
+    void Record(EditOperation operation);
+    // Adds operations undone together, each offset is where the operation
+    // applies after the previous ones
+    void Record(EditTransaction transaction);
+    // The next operation starts a new transaction
+    void Close() { m_open = false; }
+    void SetMaxBytes(size_t bytes);
+    void Clear();
+
+    // Moves the last transaction between the stacks and returns it, NULL
+    // when there is none
+    EditTransaction const* PopUndo();
+    EditTransaction const* PopRedo();
+
+  private:
+    void Evict();
+  };
+
+  // Caret and selection over a Document, with a gap buffer at the caret.
+  // The bytes around the caret are pulled out of the piece tree into two
+  // small buffers, typing, deleting and moving the caret near it only
+  // touch those and the tree is edited once per Flush.
+  struct DocumentEditor
+  {
+    // bytes pulled out of the document at a time, and the most the gap
+    // holds before it is flushed
+    static constexpr size_t PullSize = 256;
+    static constexpr size_t MaxGapSize = 4096;
+
+    Document m_document;
+    // [m_start, m_end) of the document is replaced by m_before followed by
+    // m_after, the caret sits between the two
+    size_t m_start = 0;
+    size_t m_end = 0;
+    std::string m_before;
+    // reversed, the byte right after the caret is at the back
+    std::string m_after;
+    // false while the gap only holds bytes pulled out unchanged
+    bool m_modified = false;
+    // the selection runs from the anchor to the caret
+    size_t m_anchor = 0;
+    // column kept by consecutive up and down moves
+    size_t m_column = SIZE_MAX;
+    EditHistory m_history;
+    // Called after every change of the text with the line it starts on and
+    // the number of newlines it removed and inserted there. The lines
+    // before are untouched and the ones after only shifted, per-line caches
+    // keep them.
+    std::function<void(size_t line, size_t removed_lines, size_t inserted_lines)> m_on_lines_changed;
+
+    size_t Size() const;
+    size_t Caret() const;
+    bool HasSelection() const;
+    void Selection(size_t& start, size_t& end) const;
+
+    // Calls `fn` on the text from `from` in order, one chunk at a time,
+    // until it returns false
+    void Read(size_t from, std::function<bool(std::string_view)> const& fn) const;
+
+    // Line queries of DocumentSnapshot, through the gap
+    size_t LineCount() const;
+    size_t LineOf(size_t offset) const;
+    size_t LineOffset(size_t line) const;
+    // Text of `line` without its newline, cut after `max_bytes`
+    std::string Line(size_t line, size_t max_bytes = SIZE_MAX) const;
+
+    // Writes the gap back, the document is up to date until the next edit
+    Document& Flush();
+    void SetText(std::string text);
+    void SetText(std::shared_ptr<const void> owner, std::string_view text);
+    // Takes a text built elsewhere, on another thread for a large one. The
+    // caret, the selection and the history start over like with SetText.
+    void SetDocument(Document document);
+
+    // `extend` keeps the anchor where it is and selects up to the caret
+    void SetCaret(size_t offset, bool extend = false);
+    void MoveLeft(bool extend = false);
+    void MoveRight(bool extend = false);
+    void MoveUp(bool extend = false);
+    void MoveDown(bool extend = false);
+    void MoveHome(bool extend = false);
+    void MoveEnd(bool extend = false);
+
+    // Replaces the selection with `text`
+    void Insert(std::string_view text);
+    // Replaces all of `ranges`, sorted and not overlapping, with `text` as
+    // one edit and one undo step
+    void Replace(std::vector<DocumentRange> const& ranges, std::string_view text);
+    // Erase the selection, or the character before/after the caret
+    void Backspace();
+    void Delete();
+
+    // Reverts or replays the last transaction of the history, false when
+    // there is none. The caret is put after the text it restores.
+    bool Undo();
+    bool Redo();
+
+  private:
+    // caret, selection and gap back to the start of a new text
+    void Reset();
+    // the gap text in order, m_before then m_after reversed
+    char GapAt(size_t i) const;
+    size_t GapNewlines() const;
+    bool PullBefore();
+    bool PullAfter();
+    void DeleteSelection();
+    void Select(bool extend);
+    // `removed` was replaced by `inserted` at `offset` of the current text
+    void LinesChanged(size_t offset, std::string_view removed, std::string_view inserted);
+  };
+}
@@ -0,0 +1,162 @@
+#include "frame_stats.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace application
+{
+  namespace
+  {
+    FrameStats::Summary Summarize(std::vector<double>& values)
+    {
+      FrameStats::Summary s;
+      s.frames = values.size();
+      if (values.empty())
+        return s;
+
+      std::sort(values.begin(), values.end());
+      // nearest rank
+      auto percentile = [&values](double p) {
+        size_t rank = (size_t) (p / 100.0 * values.size() + 0.999999);
+        rank = std::clamp<size_t>(rank, 1, values.size());
+        return values[rank - 1];
+      };
+      s.p50 = percentile(50);
+      s.p95 = percentile(95);
+      s.p99 = percentile(99);
+      s.max = values.back();
+      return s;
+    }
+  }
+
+  char const* FramePhaseName(int phase)
+  {
+    switch (phase)
+    {
+    case PumpMessagesPhase:  return "pump_messages";
+    case ProcessEventsPhase: return "process_events";
+    case LayoutPhase:        return "layout";
+    case DrawPhase:          return "draw";
+    case PresentPhase:       return "present";
+    case SleepPhase:         return "sleep";
+    }
+    return "total";
+  }
+
+  void FrameStats::BeginFrame()
+  {
+    m_current = {};
+    m_current.frame = m_frame;
+    m_frame_start = platform::CurrentTimestamp();
+    m_in_frame = true;
+  }
+
+  void FrameStats::Add(FramePhase phase, platform::Duration d)
+  {
+    if (!m_in_frame)
+      return;
+    m_current.phases[phase] += d.count();
+  }
+
+  platform::Timestamp FrameStats::AddSince(FramePhase phase, platform::Timestamp start)
+  {
+    platform::Timestamp now = platform::CurrentTimestamp();
+    Add(phase, platform::DurationFrom(now, start));
+    return now;
+  }
+
+  double FrameStats::Recorded()
+  {
+    double sum = 0;
+    for (double d : m_current.phases)
+      sum += d;
+    return sum;
+  }
+
+  platform::Timestamp FrameStats::AddSinceExclusive(FramePhase phase, platform::Timestamp start, double recorded_at_start)
+  {
+    double nested = Recorded() - recorded_at_start;
+    platform::Timestamp now = platform::CurrentTimestamp();
+    Add(phase, platform::Duration(platform::DurationFrom(now, start).count() - nested));
+    return now;
+  }
+
+  void FrameStats::EndFrame()
+  {
+    if (!m_in_frame)
+      return;
+
+    m_current.total = platform::DurationFrom(platform::CurrentTimestamp(), m_frame_start).count();
+    m_frames[m_next] = m_current;
+    m_next = (m_next + 1) % Capacity;
+    m_count = std::min(m_count + 1, Capacity);
+    m_frame++;
+    m_in_frame = false;
+  }
+
+  size_t FrameStats::Size()
+  {
+    return m_count;
+  }
+
+  FrameTiming const& FrameStats::At(size_t i)
+  {
+    return m_frames[(m_next + Capacity - m_count + i) % Capacity];
+  }
+
+  FrameStats::Summary FrameStats::Summarize(FramePhase phase)
+  {
+    std::vector<double> values;
+    values.reserve(m_count);
+    for (size_t i = 0; i < m_count; ++i)
+      values.push_back(At(i).phases[phase]);
+    return application::Summarize(values);
+  }
+
+  FrameStats::Summary FrameStats::SummarizeTotal()
+  {
+    std::vector<double> values;
+    values.reserve(m_count);
+    for (size_t i = 0; i < m_count; ++i)
+      values.push_back(At(i).total);
+    return application::Summarize(values);
+  }
+
+  void FrameStats::Clear()
+  {
+    m_count = 0;
+    m_next = 0;
+  }
+
+  bool FrameStats::Dump(std::string const& path)
+  {
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (!f)
+      return false;
+
+    std::fprintf(f, "# phase p50_ms p95_ms p99_ms max_ms over %zu frames\n", m_count);
+    for (int phase = 0; phase <= FramePhaseCount; ++phase)
+    {
+      Summary s = phase == FramePhaseCount ? SummarizeTotal() : Summarize((FramePhase) phase);
+      std::fprintf(f, "# %-15s %8.3f %8.3f %8.3f %8.3f\n", FramePhaseName(phase), s.p50, s.p95, s.p99, s.max);
+    }
+
+    std::fprintf(f, "frame");
+    for (int phase = 0; phase < FramePhaseCount; ++phase)
+      std::fprintf(f, ",%s", FramePhaseName(phase));
+    std::fprintf(f, ",total\n");
+
+    for (size_t i = 0; i < m_count; ++i)
+    {
+      FrameTiming const& t = At(i);
+      std::fprintf(f, "%llu", t.frame);
+      for (int phase = 0; phase < FramePhaseCount; ++phase)
+        std::fprintf(f, ",%.3f", t.phases[phase]);
+      std::fprintf(f, ",%.3f\n", t.total);
+    }
+
+    bool ok = !std::ferror(f);
+    return std::fclose(f) == 0 && ok;
+  }
+}
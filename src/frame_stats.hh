@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include "platform.hh"
+
+namespace application
+{
+  enum FramePhase
+  {
+    PumpMessagesPhase,   // the platform message loop, without the dispatch
+    ProcessEventsPhase,  // Application::ProcessEvent
+    LayoutPhase,
+    DrawPhase,
+    PresentPhase,        // EndDraw and present
+    SleepPhase,          // waiting for the next frame
+    FramePhaseCount
+  };
+
+  char const* FramePhaseName(int phase);
+
+  struct FrameTiming
+  {
+    unsigned long long frame = 0;
+    // milliseconds
+    double phases[FramePhaseCount] = {};
+    double total = 0;
+  };
+
+  // Timings of the last Capacity frames. A phase can be added to several
+  // times during a frame, the durations are summed.
+  struct FrameStats
+  {
+    static constexpr size_t Capacity = 1024;
+
+    struct Summary
+    {
+      size_t frames = 0;
+      double p50 = 0;
+      double p95 = 0;
+      double p99 = 0;
+      double max = 0;
+    };
+
+    std::array<FrameTiming, Capacity> m_frames;
+    size_t m_count = 0;
+    size_t m_next = 0;
+    unsigned long long m_frame = 0;
+
+    FrameTiming m_current;
+    platform::Timestamp m_frame_start;
+    bool m_in_frame = false;
+
+    void BeginFrame();
+    void Add(FramePhase phase, platform::Duration d);
+    // Adds the time since `start` to `phase`, returns the current time
+    platform::Timestamp AddSince(FramePhase phase, platform::Timestamp start);
+    // Sum of the phases recorded in the current frame so far
+    double Recorded();
+    // AddSince for a phase that runs the others, like the message pump
+    // dispatching events: what they recorded since `recorded_at_start`
+    // is left out
+    platform::Timestamp AddSinceExclusive(FramePhase phase, platform::Timestamp start, double recorded_at_start);
+    void EndFrame();
+
+    size_t Size();
+    // The i-th recorded frame, 0 is the oldest
+    FrameTiming const& At(size_t i);
+
+    Summary Summarize(FramePhase phase);
+    Summary SummarizeTotal();
+    void Clear();
+
+    // Writes one line per phase with its summary followed by every frame of
+    // the buffer as CSV, returns false when the file can't be written
+    bool Dump(std::string const& path);
+  };
+}
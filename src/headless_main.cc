@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "logger.hh"
+#include "platform_headless.hh"
+#include "application.hh"
+
+// Drives the application without a window: opens the file selector, scrolls
+// it, types and moves the caret in the text box and prints what the last
+// frame drew.
+
+using application::gui::FindId;
+using application::gui::LayoutInfo;
+using application::gui::Widget;
+
+static bool CenterOf(char const* id, int& x, int& y)
+{
+  Widget* w = FindId(id);
+  if (!w) return false;
+
+  // layouts are relative to the parent
+  x = 0;
+  y = 0;
+  for (Widget* p = w; p; p = p->GetParent())
+  {
+    LayoutInfo layout = p->GetLayout();
+    x += layout.x;
+    y += layout.y;
+  }
+  LayoutInfo layout = w->GetLayout();
+  x += layout.width / 2;
+  y += layout.height / 2;
+  return true;
+}
+
+static char const* CommandName(platform::DrawCommand::Type type)
+{
+  switch (type)
+  {
+  case platform::DrawCommand::FillRectangle: return "fill";
+  case platform::DrawCommand::DrawText:      return "text";
+  case platform::DrawCommand::PushClip:      return "push_clip";
+  case platform::DrawCommand::PopClip:       return "pop_clip";
+  }
+  return "?";
+}
+
+int main(int argc, char** argv)
+{
+  logger::Init();
+
+  bool dump = argc > 1 && std::strcmp(argv[1], "--dump") == 0;
+
+  platform::HeadlessWindow window(1280, 720);
+  window.Frame();
+  printf("initial frame: %zu commands\n", window.m_render_context.commands.size());
+
+  int x, y;
+  if (CenterOf("TextBox", x, y))
+  {
+    window.Click(x, y);
+    for (char const* c = "hello"; *c; ++c)
+      window.Char(*c);
+    // edit at the start of the line
+    window.Key(application::gui::VirtualKey_Home);
+    window.Char('>');
+    window.Frame();
+  }
+
+  if (CenterOf("OpenButton", x, y))
+  {
+    window.Click(x, y);
+    window.Frame();
+    printf("file selector: %zu commands\n", window.m_render_context.commands.size());
+  }
+
+  for (int i = 0; i < 10; ++i)
+  {
+    window.MouseWheel(window.m_width / 2, window.m_height / 2, -120);
+    window.Frame();
+  }
+  printf("after scrolling: %zu commands\n", window.m_render_context.commands.size());
+
+  // the labels and lines drawn again are not shaped again
+  application::TextLayoutCacheStats const& cache = application::GetTextLayoutCache().Stats();
+  printf("text layout cache: %llu hits, %llu misses, %zu entries, %zu bytes\n", cache.hits, cache.misses, cache.entries, cache.bytes);
+
+  if (dump)
+  {
+    for (platform::DrawCommand const& c : window.m_render_context.commands)
+    {
+      printf("%-9s %s %g %g %g %g \"%s\"\n",
+        CommandName(c.type),
+        application::gui::IdString(c.widget->GetId()).c_str(),
+        c.x, c.y, c.width, c.height,
+        c.text.c_str());
+    }
+  }
+
+  // FRAME_STATS_FILE=<path> keeps the timings of the frames
+  if (char* path = getenv("FRAME_STATS_FILE"))
+  {
+    if (!window.m_app->m_frame_stats.Dump(path))
+      logger::Error("Can't write frame stats to %s", path);
+  }
+
+  return 0;
+}
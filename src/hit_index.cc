@@ -0,0 +1,418 @@
+#include "application.hh"
+
+#include <algorithm>
+#include <cassert>
+
+namespace application
+{
+  namespace gui
+  {
+    namespace
+    {
+      const uint32_t MaxEntriesPerLeaf = 4;
+      const uint32_t NoEntry = UINT32_MAX;
+
+      bool IsEmpty(int x0, int y0, int x1, int y1)
+      {
+        return x0 > x1 || y0 > y1;
+      }
+
+      template<typename A, typename B>
+      void Merge(A& into, B const& r)
+      {
+        if (IsEmpty(r.x0, r.y0, r.x1, r.y1)) return;
+        if (IsEmpty(into.x0, into.y0, into.x1, into.y1))
+        {
+          into.x0 = r.x0;
+          into.y0 = r.y0;
+          into.x1 = r.x1;
+          into.y1 = r.y1;
+          return;
+        }
+        into.x0 = std::min(into.x0, r.x0);
+        into.y0 = std::min(into.y0, r.y0);
+        into.x1 = std::max(into.x1, r.x1);
+        into.y1 = std::max(into.y1, r.y1);
+      }
+
+      template<typename R>
+      bool Contains(R const& r, int x, int y)
+      {
+        return x >= r.x0 && x <= r.x1 && y >= r.y0 && y <= r.y1;
+      }
+
+      long long Center(HitTestIndex::Entry const& e, int axis)
+      {
+        return axis == 0 ? (long long) e.x0 + e.x1 : (long long) e.y0 + e.y1;
+      }
+    }
+
+    bool HitTestIndex::IsValid(Widget* root)
+    {
+      WidgetTree& tree = GetWidgetTree();
+      return m_valid &&
+        root == m_root &&
+        tree.structure_version == m_structure_version &&
+        tree.layout_changed.empty() &&
+        !tree.layout_changed_overflow;
+    }
+
+    void HitTestIndex::Update(Widget* root)
+    {
+      WidgetTree& tree = GetWidgetTree();
+      if (!m_valid ||
+          root != m_root ||
+          tree.structure_version != m_structure_version ||
+          tree.layout_changed_overflow)
+      {
+        Build(root);
+        return;
+      }
+
+      if (tree.layout_changed.empty())
+        return;
+
+      std::vector<uint32_t> changed;
+      for (WidgetHandle node : tree.layout_changed)
+      {
+        uint32_t e = node < m_entry_of_node.size() ? m_entry_of_node[node] : NoEntry;
+        if (e == NoEntry)
+        {
+          // the widget was skipped because its layout was invalid, it needs
+          // a place in the index if its parent is indexed and tests it
+          WidgetHandle p = tree.parent[node];
+          if (p == InvalidWidgetHandle || m_entry_of_node[p] == NoEntry)
+            continue;
+          if (tree.widget[p]->GetType() == WidgetType::LayersType && tree.last_child[p] != node)
+            continue;
+          if (IsLayoutInfoValid(tree.layout[node]))
+          {
+            Build(root);
+            return;
+          }
+          continue;
+        }
+
+        if (tree.widget[node]->GetType() != WidgetType::LayersType &&
+            !IsLayoutInfoValid(tree.layout[node]))
+        {
+          Build(root);
+          return;
+        }
+        changed.push_back(e);
+      }
+      tree.layout_changed.clear();
+
+      // a moved widget moves its whole subtree, which is contiguous
+      std::sort(changed.begin(), changed.end());
+      std::vector<uint32_t> touched;
+      uint32_t covered_end = 0;
+      for (uint32_t e : changed)
+      {
+        if (e < covered_end) continue;
+        covered_end = e + m_entries[e].subtree_size;
+        for (uint32_t i = e; i < covered_end; ++i)
+          touched.push_back(i);
+      }
+
+      // refitting most of the entries produces a worse tree than building
+      if (touched.size() * 2 > m_entries.size())
+      {
+        Build(root);
+        return;
+      }
+
+      std::vector<uint32_t> leaves;
+      for (uint32_t e : touched)
+      {
+        ComputeRect(e);
+        leaves.push_back(m_leaf_of_entry[e]);
+      }
+      std::sort(leaves.begin(), leaves.end());
+      leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+      for (uint32_t leaf : leaves)
+        RefitLeaf(leaf);
+
+      m_refits++;
+    }
+
+    void HitTestIndex::Build(Widget* root)
+    {
+      WidgetTree& tree = GetWidgetTree();
+
+      m_entries.clear();
+      m_nodes.clear();
+      m_refs.clear();
+      m_entry_of_node.assign(tree.widget.size(), NoEntry);
+
+      if (root)
+        AddSubtree(root->m_node, NoEntry);
+
+      m_refs.resize(m_entries.size());
+      for (uint32_t i = 0; i < m_refs.size(); ++i)
+        m_refs[i] = i;
+      m_leaf_of_entry.assign(m_entries.size(), 0);
+
+      if (!m_refs.empty())
+        BuildNode(0, m_refs.size(), UINT32_MAX);
+
+      tree.layout_changed.clear();
+      tree.layout_changed_overflow = false;
+
+      m_root = root;
+      m_structure_version = tree.structure_version;
+      m_valid = true;
+      m_rebuilds++;
+    }
+
+    void HitTestIndex::AddSubtree(WidgetHandle node, uint32_t parent_entry)
+    {
+      WidgetTree& tree = GetWidgetTree();
+      bool layers = tree.widget[node]->GetType() == WidgetType::LayersType;
+
+      // same rule as the containers, a widget without layout is skipped
+      // together with its children
+      if (!layers && !IsLayoutInfoValid(tree.layout[node]))
+        return;
+
+      uint32_t e = m_entries.size();
+      m_entries.push_back({});
+      m_entries[e].node = node;
+      m_entries[e].parent_entry = parent_entry;
+      m_entry_of_node[node] = e;
+      ComputeRect(e);
+
+      if (layers)
+      {
+        // only the top layer receives the mouse
+        WidgetHandle top = tree.last_child[node];
+        if (top != InvalidWidgetHandle)
+          AddSubtree(top, e);
+      }
+      else
+      {
+        for (WidgetHandle child = tree.first_child[node]; child != InvalidWidgetHandle; child = tree.next_sibling[child])
+          AddSubtree(child, e);
+      }
+
+      m_entries[e].subtree_size = m_entries.size() - e;
+    }
+
+    void HitTestIndex::ComputeRect(uint32_t index)
+    {
+      WidgetTree& tree = GetWidgetTree();
+      Entry& e = m_entries[index];
+
+      e.ox = 0;
+      e.oy = 0;
+      e.clip_x0 = INT_MIN;
+      e.clip_y0 = INT_MIN;
+      e.clip_x1 = INT_MAX;
+      e.clip_y1 = INT_MAX;
+
+      if (e.parent_entry != NoEntry)
+      {
+        Entry const& p = m_entries[e.parent_entry];
+        LayoutInfo const& pl = tree.layout[p.node];
+        WidgetType ptype = tree.widget[p.node]->GetType();
+
+        e.clip_x0 = p.clip_x0;
+        e.clip_y0 = p.clip_y0;
+        e.clip_x1 = p.clip_x1;
+        e.clip_y1 = p.clip_y1;
+
+        // Layers passes the mouse position to its layers unchanged, the
+        // other widgets translate it into their own space
+        e.ox = p.ox;
+        e.oy = p.oy;
+        if (ptype != WidgetType::LayersType)
+        {
+          e.ox += pl.x;
+          e.oy += pl.y;
+        }
+
+        if (ptype == WidgetType::FileSelectorType || ptype == WidgetType::VirtualListType)
+        {
+          e.clip_x0 = std::max(e.clip_x0, p.x0);
+          e.clip_y0 = std::max(e.clip_y0, p.y0);
+          e.clip_x1 = std::min(e.clip_x1, p.x1);
+          e.clip_y1 = std::min(e.clip_y1, p.y1);
+        }
+      }
+
+      LayoutInfo const& l = tree.layout[e.node];
+      switch (tree.widget[e.node]->GetType())
+      {
+      case WidgetType::LayersType:
+      {
+        // Layers is hit everywhere
+        e.x0 = INT_MIN;
+        e.y0 = INT_MIN;
+        e.x1 = INT_MAX;
+        e.y1 = INT_MAX;
+      } break;
+      case WidgetType::FileSelectorType:
+      {
+        e.x0 = e.ox + l.x;
+        e.y0 = e.oy + l.y;
+        e.x1 = e.ox + l.x + l.width;
+        e.y1 = e.oy + l.y + l.height;
+      } break;
+      default:
+      {
+        // strict comparisons of Widget::HitTest
+        e.x0 = e.ox + l.x + 1;
+        e.y0 = e.oy + l.y + 1;
+        e.x1 = e.ox + l.x + l.width - 1;
+        e.y1 = e.oy + l.y + l.height - 1;
+      } break;
+      }
+
+      e.x0 = std::max(e.x0, e.clip_x0);
+      e.y0 = std::max(e.y0, e.clip_y0);
+      e.x1 = std::min(e.x1, e.clip_x1);
+      e.y1 = std::min(e.y1, e.clip_y1);
+    }
+
+    uint32_t HitTestIndex::BuildNode(uint32_t first, uint32_t count, uint32_t parent)
+    {
+      uint32_t index = m_nodes.size();
+      m_nodes.push_back({});
+      m_nodes[index].parent = parent;
+
+      BvhNode bounds = {};
+      for (uint32_t i = first; i < first + count; ++i)
+      {
+        Entry const& e = m_entries[m_refs[i]];
+        Merge(bounds, e);
+        bounds.min_entry = std::min(bounds.min_entry, m_refs[i]);
+        bounds.max_entry = std::max(bounds.max_entry, m_refs[i]);
+      }
+      m_nodes[index].x0 = bounds.x0;
+      m_nodes[index].y0 = bounds.y0;
+      m_nodes[index].x1 = bounds.x1;
+      m_nodes[index].y1 = bounds.y1;
+      m_nodes[index].min_entry = bounds.min_entry;
+      m_nodes[index].max_entry = bounds.max_entry;
+
+      if (count <= MaxEntriesPerLeaf)
+      {
+        m_nodes[index].first = first;
+        m_nodes[index].count = count;
+        for (uint32_t i = first; i < first + count; ++i)
+          m_leaf_of_entry[m_refs[i]] = index;
+        return index;
+      }
+
+      // split at the median along the axis where the centers spread most
+      long long min_c[2] = { LLONG_MAX, LLONG_MAX };
+      long long max_c[2] = { LLONG_MIN, LLONG_MIN };
+      for (uint32_t i = first; i < first + count; ++i)
+      {
+        for (int axis = 0; axis < 2; ++axis)
+        {
+          long long c = Center(m_entries[m_refs[i]], axis);
+          min_c[axis] = std::min(min_c[axis], c);
+          max_c[axis] = std::max(max_c[axis], c);
+        }
+      }
+      int axis = (max_c[0] - min_c[0]) >= (max_c[1] - min_c[1]) ? 0 : 1;
+
+      uint32_t mid = count / 2;
+      std::nth_element(
+        m_refs.begin() + first,
+        m_refs.begin() + first + mid,
+        m_refs.begin() + first + count,
+        [this, axis](uint32_t a, uint32_t b) {
+          return Center(m_entries[a], axis) < Center(m_entries[b], axis);
+        });
+
+      BuildNode(first, mid, index);
+      uint32_t right = BuildNode(first + mid, count - mid, index);
+      m_nodes[index].right = right;
+      return index;
+    }
+
+    void HitTestIndex::RefitLeaf(uint32_t leaf)
+    {
+      BvhNode& n = m_nodes[leaf];
+      n.x0 = 0;
+      n.y0 = 0;
+      n.x1 = -1;
+      n.y1 = -1;
+      for (uint32_t i = n.first; i < n.first + n.count; ++i)
+        Merge(n, m_entries[m_refs[i]]);
+
+      for (uint32_t p = n.parent; p != UINT32_MAX; p = m_nodes[p].parent)
+      {
+        BvhNode& inner = m_nodes[p];
+        inner.x0 = 0;
+        inner.y0 = 0;
+        inner.x1 = -1;
+        inner.y1 = -1;
+        Merge(inner, m_nodes[p + 1]);
+        Merge(inner, m_nodes[inner.right]);
+      }
+    }
+
+    uint32_t HitTestIndex::FirstHit(int x, int y, uint32_t lo, uint32_t hi)
+    {
+      uint32_t best = hi;
+
+      uint32_t stack[64];
+      int top = 0;
+      stack[top++] = 0;
+
+      while (top > 0)
+      {
+        uint32_t index = stack[--top];
+        BvhNode const& n = m_nodes[index];
+        if (n.min_entry >= best || n.max_entry < lo || !Contains(n, x, y)) continue;
+
+        if (n.count > 0)
+        {
+          for (uint32_t i = n.first; i < n.first + n.count; ++i)
+          {
+            uint32_t e = m_refs[i];
+            if (e >= lo && e < best && Contains(m_entries[e], x, y))
+              best = e;
+          }
+        }
+        else
+        {
+          // visit the child holding the earlier entries first, the other
+          // one is then often pruned by `best`
+          uint32_t left = index + 1;
+          uint32_t right = n.right;
+          if (m_nodes[right].min_entry < m_nodes[left].min_entry)
+            std::swap(left, right);
+          assert(top + 2 <= 64);
+          stack[top++] = right;
+          stack[top++] = left;
+        }
+      }
+
+      return best == hi ? NoEntry : best;
+    }
+
+    Widget* HitTestIndex::HitTest(int x, int y)
+    {
+      if (m_nodes.empty()) return NULL;
+
+      uint32_t result = FirstHit(x, y, 0, m_entries.size());
+      if (result == NoEntry) return NULL;
+
+      // Widget::HitTest descends into the first child that has a hit in its
+      // subtree, which is the subtree holding the next hit in pre-order
+      for (;;)
+      {
+        uint32_t next = FirstHit(x, y, result + 1, result + m_entries[result].subtree_size);
+        if (next == NoEntry)
+          break;
+        result = next;
+      }
+
+      return GetWidgetTree().widget[m_entries[result].node];
+    }
+  } // namespace gui
+} // namespace application
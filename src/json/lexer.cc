@@ -0,0 +1,151 @@
+#include <algorithm>
+#include "lexer.hh"
+
+using application::TokenKind;
+using application::TokenSpan;
+
+namespace json
+{
+  namespace
+  {
+    bool IsSpace(char c)
+    {
+      return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    bool IsPunctuation(char c)
+    {
+      return c == '{' || c == '}' || c == '[' || c == ']' || c == ',' || c == ':';
+    }
+
+    // end of the bytes that can't be anything else than a number, a keyword
+    // or junk, which the caller tells apart
+    size_t WordEnd(std::string_view line, size_t i)
+    {
+      while (i < line.size() && !IsSpace(line[i]) && !IsPunctuation(line[i]) && line[i] != '"' && line[i] != '/')
+        i++;
+      return i;
+    }
+
+    bool IsNumber(std::string_view word)
+    {
+      size_t i = 0;
+      auto digits = [&] {
+        size_t start = i;
+        while (i < word.size() && word[i] >= '0' && word[i] <= '9')
+          i++;
+        return i > start;
+      };
+
+      if (i < word.size() && word[i] == '-')
+        i++;
+      if (!digits())
+        return false;
+      if (i < word.size() && word[i] == '.')
+      {
+        i++;
+        if (!digits())
+          return false;
+      }
+      if (i < word.size() && (word[i] == 'e' || word[i] == 'E'))
+      {
+        i++;
+        if (i < word.size() && (word[i] == '+' || word[i] == '-'))
+          i++;
+        if (!digits())
+          return false;
+      }
+      return i == word.size();
+    }
+  }
+
+  uint32_t Lexer::LexLine(std::string_view line, uint32_t state, std::vector<TokenSpan>* spans) const
+  {
+    auto add = [&](size_t start, size_t end, TokenKind kind) {
+      if (!spans)
+        return;
+      // punctuation in a row makes one span
+      if (!spans->empty() && spans->back().kind == kind && kind == TokenKind::Punctuation &&
+          spans->back().offset + spans->back().length == start)
+        spans->back().length += (uint32_t) (end - start);
+      else
+        spans->push_back({ (uint32_t) start, (uint32_t) (end - start), kind });
+    };
+
+    size_t i = 0;
+    if (state == BlockComment)
+    {
+      size_t end = line.find("*/");
+      if (end == std::string_view::npos)
+      {
+        add(0, line.size(), TokenKind::Comment);
+        return BlockComment;
+      }
+      add(0, end + 2, TokenKind::Comment);
+      i = end + 2;
+    }
+
+    while (i < line.size())
+    {
+      char c = line[i];
+      size_t start = i;
+      if (IsSpace(c))
+      {
+        i++;
+      }
+      else if (IsPunctuation(c))
+      {
+        add(start, ++i, TokenKind::Punctuation);
+      }
+      else if (c == '"')
+      {
+        for (i++; i < line.size() && line[i] != '"'; ++i)
+        {
+          if (line[i] == '\\')
+            i++;
+        }
+        if (i >= line.size())
+        {
+          // unterminated
+          add(start, line.size(), TokenKind::Invalid);
+          return Value;
+        }
+        i++;
+
+        size_t next = i;
+        while (next < line.size() && IsSpace(line[next]))
+          next++;
+        add(start, i, next < line.size() && line[next] == ':' ? TokenKind::Key : TokenKind::String);
+      }
+      else if (c == '/' && i + 1 < line.size() && line[i + 1] == '/')
+      {
+        add(start, line.size(), TokenKind::Comment);
+        return Value;
+      }
+      else if (c == '/' && i + 1 < line.size() && line[i + 1] == '*')
+      {
+        size_t end = line.find("*/", i + 2);
+        if (end == std::string_view::npos)
+        {
+          add(start, line.size(), TokenKind::Comment);
+          return BlockComment;
+        }
+        i = end + 2;
+        add(start, i, TokenKind::Comment);
+      }
+      else
+      {
+        // a lone '/' is junk too
+        i = std::max(WordEnd(line, i), i + 1);
+        std::string_view word = line.substr(start, i - start);
+        if (word == "true" || word == "false" || word == "null")
+          add(start, i, TokenKind::Keyword);
+        else if (IsNumber(word))
+          add(start, i, TokenKind::Number);
+        else
+          add(start, i, TokenKind::Invalid);
+      }
+    }
+    return Value;
+  }
+}
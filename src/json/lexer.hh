@@ -0,0 +1,21 @@
+#pragma once
+
+#include "../syntax.hh"
+
+namespace json
+{
+  // Colours JSON for the TextBox, with the // and /* */ comments of config
+  // files. A string followed by a colon is a key. Strings can't span lines,
+  // so the only state carried from one line to the next is being inside a
+  // block comment.
+  struct Lexer: public application::Lexer
+  {
+    enum State: uint32_t
+    {
+      Value = application::Lexer::Initial,
+      BlockComment,
+    };
+
+    uint32_t LexLine(std::string_view line, uint32_t state, std::vector<application::TokenSpan>* spans) const override;
+  };
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include "load.hh"
+#include "platform.hh"
+#include "utf8.hh"
+
+namespace application
+{
+  namespace
+  {
+    bool IsContinuation(char c)
+    {
+      return (c & 0xc0) == 0x80;
+    }
+
+    // `text` cut to at most `size` bytes, after a newline when there is
+    // one, otherwise before a character
+    std::string_view CutPreview(std::string_view text, size_t size)
+    {
+      if (text.size() <= size)
+        return text;
+      std::string_view preview = text.substr(0, size);
+      size_t newline = preview.rfind('\n');
+      if (newline != std::string_view::npos)
+        return preview.substr(0, newline + 1);
+      while (!preview.empty() && IsContinuation(text[preview.size()]))
+        preview.remove_suffix(1);
+      return preview;
+    }
+  }
+
+  std::shared_ptr<LoadJob> LoadJob::Start(ThreadPool& pool, std::string filename, Callbacks callbacks)
+  {
+    auto job = std::make_shared<LoadJob>();
+
+    pool.Submit([job, filename = std::move(filename), callbacks = std::move(callbacks)] {
+      if (job->Cancelled())
+        return;
+      // mapping costs nothing, the pages are read as they are touched
+      std::shared_ptr<platform::MappedFile> file = platform::MapFile(filename);
+      if (!file)
+      {
+        if (!job->Cancelled() && callbacks.on_done)
+          callbacks.on_done({}, false, false);
+        return;
+      }
+
+      std::string_view text = file->Text();
+      job->m_size = text.size();
+      if (text.size() > PreviewBytes && callbacks.on_preview)
+        callbacks.on_preview(file, CutPreview(text, PreviewBytes));
+
+      // each section is checked up to its last character, the bytes of one
+      // that straddles two sections are checked with the next
+      bool valid_utf8 = true;
+      size_t validated = 0;
+      Document document;
+      bool indexed = document.SetText(file, text, [&](size_t indexed) {
+        if (valid_utf8)
+        {
+          size_t end = indexed;
+          while (end < text.size() && end > validated && IsContinuation(text[end]))
+            end--;
+          valid_utf8 = utf8::Validate(text.substr(validated, end - validated));
+          validated = end;
+        }
+
+        job->m_indexed = indexed;
+        if (job->Cancelled())
+          return false;
+        if (callbacks.on_progress)
+          callbacks.on_progress(job->Progress());
+        return true;
+      });
+
+      if (indexed && !job->Cancelled() && callbacks.on_done)
+        callbacks.on_done(std::move(document), true, valid_utf8);
+    });
+    return job;
+  }
+
+  double LoadJob::Progress() const
+  {
+    size_t size = m_size.load();
+    return size ? (double) m_indexed.load() / size : 0.0;
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "document.hh"
+#include "thread_pool.hh"
+
+namespace application
+{
+  // A file opened on a thread pool. The start of the file is handed out as
+  // soon as it is read so that it can be shown, then the lines are indexed
+  // and the UTF-8 checked a section at a time and the document handed out
+  // once they all are. Nothing is copied, the document points into the
+  // mapped file.
+  struct LoadJob
+  {
+    // most bytes of the preview, cut after its last whole line
+    static constexpr size_t PreviewBytes = 64 * 1024;
+
+    struct Callbacks
+    {
+      // The start of a file larger than PreviewBytes, `owner` keeps it
+      // alive
+      std::function<void(std::shared_ptr<const void> owner, std::string_view preview)> on_preview;
+      // Fraction of the file indexed, after every section
+      std::function<void(double progress)> on_progress;
+      // `opened` is false when the file couldn't be read, `valid_utf8`
+      // when some of its bytes aren't UTF-8
+      std::function<void(Document document, bool opened, bool valid_utf8)> on_done;
+    };
+
+    std::atomic<bool> m_cancelled { false };
+    std::atomic<size_t> m_indexed { 0 };
+    // 0 until the file is mapped
+    std::atomic<size_t> m_size { 0 };
+
+    // The callbacks run on the pool thread, none once the job is cancelled
+    static std::shared_ptr<LoadJob> Start(ThreadPool& pool, std::string filename, Callbacks callbacks);
+
+    void Cancel() { m_cancelled = true; }
+    bool Cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+    // Fraction of the file indexed so far
+    double Progress() const;
+  };
+}
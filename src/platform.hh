@@ -3,6 +3,11 @@
 #include "logger.hh"
 #include <chrono>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 namespace application::gui
 {
 	struct Widget;
@@ -20,8 +25,29 @@ namespace platform
 
 
 	bool WriteFile(std::string name, std::string content);
+	// Writes the chunks `next` returns, until it returns false, to a
+	// temporary file next to `name`, flushes it to the disk and renames it
+	// over `name`. `name` holds either its old or its new content whatever
+	// happens during the save.
+	bool WriteFileAtomic(std::string name, std::function<bool(std::string_view&)> const& next);
 	std::string ReadFile(std::string name);
 
+	// Read-only bytes of a whole file, mapped in memory so that opening it
+	// costs nothing until pages are touched, and the pages can be dropped
+	// and read again by the system instead of being copied. Files that
+	// can't be mapped are read instead.
+	struct MappedFile
+	{
+		char const* data = NULL;
+		size_t size = 0;
+
+		virtual ~MappedFile() = default;
+		std::string_view Text() const { return std::string_view(data, size); }
+	};
+
+	// NULL when the file can't be opened
+	std::shared_ptr<MappedFile> MapFile(std::string name);
+
 
 
 	std::vector<std::string> ReadPath(std::string);
@@ -0,0 +1,644 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <utility>
+#include "logger.hh"
+#include "platform.hh"
+#include "platform_headless.hh"
+#include "application.hh"
+#include "utf8.hh"
+
+
+namespace platform
+{
+  Timestamp CurrentTimestamp()
+  {
+    return std::chrono::steady_clock::now();
+  }
+  Duration DurationFrom(Timestamp to, Timestamp from)
+  {
+    return std::chrono::duration_cast<Duration>(to - from);
+  }
+
+  std::vector<std::string> ReadPath(std::string path)
+  {
+    DIR* dir = opendir(path.c_str());
+    if (!dir)
+      return {};
+
+    std::vector<std::string> out;
+    while (dirent* entry = readdir(dir))
+    {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..")
+        continue;
+      out.push_back(std::move(name));
+    }
+    closedir(dir);
+
+    out.push_back("..");
+    return out;
+  }
+
+  std::string CurrentPath()
+  {
+    char* cwd = getcwd(NULL, 0);
+    if (!cwd)
+      return {};
+    std::string out = cwd;
+    free(cwd);
+    return out;
+  }
+
+  bool IsFile(std::string path)
+  {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+  }
+  bool IsDirectory(std::string path)
+  {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+  }
+
+  std::string AppendSegment(std::string basepath, std::string name)
+  {
+    std::string out = basepath;
+    if (out.empty() || out[0] != '/')
+    {
+      std::string cwd = CurrentPath();
+      out = out.empty() ? cwd : cwd + "/" + out;
+    }
+    if (out.back() != '/')
+      out += '/';
+    out += name;
+    return out;
+  }
+
+  bool WriteAll(int fd, std::string_view bytes)
+  {
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+      ssize_t n = write(fd, bytes.data() + written, bytes.size() - written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      written += n;
+    }
+    return true;
+  }
+
+  bool WriteFile(std::string filename, std::string content)
+  {
+    bool done = false;
+    return WriteFileAtomic(filename, [&](std::string_view& chunk) {
+      chunk = content;
+      return !std::exchange(done, true);
+    });
+  }
+
+  bool WriteFileAtomic(std::string name, std::function<bool(std::string_view&)> const& next)
+  {
+    // in the same directory, a rename can't cross file systems
+    std::string temp = name + ".XXXXXX";
+    int fd = mkstemp(temp.data());
+    if (fd < 0)
+    {
+      logger::Error("Cant write to file");
+      return false;
+    }
+
+    // mkstemp makes the file private, keep the mode of the replaced file
+    struct stat st;
+    fchmod(fd, stat(name.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644);
+
+    bool ok = true;
+    std::string_view chunk;
+    while (ok && next(chunk))
+      ok = WriteAll(fd, chunk);
+
+    // the content reaches the disk before the rename makes it visible
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(temp.c_str(), name.c_str()) == 0;
+    if (!ok)
+    {
+      unlink(temp.c_str());
+      logger::Error("Cant write to file");
+      return false;
+    }
+
+    // and the rename is made durable with the directory
+    std::string directory = std::filesystem::path(name).parent_path().string();
+    int dir = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir >= 0)
+    {
+      fsync(dir);
+      close(dir);
+    }
+    return true;
+  }
+
+  std::string ReadFile(std::string name)
+  {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return {};
+
+    std::string out;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      out.reserve(st.st_size);
+
+    char buffer[64 * 1024];
+    for (;;)
+    {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      out.append(buffer, n);
+    }
+
+    close(fd);
+    return out;
+  }
+
+  struct PosixMappedFile : public MappedFile
+  {
+    void* mapping = NULL;
+    // what couldn't be mapped is read here
+    std::string bytes;
+
+    ~PosixMappedFile() override
+    {
+      if (mapping)
+        munmap(mapping, size);
+    }
+  };
+
+  std::shared_ptr<MappedFile> MapFile(std::string name)
+  {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return NULL;
+
+    auto file = std::make_shared<PosixMappedFile>();
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED)
+      {
+        file->mapping = mapping;
+        file->data = (char const*) mapping;
+        file->size = st.st_size;
+      }
+    }
+    close(fd);
+
+    if (!file->mapping)
+    {
+      file->bytes = ReadFile(name);
+      file->data = file->bytes.data();
+      file->size = file->bytes.size();
+    }
+    return file;
+  }
+
+  void Record(RenderContext* render_context, DrawCommand::Type type, application::gui::Widget* widget, application::gui::LayoutInfo const& layout, application::gui::Color color = {}, std::string text = {})
+  {
+    render_context->commands.push_back(DrawCommand {
+      .type = type,
+      .widget = widget,
+      .x = render_context->x + layout.x,
+      .y = render_context->y + layout.y,
+      .width = (float) layout.width,
+      .height = (float) layout.height,
+      .color = color,
+      .text = std::move(text),
+    });
+  }
+
+  // Stands for the shaped text of the Win32 backend, so the text layout
+  // cache sees the same lookups here
+  struct HeadlessTextLayout : public application::TextLayout
+  {
+  };
+
+  void ShapeText(std::string_view text, int width, int height)
+  {
+    application::TextLayoutCache& cache = application::GetTextLayoutCache();
+    if (!cache.Find(text, 0, width, height))
+      cache.Insert(text, 0, width, height, std::make_unique<HeadlessTextLayout>(), text.size() * 24 + 1024);
+  }
+
+  // Draws the children of `node` translated by `layout`
+  void DrawChildren(RenderContext* render_context, application::gui::InteractionContext const& interaction_context, application::gui::WidgetHandle node, application::gui::LayoutInfo const& layout)
+  {
+    float parent_x = render_context->x;
+    float parent_y = render_context->y;
+    render_context->x += layout.x;
+    render_context->y += layout.y;
+
+    application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+    for (auto child = tree.first_child[node]; child != application::gui::InvalidWidgetHandle; child = tree.next_sibling[child])
+    {
+      tree.widget[child]->Draw(render_context, interaction_context);
+    }
+
+    render_context->x = parent_x;
+    render_context->y = parent_y;
+  }
+
+  struct PlatformRectangle : public application::gui::Rectangle
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("Rectangle::Draw");
+      if (!IsLayoutInfoValid(layout))
+      {
+        logger::Error("Call draw without layout");
+      }
+
+      bool active = interaction_context.active == this ||
+                    interaction_context.hot    == this;
+      Record(render_context, DrawCommand::FillRectangle, this, layout,
+        active ? m_bg_active_color : m_bg_default_color);
+    }
+  };
+
+  struct PlatformVerticalContainer: public application::gui::VerticalContainer
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("VerticalContainer::Draw");
+      if (!IsLayoutInfoValid(layout)) return;
+
+      DrawChildren(render_context, interaction_context, m_node, layout);
+    }
+  };
+
+  struct PlatformHorizontalContainer: public application::gui::HorizontalContainer
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      if (!IsLayoutInfoValid(layout)) return;
+      logger::Debug("HorizontalContainer::Draw");
+
+      DrawChildren(render_context, interaction_context, m_node, layout);
+    }
+  };
+
+  struct PlatformButton: public application::gui::Button
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("Button::Draw");
+      if (!IsLayoutInfoValid(layout))
+      {
+        logger::Error("Call draw without layout");
+        return;
+      }
+
+      bool active = interaction_context.about_to_active == this ||
+                    interaction_context.hot             == this;
+      Record(render_context, DrawCommand::FillRectangle, this, layout,
+        active ? m_bg_active_color : m_bg_default_color);
+      ShapeText(m_text, layout.width, layout.height);
+      Record(render_context, DrawCommand::DrawText, this, layout, m_fg_default_color, m_text);
+    }
+  };
+
+  struct PlatformTextBox: public application::gui::TextBox
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("TextBox::Draw");
+      if (!IsLayoutInfoValid(layout))
+      {
+        logger::Error("Call draw without layout");
+        return;
+      }
+
+      Record(render_context, DrawCommand::FillRectangle, this, layout, m_bg_default_color);
+
+      // same caret blink as the Win32 text box
+      static unsigned long n = 0;
+
+      size_t caret = std::string::npos;
+      std::string tmp_text = GetVisibleText(&caret);
+      std::vector<application::TokenSpan> spans;
+      GetVisibleSpans(tmp_text, spans);
+
+      // shaped line by line like on Win32
+      for (size_t start = 0; start <= tmp_text.size(); )
+      {
+        size_t end = std::min(tmp_text.find('\n', start), tmp_text.size());
+        ShapeText(std::string_view(tmp_text).substr(start, end - start), layout.width, m_line_height);
+        start = end + 1;
+      }
+
+      if (interaction_context.active == this)
+      {
+        if (interaction_context.keys_pressed.empty())
+        {
+          n++;
+        }
+        else
+        {
+          n = 0;
+        }
+        // there are no text metrics here, the caret is drawn in the text
+        if (n % 60 < 30 && caret != std::string::npos)
+        {
+          tmp_text.insert(caret, 1, '_');
+          for (application::TokenSpan& span : spans)
+          {
+            if (span.offset >= caret)
+              span.offset++;
+            else if (span.offset + span.length > caret)
+              span.length++;
+          }
+        }
+      }
+
+      Record(render_context, DrawCommand::DrawText, this, layout, m_fg_default_color, std::move(tmp_text));
+      render_context->commands.back().spans = std::move(spans);
+    }
+  };
+
+  struct PlatformLayers : public application::gui::Layers
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("Layers::Draw");
+      if (!IsLayoutInfoValid(layout))
+      {
+        logger::Error("Call draw without layout");
+      }
+
+      DrawChildren(render_context, interaction_context, m_node, layout);
+    }
+  };
+
+  struct PlatformVirtualList : public application::gui::VirtualList
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("VirtualList::Draw");
+      if (!IsLayoutInfoValid(layout)) return;
+
+      Record(render_context, DrawCommand::PushClip, this, layout);
+
+      float parent_x = render_context->x;
+      float parent_y = render_context->y;
+      render_context->x += layout.x;
+      render_context->y += layout.y;
+
+      // unbound rows of the pool have no layout
+      application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+      for (auto child = tree.first_child[m_node]; child != application::gui::InvalidWidgetHandle; child = tree.next_sibling[child])
+      {
+        if (IsLayoutInfoValid(tree.layout[child]))
+          tree.widget[child]->Draw(render_context, interaction_context);
+      }
+
+      render_context->x = parent_x;
+      render_context->y = parent_y;
+
+      Record(render_context, DrawCommand::PopClip, this, layout);
+    }
+  };
+
+  struct PlatformFileSelector : public application::gui::FileSelector
+  {
+      void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+      {
+        application::gui::LayoutInfo layout = GetLayout();
+        logger::Debug("FileSelector::Draw");
+        if (!IsLayoutInfoValid(layout)) return;
+
+        float parent_x = render_context->x;
+        float parent_y = render_context->y;
+        render_context->x += layout.x;
+        render_context->y += layout.y;
+
+        m_file_list->Draw(render_context, interaction_context);
+        m_action_row->Draw(render_context, interaction_context);
+
+        render_context->x = parent_x;
+        render_context->y = parent_y;
+      }
+  };
+
+  application::gui::Widget*
+  NewWidget(int type)
+  {
+      switch (type)
+      {
+      case application::gui::WidgetType::RectangleType:
+      {
+          return new PlatformRectangle();
+      } break;
+      case application::gui::WidgetType::VerticalContainerType:
+      {
+          return new PlatformVerticalContainer();
+      } break;
+      case application::gui::WidgetType::HorizontalContainerType:
+      {
+          return new PlatformHorizontalContainer();
+      } break;
+      case application::gui::WidgetType::ButtonType:
+      {
+          return new PlatformButton();
+      } break;
+      case application::gui::WidgetType::TextBoxType:
+      {
+          return new PlatformTextBox();
+      } break;
+      case application::gui::WidgetType::LayersType:
+      {
+          return new PlatformLayers();
+      } break;
+      case application::gui::WidgetType::FileSelectorType:
+      {
+          return new PlatformFileSelector();
+      } break;
+      case application::gui::WidgetType::VirtualListType:
+      {
+          return new PlatformVirtualList();
+      } break;
+      default:
+      {
+        std::unreachable();
+      }
+    }
+  }
+
+  HeadlessWindow::HeadlessWindow(int width, int height)
+    : m_width { width },
+      m_height { height }
+  {
+    m_app = new application::gui::Application();
+    // events sent before a Frame call belong to that frame
+    m_app->m_frame_stats.BeginFrame();
+  }
+
+  HeadlessWindow::~HeadlessWindow()
+  {
+    delete m_app;
+  }
+
+  void HeadlessWindow::Resize(int width, int height)
+  {
+    m_width = width;
+    m_height = height;
+  }
+
+  void HeadlessWindow::Frame()
+  {
+    application::gui::LayoutConstraint constraint = {
+      .max_width = m_width,
+      .max_height = m_height,
+      .x = 0,
+      .y = 0
+    };
+
+    m_render_context.commands.clear();
+    m_render_context.x = 0;
+    m_render_context.y = 0;
+    m_app->Render(&constraint, &m_render_context);
+
+    application::FrameStats& stats = m_app->m_frame_stats;
+    stats.EndFrame();
+    stats.BeginFrame();
+  }
+
+  void SendMouseEvent(application::gui::Application* app, int state, int x, int y)
+  {
+    application::gui::MouseEvent e;
+    e.state = state;
+    e.x = x;
+    e.y = y;
+    e.timestamp = CurrentTimestamp();
+
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::MouseEventType,
+      .mouse_event = e,
+    };
+
+    app->ProcessEvent(&event);
+  }
+
+  void HeadlessWindow::MouseMove(int x, int y)
+  {
+    SendMouseEvent(m_app, application::gui::MouseState::Move, x, y);
+  }
+
+  void HeadlessWindow::MouseDown(int x, int y)
+  {
+    SendMouseEvent(m_app, application::gui::MouseState::Down, x, y);
+  }
+
+  void HeadlessWindow::MouseUp(int x, int y)
+  {
+    SendMouseEvent(m_app, application::gui::MouseState::Up, x, y);
+  }
+
+  void HeadlessWindow::Click(int x, int y)
+  {
+    MouseMove(x, y);
+    MouseDown(x, y);
+    MouseUp(x, y);
+  }
+
+  void HeadlessWindow::MouseWheel(int x, int y, int delta)
+  {
+    application::gui::MouseWheelEvent e;
+    e.x = x;
+    e.y = y;
+    e.delta = delta;
+
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::MouseWheelEventType,
+      .mouse_wheel_event = e,
+    };
+
+    m_app->ProcessEvent(&event);
+  }
+
+  void HeadlessWindow::Char(uint32_t c)
+  {
+    application::gui::KeyboardEvent e;
+
+    e.key_press = 0;
+    e.modifier = 0;
+    e.key_length = 0;
+    e.virtual_key = -1;
+
+    e.key_length = utf8::Encode(c, (char*) &e.key_press);
+
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::KeyboardEventType,
+        .keyboard_event = e
+    };
+
+    m_app->ProcessEvent(&event);
+  }
+  void HeadlessWindow::Text(std::string_view text)
+  {
+    m_app->InsertText(text);
+  }
+
+  void HeadlessWindow::Key(int virtual_key, int modifier)
+  {
+    application::gui::KeyboardEvent e;
+
+    e.key_press = 0;
+    e.modifier = modifier;
+    e.key_length = 0;
+    e.virtual_key = virtual_key;
+
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::KeyboardEventType,
+        .keyboard_event = e
+    };
+
+    m_app->ProcessEvent(&event);
+  }
+} // namespace platform
+
+namespace logger
+{
+  void Init()
+  {
+    char* level = getenv("LOG_LEVEL");
+    if (!level)
+    {
+      current_log_level = normal;
+    }
+    else
+    {
+      char c = level[0];
+      current_log_level = c - '0';
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "application.hh"
+
+// Headless platform: widgets record their draw calls instead of rendering,
+// so the application core runs on machines without a window system.
+namespace platform
+{
+  struct DrawCommand
+  {
+    enum Type
+    {
+      FillRectangle,
+      DrawText,
+      PushClip,
+      PopClip,
+    };
+
+    Type type;
+    application::gui::Widget* widget = NULL;
+    // window coordinates, the widget translations are already applied
+    float x = 0;
+    float y = 0;
+    float width = 0;
+    float height = 0;
+    application::gui::Color color = {};
+    std::string text;
+    // colours of parts of `text`, offsets in it
+    std::vector<application::TokenSpan> spans;
+  };
+
+  struct RenderContext
+  {
+    std::vector<DrawCommand> commands;
+
+    // translation of the widget being drawn
+    float x = 0;
+    float y = 0;
+  };
+
+  // Owns an Application and feeds it frames and input the way the Win32
+  // MainWindow does, without any window.
+  struct HeadlessWindow
+  {
+    application::gui::Application* m_app = NULL;
+    RenderContext m_render_context;
+    int m_width = 0;
+    int m_height = 0;
+
+    HeadlessWindow(int width, int height);
+    HeadlessWindow(HeadlessWindow const&) = delete;
+    ~HeadlessWindow();
+
+    void Resize(int width, int height);
+    // Lays out and draws one frame, m_render_context.commands holds its
+    // draw calls afterwards.
+    void Frame();
+
+    void MouseMove(int x, int y);
+    void MouseDown(int x, int y);
+    void MouseUp(int x, int y);
+    void Click(int x, int y);
+    void MouseWheel(int x, int y, int delta);
+    // `codepoint` is encoded to utf-8 like a WM_CHAR message
+    void Char(uint32_t codepoint);
+    // A paste, sent as one TextInputEvent
+    void Text(std::string_view text);
+    // `virtual_key` is a Virtual_KeyCode, `modifier` KeyModifier bits
+    void Key(int virtual_key, int modifier = 0);
+  };
+}
@@ -11,6 +11,7 @@
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <set>
 #include <chrono>
 #include <cassert>
@@ -19,10 +20,10 @@
 #include <fstream>
 #include <thread>
 #include <filesystem>
-#include <codecvt>
 #include "logger.hh"
 #include "platform.hh"
 #include "application.hh"
+#include "utf8.hh"
 
 
 namespace platform
@@ -80,11 +81,7 @@ namespace platform
 
   std::wstring ConvertToPlatform(std::string s)
   {
-    std::wstring out(s.size(), wchar_t {});
-
-    if (0 == MultiByteToWideChar(CP_UTF8, MB_PRECOMPOSED, s.c_str(), s.size(), &out[0], s.size()))
-      return {};
-    return out;
+    return utf8::ToWide(s);
   }
 
   struct RenderContext
@@ -102,6 +99,44 @@ namespace platform
     (*i) = 0;
   }
 
+  // DirectWrite layout kept in the text layout cache
+  struct Win32TextLayout : public application::TextLayout
+  {
+    IDWriteTextLayout* layout = NULL;
+
+    ~Win32TextLayout() override
+    {
+      if (layout)
+        SafeRelease(&layout);
+    }
+  };
+
+  // Shapes `text` only the first time it is drawn with this format in a box
+  // of this size
+  IDWriteTextLayout* CachedTextLayout(RenderContext* render_context, std::string_view text, IDWriteTextFormat* format, float width, float height)
+  {
+    application::TextLayoutCache& cache = application::GetTextLayoutCache();
+    if (auto* cached = static_cast<Win32TextLayout*>(cache.Find(text, (uintptr_t) format, (int) width, (int) height)))
+      return cached->layout;
+
+    std::wstring wide = utf8::ToWide(text);
+
+    auto entry = std::make_unique<Win32TextLayout>();
+    HRESULT hr = render_context->dwrite_factory->CreateTextLayout(
+      wide.c_str(),
+      wide.size(),
+      format,
+      width,
+      height,
+      &entry->layout);
+    if (FAILED(hr)) return NULL;
+
+    // glyph indices, advances and offsets of every character plus the runs
+    size_t bytes = wide.size() * 24 + 1024;
+    auto* inserted = static_cast<Win32TextLayout*>(cache.Insert(text, (uintptr_t) format, (int) width, (int) height, std::move(entry), bytes));
+    return inserted->layout;
+  }
+
   D2D1_COLOR_F ConvertToD2D1Color(application::gui::Color color)
   {
     return D2D1::ColorF(
@@ -115,8 +150,9 @@ namespace platform
   {
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
+      application::gui::LayoutInfo layout = GetLayout();
       logger::Debug("Rectangle::Draw");
-      if (!IsLayoutInfoValid(m_layout))
+      if (!IsLayoutInfoValid(layout))
       {
         logger::Error("Call draw without layout");
       }
@@ -137,9 +173,9 @@ namespace platform
 
       D2D1_RECT_F rec = D2D1::RectF(
         0, 0,
-        m_layout.width, m_layout.height);
+        layout.width, layout.height);
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
 
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
 
@@ -164,20 +200,21 @@ namespace platform
   {
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
+      application::gui::LayoutInfo layout = GetLayout();
       logger::Debug("VerticalContainer::Draw");
-      if (!IsLayoutInfoValid(m_layout)) return;
+      if (!IsLayoutInfoValid(layout)) return;
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
       render_context->render_target->GetTransform(&parent_translation);
 
       my_translation = parent_translation * my_translation;
 
       render_context->render_target->SetTransform(my_translation);
-      for (auto it = m_children.begin(); it != m_children.end(); ++it)
+      application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+      for (auto child = tree.first_child[m_node]; child != application::gui::InvalidWidgetHandle; child = tree.next_sibling[child])
       {
-          Widget* widget = it->get();
-        widget->Draw(render_context, interaction_context);
+        tree.widget[child]->Draw(render_context, interaction_context);
       }
       render_context->render_target->SetTransform(parent_translation);
 
@@ -188,20 +225,21 @@ namespace platform
   {
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
-      if (!IsLayoutInfoValid(m_layout)) return;
+      application::gui::LayoutInfo layout = GetLayout();
+      if (!IsLayoutInfoValid(layout)) return;
       logger::Debug("HorizontalContainer::Draw");
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
       render_context->render_target->GetTransform(&parent_translation);
 
       my_translation = parent_translation * my_translation;
 
       render_context->render_target->SetTransform(my_translation);
-      for (auto it = m_children.begin(); it != m_children.end(); ++it)
+      application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+      for (auto child = tree.first_child[m_node]; child != application::gui::InvalidWidgetHandle; child = tree.next_sibling[child])
       {
-        Widget* widget = it->get();
-        widget->Draw(render_context, interaction_context);
+        tree.widget[child]->Draw(render_context, interaction_context);
       }
       render_context->render_target->SetTransform(parent_translation);
 
@@ -212,8 +250,9 @@ namespace platform
   {
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
+      application::gui::LayoutInfo layout = GetLayout();
       logger::Debug("Button::Draw");
-      if (!IsLayoutInfoValid(m_layout))
+      if (!IsLayoutInfoValid(layout))
       {
         logger::Error("Call draw without layout");
         return;
@@ -244,10 +283,10 @@ namespace platform
 
       D2D1_RECT_F rec = D2D1::RectF(
         0, 0,
-        m_layout.width, m_layout.height);
+        layout.width, layout.height);
 
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
 
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
 
@@ -262,15 +301,14 @@ namespace platform
         brush
       );
 
-      std::wstring_convert<std::codecvt_utf8<wchar_t>> converter{};
-
-      auto text = converter.from_bytes(m_text);
-      render_context->render_target->DrawText(
-        text.c_str(),
-        text.size(),
-        render_context->text_format,
-        rec,
-        text_brush);
+      IDWriteTextLayout* text_layout = CachedTextLayout(render_context, m_text, render_context->text_format, layout.width, layout.height);
+      if (text_layout)
+      {
+        render_context->render_target->DrawTextLayout(
+          D2D1::Point2F(0, 0),
+          text_layout,
+          text_brush);
+      }
 
       render_context->render_target->SetTransform(parent_translation);
 
@@ -285,6 +323,7 @@ namespace platform
 
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
+      application::gui::LayoutInfo layout = GetLayout();
       if (!m_text_format)
       {
         InitTextFormat(render_context);
@@ -296,7 +335,7 @@ namespace platform
       }
 
       logger::Debug("TextBox::Draw");
-      if (!IsLayoutInfoValid(m_layout))
+      if (!IsLayoutInfoValid(layout))
       {
         logger::Error("Call draw without layout");
         return;
@@ -306,7 +345,7 @@ namespace platform
       {
         for (char c : interaction_context.keys_pressed)
         {
-          m_text.push_back((wchar_t) c);
+          Insert(std::string_view(&c, 1));
         }
       }
 
@@ -326,10 +365,10 @@ namespace platform
 
       D2D1_RECT_F rec = D2D1::RectF(
         0, 0,
-        m_layout.width, m_layout.height);
+        layout.width, layout.height);
 
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
 
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
 
@@ -346,8 +385,10 @@ namespace platform
 
       static unsigned long n = 0;
 
-      std::string tmp_text = m_text;
+      size_t caret = std::string::npos;
+      std::string tmp_text = GetVisibleText(&caret);
 
+      bool draw_caret = false;
       if (interaction_context.active == this)
       {
         if (interaction_context.keys_pressed.empty())
@@ -358,37 +399,82 @@ namespace platform
         {
           n = 0;
         }
-        if (n % 60 < 30)
-        {
-          tmp_text += '_';
-        }
+        draw_caret = n % 60 < 30 && caret != std::string::npos;
       }
 
-      IDWriteTextLayout* layout;
-
+      std::vector<application::TokenSpan> spans;
+      GetVisibleSpans(tmp_text, spans);
+      size_t span = 0;
+      // created for the kinds met, the layouts hold on to the ones they use
+      ID2D1SolidColorBrush* token_brushes[(size_t) application::TokenKind::Count] = {};
 
-      std::wstring_convert<std::codecvt_utf8<wchar_t>> converter{};
+      // one layout per line, the lines that didn't change are not shaped
+      // again
+      size_t line_start = 0;
+      for (int row = 0; line_start <= tmp_text.size(); ++row)
+      {
+        size_t line_end = std::min(tmp_text.find('\n', line_start), tmp_text.size());
+        std::string_view line(tmp_text.data() + line_start, line_end - line_start);
+        float y = (float) row * m_line_height;
 
-      auto text = converter.from_bytes(tmp_text);
-      hr = render_context->dwrite_factory->CreateTextLayout(
-        text.c_str(),
-        text.size(),
-        m_text_format,
-        m_layout.width,
-        m_layout.height,
-        &layout);
-      if (FAILED(hr)) return;
+        IDWriteTextLayout* text_layout = CachedTextLayout(render_context, line, m_text_format, layout.width, m_line_height);
+        if (text_layout && m_highlighter)
+        {
+          // the layout is shared by every line with this text, the colours
+          // it was last drawn with go first
+          text_layout->SetDrawingEffect(NULL, DWRITE_TEXT_RANGE { 0, UINT32_MAX });
+
+          // the layout counts utf-16 code units
+          size_t position = 0;
+          UINT32 units = 0;
+          for (; span < spans.size() && spans[span].offset < line_end; ++span)
+          {
+            size_t start = spans[span].offset - line_start;
+            size_t end = std::min<size_t>(spans[span].offset + spans[span].length, line_end) - line_start;
+            units += (UINT32) utf8::Utf16Length(line.substr(position, start - position));
+            UINT32 length = (UINT32) utf8::Utf16Length(line.substr(start, end - start));
+            position = end;
+
+            ID2D1SolidColorBrush*& token_brush = token_brushes[(size_t) spans[span].kind];
+            if (!token_brush)
+              render_context->render_target->CreateSolidColorBrush(ConvertToD2D1Color(GetTokenColor(spans[span].kind)), &token_brush);
+            if (token_brush)
+              text_layout->SetDrawingEffect(token_brush, DWRITE_TEXT_RANGE { units, length });
+            units += length;
+          }
+        }
+        if (text_layout)
+        {
+          render_context->render_target->DrawTextLayout(
+            D2D1::Point2F(0, y),
+            text_layout,
+            text_brush);
+        }
 
-      render_context->render_target->DrawTextLayout(
-        D2D1::Point2F(0, 0),
-        layout,
-        text_brush);
+        if (draw_caret && text_layout && caret >= line_start && caret <= line_end)
+        {
+          // the layout counts utf-16 code units
+          UINT32 position = utf8::Utf16Length(line.substr(0, caret - line_start));
+          FLOAT caret_x, caret_y;
+          DWRITE_HIT_TEST_METRICS metrics;
+          hr = text_layout->HitTestTextPosition(position, FALSE, &caret_x, &caret_y, &metrics);
+          if (SUCCEEDED(hr))
+          {
+            render_context->render_target->FillRectangle(
+              D2D1::RectF(caret_x, y + caret_y, caret_x + 1, y + caret_y + metrics.height),
+              text_brush);
+          }
+        }
 
+        line_start = line_end + 1;
+      }
 
       render_context->render_target->SetTransform(parent_translation);
 
       SafeRelease(&brush);
       SafeRelease(&text_brush);
+      for (ID2D1SolidColorBrush*& token_brush : token_brushes)
+        SafeRelease(&token_brush);
     }
 
     void InitTextFormat(RenderContext* render_context)
@@ -410,6 +496,20 @@ namespace platform
       else
       {
         m_text_format->SetTextAlignment(DWRITE_TEXT_ALIGNMENT_LEADING);
+        // the core cuts or wraps the lines to the width, one text line is
+        // one row
+        m_text_format->SetWordWrapping(DWRITE_WORD_WRAPPING_NO_WRAP);
+      }
+
+      // the core wraps at the advance of a character of this font
+      IDWriteTextLayout* layout = NULL;
+      wchar_t const sample[] = L"0000000000";
+      if (SUCCEEDED(render_context->dwrite_factory->CreateTextLayout(sample, 10, m_text_format, 1000.0f, 100.0f, &layout)))
+      {
+        DWRITE_TEXT_METRICS metrics;
+        if (SUCCEEDED(layout->GetMetrics(&metrics)) && metrics.widthIncludingTrailingWhitespace > 0)
+          m_char_width = metrics.widthIncludingTrailingWhitespace / 10;
+        SafeRelease(&layout);
       }
     }
   };
@@ -418,13 +518,14 @@ namespace platform
   {
     virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
     {
+      application::gui::LayoutInfo layout = GetLayout();
       logger::Debug("Layers::Draw");
-      if (!IsLayoutInfoValid(m_layout))
+      if (!IsLayoutInfoValid(layout))
       {
         logger::Error("Call draw without layout");
       }
 
-      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
       D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
       render_context->render_target->GetTransform(&parent_translation);
 
@@ -433,23 +534,57 @@ namespace platform
       render_context->render_target->SetTransform(my_translation);
 
       int d = 0;
-      for (auto it = m_layers.begin(); it != m_layers.end(); ++it)
+      application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+      for (auto layer = tree.first_child[m_node]; layer != application::gui::InvalidWidgetHandle; layer = tree.next_sibling[layer])
       {
         logger::Debug("Draw layer %d", d++);
-        it->second->Draw(render_context, interaction_context);
+        tree.widget[layer]->Draw(render_context, interaction_context);
       }
       render_context->render_target->SetTransform(parent_translation);
     }
   };
 
+  struct PlatformVirtualList : public application::gui::VirtualList
+  {
+    virtual void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
+    {
+      application::gui::LayoutInfo layout = GetLayout();
+      logger::Debug("VirtualList::Draw");
+      if (!IsLayoutInfoValid(layout)) return;
+
+      D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
+      D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
+      render_context->render_target->GetTransform(&parent_translation);
+
+      my_translation = parent_translation * my_translation;
+
+      render_context->render_target->SetTransform(my_translation);
+      render_context->render_target->PushAxisAlignedClip(
+        D2D1::RectF(0, 0, layout.width, layout.height),
+        D2D1_ANTIALIAS_MODE_ALIASED);
+
+      // unbound rows of the pool have no layout
+      application::gui::WidgetTree& tree = application::gui::GetWidgetTree();
+      for (auto child = tree.first_child[m_node]; child != application::gui::InvalidWidgetHandle; child = tree.next_sibling[child])
+      {
+        if (IsLayoutInfoValid(tree.layout[child]))
+          tree.widget[child]->Draw(render_context, interaction_context);
+      }
+
+      render_context->render_target->PopAxisAlignedClip();
+      render_context->render_target->SetTransform(parent_translation);
+    }
+  };
+
   struct PlatformFileSelector : public application::gui::FileSelector
   {
       void Draw(RenderContext* render_context, application::gui::InteractionContext interaction_context) override
       {
+        application::gui::LayoutInfo layout = GetLayout();
         logger::Debug("FileSelector::Draw");
-        if (!IsLayoutInfoValid(m_layout)) return;
+        if (!IsLayoutInfoValid(layout)) return;
 
-        D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(m_layout.x, m_layout.y);
+        D2D1_MATRIX_3X2_F my_translation = D2D1::Matrix3x2F::Translation(layout.x, layout.y);
         D2D1_MATRIX_3X2_F parent_translation = D2D1::Matrix3x2F::Identity();
         render_context->render_target->GetTransform(&parent_translation);
 
@@ -498,6 +633,10 @@ namespace platform
       {
           return new PlatformFileSelector();
       } break;
+      case application::gui::WidgetType::VirtualListType:
+      {
+          return new PlatformVirtualList();
+      } break;
       default:
       {
         std::unreachable();
@@ -508,35 +647,121 @@ namespace platform
 
   bool WriteFile(std::string filename, std::string content)
   {
-    logger::Debug("I'm writting");
-    std::wfstream f(filename, std::ios::out | std::ios::trunc);
-    if (!f)
+    bool done = false;
+    return WriteFileAtomic(filename, [&](std::string_view& chunk) {
+      chunk = content;
+      return !std::exchange(done, true);
+    });
+  }
+
+  bool WriteFileAtomic(std::string name, std::function<bool(std::string_view&)> const& next)
+  {
+    std::wstring path = utf8::ToWide(name);
+    std::wstring temp = path + L".tmp";
+    HANDLE file = CreateFileW(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
     {
       logger::Error("Cant write to file");
       return false;
     }
 
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter{};
-
-    auto text = converter.from_bytes(content);
-    f << text;
-
+    // the content is already utf-8, written as is
+    bool ok = true;
+    std::string_view chunk;
+    while (ok && next(chunk))
+    {
+      while (ok && !chunk.empty())
+      {
+        DWORD n = 0;
+        ok = ::WriteFile(file, chunk.data(), (DWORD) std::min<size_t>(chunk.size(), 1 << 30), &n, NULL) && n > 0;
+        chunk.remove_prefix(n);
+      }
+    }
 
-    f.flush();
-    if (f) return true;
-    return false;
+    // the content reaches the disk before the rename makes it visible
+    ok = ok && FlushFileBuffers(file);
+    CloseHandle(file);
+    ok = ok && MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    if (!ok)
+    {
+      DeleteFileW(temp.c_str());
+      logger::Error("Cant write to file");
+    }
+    return ok;
   }
 
   std::string ReadFile(std::string name)
   {
-    char filepath[1000];
+    std::shared_ptr<MappedFile> file = MapFile(name);
+    if (!file) return {};
+    return std::string(file->Text());
+  }
+
+  struct Win32MappedFile : public MappedFile
+  {
+    HANDLE mapping = NULL;
+    // what couldn't be mapped is read here
+    std::string bytes;
+
+    ~Win32MappedFile() override
+    {
+      if (mapping)
+      {
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+      }
+    }
+  };
+
+  std::shared_ptr<MappedFile> MapFile(std::string name)
+  {
+    // sharing delete lets a save rename over the file while it is mapped
+    HANDLE file = CreateFileW(utf8::ToWide(name).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+      return NULL;
+
+    auto mapped = std::make_shared<Win32MappedFile>();
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+      CloseHandle(file);
+      return NULL;
+    }
 
-    std::fstream f(filepath);
-    if (!f) return {};
-    std::stringstream buffer;
-    buffer << f.rdbuf();
+    // an empty file can't be mapped, and has nothing to read
+    if (size.QuadPart > 0)
+    {
+      mapped->mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapped->mapping)
+      {
+        mapped->data = (char const*) MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (mapped->data)
+        {
+          mapped->size = size.QuadPart;
+        }
+        else
+        {
+          CloseHandle(mapped->mapping);
+          mapped->mapping = NULL;
+        }
+      }
 
-    return buffer.str();
+      if (!mapped->mapping)
+      {
+        mapped->bytes.resize(size.QuadPart);
+        size_t read = 0;
+        DWORD n = 0;
+        while (read < mapped->bytes.size() &&
+               ::ReadFile(file, &mapped->bytes[read], (DWORD) std::min<size_t>(mapped->bytes.size() - read, 1 << 30), &n, NULL) && n > 0)
+          read += n;
+        mapped->bytes.resize(read);
+        mapped->data = mapped->bytes.data();
+        mapped->size = read;
+      }
+    }
+
+    CloseHandle(file);
+    return mapped;
   }
 } // namespace application
 
@@ -587,6 +812,8 @@ public:
   application::gui::UserInput    m_user_input;
   application::gui::UserInput    m_last_user_input;
   bool m_running = true;
+  // first half of a surrogate pair until WM_CHAR brings the second
+  wchar_t m_high_surrogate = 0;
 
   int m_width = 0;
   int m_height = 0;
@@ -735,10 +962,17 @@ public:
     };
 
 
+    application::FrameStats& stats = m_app->m_frame_stats;
+    platform::Timestamp start = platform::CurrentTimestamp();
     m_render_target->BeginDraw();
     m_render_target->Clear(D2D1::ColorF(D2D1::ColorF::Black));
+    stats.AddSince(application::DrawPhase, start);
+
     m_app->Render(&constraint, &wc);
+
+    start = platform::CurrentTimestamp();
     m_render_target->EndDraw();
+    stats.AddSince(application::PresentPhase, start);
 
     platform::SafeRelease(&brush);
     
@@ -836,17 +1070,14 @@ public:
         OnMouseUp(mouse_x, mouse_y);
         return 0;
       } break;
-      //case WM_KEYDOWN:
-      //{
-      //  OnKeyboartEvent(wparam);
-      //  UINT virtual_key = wparam;
-      //  UINT mapped_key = MapVirtualKey(virtual_key, MAPVK_VK_TO_CHAR);
-      //  printf("Virtual key: %u -> %u\n", virtual_key, mapped_key);
-      //} break;
+      case WM_KEYDOWN:
+      {
+        // keys with a character come as WM_CHAR
+        if (OnKeyDown(wparam))
+          return 0;
+      } break;
       case WM_CHAR:
       {
-        // OnKeyboartEvent(wparam);
-        printf("Char: %llx %c\n", wparam, (wchar_t) wparam);
         OnKeyboardEvent(wparam);
 
         return 0;
@@ -873,23 +1104,32 @@ public:
     const float ms_per_frame = 1000.0 / 60;
     unsigned long long frame = 0;
 
+    application::FrameStats& stats = m_app->m_frame_stats;
+
     IntervalTimePoint start_show = std::chrono::time_point_cast<Interval>(IntervalClock::now());
     while (m_running)
     {
       IntervalTimePoint start_frame_ts = std::chrono::time_point_cast<Interval>(IntervalClock::now());
       BOOL r = 0;
 
+      stats.BeginFrame();
+
       // UpdateApplicationLibrary();
 
+      // the dispatched messages record their own phases
+      platform::Timestamp phase_start = platform::CurrentTimestamp();
+      double recorded = stats.Recorded();
       while ((r = PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) != 0)
       {
         TranslateMessage(&msg);
         DispatchMessage(&msg);
       }
+      stats.AddSinceExclusive(application::PumpMessagesPhase, phase_start, recorded);
 
 
       OnPaint();
 
+      phase_start = platform::CurrentTimestamp();
       IntervalTimePoint end_frame_ts = std::chrono::time_point_cast<Interval>(IntervalClock::now());
 
       Interval frame_duration = end_frame_ts - start_frame_ts;
@@ -900,13 +1140,32 @@ public:
         end_frame_ts = std::chrono::time_point_cast<Interval>(IntervalClock::now());
       }
 
+      stats.AddSince(application::SleepPhase, phase_start);
+      stats.EndFrame();
+
       Interval total_duration = end_frame_ts - start_show;
       logger::Info("Frame: %u, Time: %u", frame % 60, total_duration.count() );
 
+      if (frame % 600 == 599)
+        LogFrameStats(stats);
+
       frame += 1;
     }
   }
 
+  static void LogFrameStats(application::FrameStats& stats)
+  {
+    application::FrameStats::Summary total = stats.SummarizeTotal();
+    logger::Info("Frames: %zu, p50 %.2fms, p95 %.2fms, p99 %.2fms, max %.2fms",
+      total.frames, total.p50, total.p95, total.p99, total.max);
+    for (int phase = 0; phase < application::FramePhaseCount; ++phase)
+    {
+      application::FrameStats::Summary s = stats.Summarize((application::FramePhase) phase);
+      logger::Info("  %-15s p50 %.2fms, p95 %.2fms, p99 %.2fms, max %.2fms",
+        application::FramePhaseName(phase), s.p50, s.p95, s.p99, s.max);
+    }
+  }
+
   void OnMouseHover(int x, int y)
   {
     application::gui::MouseEvent e;
@@ -955,52 +1214,68 @@ public:
     m_app->ProcessEvent(&event);
   }
 
-  void OnKeyboardEvent(wchar_t c)
+  bool OnKeyDown(WPARAM virtual_key)
   {
-    printf("Char: %lx %c\n", c, (wchar_t) c);
-
     application::gui::KeyboardEvent e;
 
     e.key_press = 0;
     e.modifier = 0;
     e.key_length = 0;
 
-    if (c <= 0x007f)
+    switch (virtual_key)
     {
-      e.key_press = c;
-      e.key_length = 1;
+    case VK_LEFT:   e.virtual_key = application::gui::VirtualKey_Left; break;
+    case VK_RIGHT:  e.virtual_key = application::gui::VirtualKey_Right; break;
+    case VK_UP:     e.virtual_key = application::gui::VirtualKey_Up; break;
+    case VK_DOWN:   e.virtual_key = application::gui::VirtualKey_Down; break;
+    case VK_HOME:   e.virtual_key = application::gui::VirtualKey_Home; break;
+    case VK_END:    e.virtual_key = application::gui::VirtualKey_End; break;
+    case VK_DELETE: e.virtual_key = application::gui::VirtualKey_Delete; break;
+    default:
+      return false;
     }
-    else if (c >= 0x0080 && c <= 0x07ff)
-    {
-      std::wstring_convert<std::codecvt_utf8<wchar_t>> converter{};
-      std::string s = converter.to_bytes(c);
 
-      assert(s.size() == 2);
+    if (GetKeyState(VK_SHIFT) < 0)
+      e.modifier |= application::gui::ShiftModifier;
+    if (GetKeyState(VK_CONTROL) < 0)
+      e.modifier |= application::gui::ControlModifier;
 
-      char* p = (char*) &e.key_press;
-      p[0] = s[0];
-      p[1] = s[1];
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::KeyboardEventType,
+        .keyboard_event = e
+    };
 
-      e.key_length = 2;
-    }
-    else if (c >= 0x0800 && c <= 0xffff)
-    {
-      std::wstring_convert<std::codecvt_utf8<wchar_t>> converter{};
-      std::string s = converter.to_bytes(c);
+    m_app->ProcessEvent(&event);
+    return true;
+  }
 
-      assert(s.size() == 3);
+  void OnKeyboardEvent(wchar_t c)
+  {
+    application::gui::KeyboardEvent e;
 
-      char* p = (char*) &e.key_press;
-      p[0] = s[0];
-      p[1] = s[1];
-      p[2] = s[2];
+    e.key_press = 0;
+    e.modifier = 0;
+    e.key_length = 0;
+    e.virtual_key = -1;
 
-      e.key_length = 3;
+    // characters past U+FFFF come as two messages, one per surrogate
+    uint32_t codepoint = c;
+    if (c >= 0xd800 && c <= 0xdbff)
+    {
+      m_high_surrogate = c;
+      return;
     }
-    else if (c >= 0x10000 && c <= 0x10ffff) 
+    if (c >= 0xdc00 && c <= 0xdfff)
     {
-      printf("Suplementary plane\n");
+      if (!m_high_surrogate)
+        return;
+      codepoint = 0x10000 + ((m_high_surrogate - 0xd800) << 10) + (c - 0xdc00);
     }
+    m_high_surrogate = 0;
+
+    e.key_length = utf8::Encode(codepoint, (char*) &e.key_press);
+    if (!e.key_length)
+      return;
 
     application::gui::UserEvent event {
       .type = application::gui::UserEvent::Type::KeyboardEventType,
@@ -1010,8 +1285,25 @@ public:
     m_app->ProcessEvent(&event);
   }
 
-  void OnMouseWheel(DWORD wparam, DWORD lparam)
+  void OnMouseWheel(WPARAM wparam, LPARAM lparam)
   {
+    // the wheel message carries screen coordinates
+    POINT p;
+    p.x = (short) LOWORD(lparam);
+    p.y = (short) HIWORD(lparam);
+    ScreenToClient(m_hwnd, &p);
+
+    application::gui::MouseWheelEvent e;
+    e.x = p.x;
+    e.y = p.y;
+    e.delta = GET_WHEEL_DELTA_WPARAM(wparam);
+
+    application::gui::UserEvent event {
+      .type = application::gui::UserEvent::Type::MouseWheelEventType,
+      .mouse_wheel_event = e,
+    };
+
+    m_app->ProcessEvent(&event);
   }
 
   static platform::RenderContext CreateContext(MainWindow* m)
@@ -1080,6 +1372,13 @@ int main()
   MainWindow t = MainWindow::Instance();
 
   t.Show();
+
+  // FRAME_STATS_FILE=<path> keeps the timings of the last frames
+  if (char* path = getenv("FRAME_STATS_FILE"))
+  {
+    if (!t.m_app->m_frame_stats.Dump(path))
+      logger::Error("Can't write frame stats to %s", path);
+  }
   return 0;
 }
 
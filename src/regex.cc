@@ -0,0 +1,1356 @@
+#include "regex.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "utf8.hh"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define REGEX_SSE2 1
+#endif
+
+namespace application
+{
+  // Thompson NFA over bytes, non-ASCII characters are compiled to their
+  // UTF-8 sequences
+  struct Regex::Program
+  {
+    struct Inst
+    {
+      enum class Op : uint8_t
+      {
+        // a byte in [lo, hi], then `out`
+        Range,
+        // `out` first, then `out1`
+        Split,
+        Empty,
+        LineStart,
+        LineEnd,
+        Match,
+      };
+
+      Op op = Op::Empty;
+      uint8_t lo = 0;
+      uint8_t hi = 0;
+      // the Split of a greedy loop, `out1` leaves it
+      bool loop = false;
+      uint32_t out = 0;
+      uint32_t out1 = 0;
+    };
+
+    std::vector<Inst> insts;
+    uint32_t start = 0;
+    // bytes no instruction tells apart share a class, the DFA has one
+    // transition per class. '\n' is always alone in its class.
+    uint8_t classes[256] = {};
+    size_t class_count = 0;
+    size_t newline_class = 0;
+    // a byte of each class
+    std::vector<uint8_t> representatives;
+  };
+
+  // DFA states of one program, built while searching
+  struct Regex::Cache
+  {
+    struct State
+    {
+      // NFA states reached, in priority order, before following the empty
+      // transitions since those depend on the next byte
+      std::vector<uint32_t> kernel;
+      uint8_t flags = 0;
+    };
+
+    std::vector<State> m_states;
+    // per state: the state after each byte class then at the end of the
+    // text, times 2 plus 1 when a match ends before it
+    std::vector<uint32_t> m_transitions;
+    std::unordered_map<std::string, uint32_t> m_ids;
+    size_t m_bytes = 0;
+    // the bytes leaving m_skip_state, empty when there are too many to skip
+    // to the next one
+    uint32_t m_skip_state = UINT32_MAX;
+    std::string m_skip_bytes;
+    // start states by flags
+    uint32_t m_starts[4];
+
+    // scratch space of the searches
+    std::vector<uint32_t> m_marks;
+    uint32_t m_mark = 0;
+    std::vector<uint32_t> m_stack;
+    std::vector<uint32_t> m_list;
+    std::vector<uint32_t> m_kernel;
+    std::string m_key;
+    // the text scanned by the forward search, scanned again backward
+    std::vector<std::string_view> m_chunks;
+  };
+
+  namespace
+  {
+    using Inst = Regex::Program::Inst;
+
+    constexpr uint32_t MaxCodepoint = 0x10ffff;
+    constexpr size_t MaxInstructions = 200000;
+    constexpr int MaxRepeat = 1000;
+
+    struct CodepointRange
+    {
+      uint32_t lo;
+      uint32_t hi;
+    };
+    using CodepointSet = std::vector<CodepointRange>;
+
+    void Normalize(CodepointSet& set)
+    {
+      std::sort(set.begin(), set.end(), [](CodepointRange a, CodepointRange b) { return a.lo < b.lo; });
+      size_t n = 0;
+      for (CodepointRange r : set)
+      {
+        if (n > 0 && r.lo <= set[n - 1].hi + 1)
+          set[n - 1].hi = std::max(set[n - 1].hi, r.hi);
+        else
+          set[n++] = r;
+      }
+      set.resize(n);
+    }
+
+    // Every character not in `set`, surrogates aren't characters
+    CodepointSet Complement(CodepointSet set)
+    {
+      set.push_back({ 0xd800, 0xdfff });
+      Normalize(set);
+      CodepointSet result;
+      uint32_t next = 0;
+      for (CodepointRange r : set)
+      {
+        if (r.lo > next)
+          result.push_back({ next, r.lo - 1 });
+        next = r.hi + 1;
+      }
+      if (next <= MaxCodepoint)
+        result.push_back({ next, MaxCodepoint });
+      return result;
+    }
+
+    // Adds the other case of the ASCII letters of `set`
+    void Fold(CodepointSet& set)
+    {
+      size_t n = set.size();
+      for (size_t i = 0; i < n; ++i)
+      {
+        uint32_t lo = std::max<uint32_t>(set[i].lo, 'a');
+        uint32_t hi = std::min<uint32_t>(set[i].hi, 'z');
+        if (lo <= hi)
+          set.push_back({ lo - 32, hi - 32 });
+        lo = std::max<uint32_t>(set[i].lo, 'A');
+        hi = std::min<uint32_t>(set[i].hi, 'Z');
+        if (lo <= hi)
+          set.push_back({ lo + 32, hi + 32 });
+      }
+      Normalize(set);
+    }
+
+    struct Node
+    {
+      enum class Kind
+      {
+        Empty,
+        Class,
+        Concat,
+        Alternate,
+        Repeat,
+        LineStart,
+        LineEnd,
+      };
+
+      Kind kind = Kind::Empty;
+      CodepointSet set;
+      std::vector<Node> children;
+      // -1 for no maximum
+      int min = 0;
+      int max = -1;
+      bool greedy = true;
+    };
+
+    struct Parser
+    {
+      std::u32string m_pattern;
+      size_t m_position = 0;
+      bool m_fold = false;
+
+      [[noreturn]] void Fail(char const* what)
+      {
+        throw std::invalid_argument(std::string("Invalid regular expression: ") + what + " at " + std::to_string(m_position));
+      }
+
+      bool AtEnd() const { return m_position == m_pattern.size(); }
+      char32_t Current() const { return m_pattern[m_position]; }
+
+      Node Parse()
+      {
+        Node node = ParseAlternation();
+        if (!AtEnd())
+          Fail("unmatched )");
+        return node;
+      }
+
+      Node ParseAlternation()
+      {
+        Node node { .kind = Node::Kind::Alternate };
+        node.children.push_back(ParseConcat());
+        while (!AtEnd() && Current() == '|')
+        {
+          m_position++;
+          node.children.push_back(ParseConcat());
+        }
+        if (node.children.size() == 1)
+          return std::move(node.children[0]);
+        return node;
+      }
+
+      Node ParseConcat()
+      {
+        Node node { .kind = Node::Kind::Concat };
+        while (!AtEnd() && Current() != '|' && Current() != ')')
+          node.children.push_back(ParseRepeat());
+        if (node.children.empty())
+          return Node {};
+        if (node.children.size() == 1)
+          return std::move(node.children[0]);
+        return node;
+      }
+
+      Node ParseRepeat()
+      {
+        Node node = ParseAtom();
+        while (!AtEnd())
+        {
+          int min = 0;
+          int max = -1;
+          if (Current() == '*')
+            m_position++;
+          else if (Current() == '+')
+            min = 1, m_position++;
+          else if (Current() == '?')
+            max = 1, m_position++;
+          else if (Current() != '{' || !ParseCount(min, max))
+            break;
+
+          bool greedy = true;
+          if (!AtEnd() && Current() == '?')
+          {
+            greedy = false;
+            m_position++;
+          }
+          Node repeat { .kind = Node::Kind::Repeat, .min = min, .max = max, .greedy = greedy };
+          repeat.children.push_back(std::move(node));
+          node = std::move(repeat);
+        }
+        return node;
+      }
+
+      // {n}, {n,} or {n,m}, leaves the position alone and returns false when
+      // the brace doesn't start one, it is a literal then
+      bool ParseCount(int& min, int& max)
+      {
+        size_t position = m_position + 1;
+        auto number = [&](int& value) {
+          size_t begin = position;
+          value = 0;
+          while (position < m_pattern.size() && m_pattern[position] >= '0' && m_pattern[position] <= '9')
+          {
+            value = std::min(value * 10 + (int) (m_pattern[position] - '0'), MaxRepeat + 1);
+            position++;
+          }
+          return position > begin;
+        };
+
+        if (!number(min))
+          return false;
+        max = min;
+        if (position < m_pattern.size() && m_pattern[position] == ',')
+        {
+          position++;
+          if (!number(max))
+            max = -1;
+        }
+        if (position >= m_pattern.size() || m_pattern[position] != '}')
+          return false;
+
+        if (min > MaxRepeat || max > MaxRepeat)
+          Fail("repetition count too large");
+        if (max != -1 && max < min)
+          Fail("repetition range out of order");
+        m_position = position + 1;
+        return true;
+      }
+
+      Node Class(CodepointSet set)
+      {
+        if (m_fold)
+          Fold(set);
+        return Node { .kind = Node::Kind::Class, .set = std::move(set) };
+      }
+
+      Node ParseAtom()
+      {
+        char32_t c = Current();
+        switch (c)
+        {
+        case '(':
+        {
+          m_position++;
+          if (m_position + 1 < m_pattern.size() && Current() == '?' && m_pattern[m_position + 1] == ':')
+            m_position += 2;
+          Node node = ParseAlternation();
+          if (AtEnd())
+            Fail("missing )");
+          m_position++;
+          return node;
+        }
+        case '[':
+          m_position++;
+          return ParseClass();
+        case '.':
+          m_position++;
+          return Node { .kind = Node::Kind::Class, .set = Complement({ { '\n', '\n' } }) };
+        case '^':
+          m_position++;
+          return Node { .kind = Node::Kind::LineStart };
+        case '$':
+          m_position++;
+          return Node { .kind = Node::Kind::LineEnd };
+        case '*':
+        case '+':
+        case '?':
+          Fail("nothing to repeat");
+        case '\\':
+        {
+          m_position++;
+          CodepointSet set;
+          ParseEscape(set);
+          return Class(std::move(set));
+        }
+        default:
+          m_position++;
+          return Class({ { c, c } });
+        }
+      }
+
+      // After the backslash, returns true when the escape is one character
+      bool ParseEscape(CodepointSet& set)
+      {
+        if (AtEnd())
+          Fail("trailing \\");
+        char32_t c = Current();
+        m_position++;
+        switch (c)
+        {
+        case 'd':
+          set = { { '0', '9' } };
+          return false;
+        case 'D':
+          set = Complement({ { '0', '9' } });
+          return false;
+        case 'w':
+          set = { { '0', '9' }, { 'A', 'Z' }, { '_', '_' }, { 'a', 'z' } };
+          return false;
+        case 'W':
+          set = Complement({ { '0', '9' }, { 'A', 'Z' }, { '_', '_' }, { 'a', 'z' } });
+          return false;
+        case 's':
+          set = { { '\t', '\r' }, { ' ', ' ' } };
+          return false;
+        case 'S':
+          set = Complement({ { '\t', '\r' }, { ' ', ' ' } });
+          return false;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case 'x':
+        {
+          uint32_t value = 0;
+          for (int i = 0; i < 2; ++i)
+          {
+            if (AtEnd() || Current() > 0x7f || !std::isxdigit((int) Current()))
+              Fail("\\x needs two hexadecimal digits");
+            char32_t d = Current();
+            value = value * 16 + (d <= '9' ? d - '0' : (d | 0x20) - 'a' + 10);
+            m_position++;
+          }
+          c = value;
+          break;
+        }
+        default:
+          if (c < 0x80 && std::isalnum((int) c))
+            Fail("unknown escape");
+        }
+        set = { { c, c } };
+        return true;
+      }
+
+      // After the bracket
+      Node ParseClass()
+      {
+        bool negated = false;
+        if (!AtEnd() && Current() == '^')
+        {
+          negated = true;
+          m_position++;
+        }
+
+        CodepointSet set;
+        bool first = true;
+        while (true)
+        {
+          if (AtEnd())
+            Fail("missing ]");
+          if (Current() == ']' && !first)
+            break;
+          first = false;
+
+          CodepointSet item;
+          bool single = ParseClassItem(item);
+          if (single && m_position + 1 < m_pattern.size() && Current() == '-' && m_pattern[m_position + 1] != ']')
+          {
+            m_position++;
+            CodepointSet end;
+            if (!ParseClassItem(end))
+              Fail("bad class range");
+            if (end[0].lo < item[0].lo)
+              Fail("class range out of order");
+            item[0].hi = end[0].lo;
+          }
+          set.insert(set.end(), item.begin(), item.end());
+        }
+        m_position++;
+
+        if (m_fold)
+          Fold(set);
+        Normalize(set);
+        if (negated)
+          set = Complement(std::move(set));
+        return Node { .kind = Node::Kind::Class, .set = std::move(set) };
+      }
+
+      bool ParseClassItem(CodepointSet& set)
+      {
+        if (AtEnd())
+          Fail("missing ]");
+        char32_t c = Current();
+        m_position++;
+        if (c == '\\')
+          return ParseEscape(set);
+        set = { { c, c } };
+        return true;
+      }
+    };
+
+    // Byte ranges matching the UTF-8 of a range of characters of the same
+    // encoded length
+    struct Utf8Sequence
+    {
+      size_t length;
+      uint8_t lo[4];
+      uint8_t hi[4];
+    };
+
+    // Splits [lo, hi] until the UTF-8 of every part is a sequence of byte
+    // ranges taken independently
+    void AddSequences(uint32_t lo, uint32_t hi, std::vector<Utf8Sequence>& out)
+    {
+      if (lo > hi)
+        return;
+      if (lo <= 0xdfff && hi >= 0xd800)
+      {
+        if (lo < 0xd800)
+          AddSequences(lo, 0xd7ff, out);
+        if (hi > 0xdfff)
+          AddSequences(0xe000, hi, out);
+        return;
+      }
+      for (uint32_t limit : { 0x7fu, 0x7ffu, 0xffffu })
+      {
+        if (lo <= limit && hi > limit)
+        {
+          AddSequences(lo, limit, out);
+          AddSequences(limit + 1, hi, out);
+          return;
+        }
+      }
+      for (int i = 1; i < 4; ++i)
+      {
+        uint32_t m = (1u << (6 * i)) - 1;
+        if ((lo & ~m) != (hi & ~m))
+        {
+          if ((lo & m) != 0)
+          {
+            AddSequences(lo, lo | m, out);
+            AddSequences((lo | m) + 1, hi, out);
+            return;
+          }
+          if ((hi & m) != m)
+          {
+            AddSequences(lo, (hi & ~m) - 1, out);
+            AddSequences(hi & ~m, hi, out);
+            return;
+          }
+        }
+      }
+
+      char a[4];
+      char b[4];
+      Utf8Sequence sequence;
+      sequence.length = utf8::Encode(lo, a);
+      utf8::Encode(hi, b);
+      for (size_t i = 0; i < sequence.length; ++i)
+      {
+        sequence.lo[i] = a[i];
+        sequence.hi[i] = b[i];
+      }
+      out.push_back(sequence);
+    }
+
+    struct Compiler
+    {
+      // instructions still to link, index * 2 + 1 for out1
+      struct Fragment
+      {
+        uint32_t start = 0;
+        std::vector<uint32_t> holes;
+      };
+
+      Regex::Program& m_program;
+      bool m_reverse;
+
+      uint32_t Emit(Inst inst)
+      {
+        if (m_program.insts.size() >= MaxInstructions)
+          throw std::invalid_argument("Invalid regular expression: pattern too large");
+        m_program.insts.push_back(inst);
+        return m_program.insts.size() - 1;
+      }
+
+      void Patch(std::vector<uint32_t> const& holes, uint32_t target)
+      {
+        for (uint32_t hole : holes)
+        {
+          Inst& inst = m_program.insts[hole >> 1];
+          (hole & 1 ? inst.out1 : inst.out) = target;
+        }
+      }
+
+      Fragment Single(Inst::Op op)
+      {
+        uint32_t i = Emit({ .op = op });
+        return { i, { i << 1 } };
+      }
+
+      Fragment Concat(Fragment a, Fragment b)
+      {
+        Patch(a.holes, b.start);
+        return { a.start, std::move(b.holes) };
+      }
+
+      Fragment Alternate(Fragment a, Fragment b)
+      {
+        uint32_t i = Emit({ .op = Inst::Op::Split, .out = a.start, .out1 = b.start });
+        a.holes.insert(a.holes.end(), b.holes.begin(), b.holes.end());
+        return { i, std::move(a.holes) };
+      }
+
+      // `node` once or not at all
+      Fragment Optional(Node const& node, bool greedy)
+      {
+        uint32_t i = Emit({ .op = Inst::Op::Split });
+        Fragment f = Compile(node);
+        Inst& split = m_program.insts[i];
+        (greedy ? split.out : split.out1) = f.start;
+        f.holes.push_back(i << 1 | (greedy ? 1 : 0));
+        return { i, std::move(f.holes) };
+      }
+
+      Fragment Star(Node const& node, bool greedy)
+      {
+        uint32_t i = Emit({ .op = Inst::Op::Split });
+        Fragment f = Compile(node);
+        Patch(f.holes, i);
+        Inst& split = m_program.insts[i];
+        (greedy ? split.out : split.out1) = f.start;
+        split.loop = greedy;
+        return { i, { i << 1 | (greedy ? 1 : 0) } };
+      }
+
+      Fragment Class(CodepointSet const& set)
+      {
+        std::vector<Utf8Sequence> sequences;
+        for (CodepointRange r : set)
+          AddSequences(r.lo, r.hi, sequences);
+        if (sequences.empty())
+        {
+          // matches nothing
+          uint32_t i = Emit({ .op = Inst::Op::Range, .lo = 1, .hi = 0 });
+          return { i, { i << 1 } };
+        }
+
+        // the sequences match different bytes, their order doesn't matter
+        Fragment result;
+        for (size_t s = sequences.size(); s-- > 0;)
+        {
+          Utf8Sequence const& sequence = sequences[s];
+          Fragment f;
+          for (size_t k = 0; k < sequence.length; ++k)
+          {
+            size_t b = m_reverse ? sequence.length - 1 - k : k;
+            uint32_t i = Emit({ .op = Inst::Op::Range, .lo = sequence.lo[b], .hi = sequence.hi[b] });
+            f = k == 0 ? Fragment { i, { i << 1 } } : Concat(std::move(f), { i, { i << 1 } });
+          }
+          result = s + 1 == sequences.size() ? std::move(f) : Alternate(std::move(f), std::move(result));
+        }
+        return result;
+      }
+
+      Fragment Compile(Node const& node)
+      {
+        switch (node.kind)
+        {
+        case Node::Kind::Empty:
+          return Single(Inst::Op::Empty);
+        case Node::Kind::LineStart:
+          return Single(m_reverse ? Inst::Op::LineEnd : Inst::Op::LineStart);
+        case Node::Kind::LineEnd:
+          return Single(m_reverse ? Inst::Op::LineStart : Inst::Op::LineEnd);
+        case Node::Kind::Class:
+          return Class(node.set);
+        case Node::Kind::Concat:
+        {
+          size_t n = node.children.size();
+          Fragment f = Compile(node.children[m_reverse ? n - 1 : 0]);
+          for (size_t k = 1; k < n; ++k)
+            f = Concat(std::move(f), Compile(node.children[m_reverse ? n - 1 - k : k]));
+          return f;
+        }
+        case Node::Kind::Alternate:
+        {
+          // emitted from the last one so that the first is preferred
+          Fragment f = Compile(node.children.back());
+          for (size_t k = node.children.size() - 1; k-- > 0;)
+            f = Alternate(Compile(node.children[k]), std::move(f));
+          return f;
+        }
+        case Node::Kind::Repeat:
+        {
+          Node const& child = node.children[0];
+          if (node.max == 0)
+            return Single(Inst::Op::Empty);
+
+          Fragment f;
+          bool empty = true;
+          auto append = [&](Fragment next) {
+            f = empty ? std::move(next) : Concat(std::move(f), std::move(next));
+            empty = false;
+          };
+          for (int k = 0; k < node.min; ++k)
+            append(Compile(child));
+          if (node.max == -1)
+          {
+            append(Star(child, node.greedy));
+          }
+          else
+          {
+            // x{2,4} is xxx?x?
+            std::vector<Fragment> optional;
+            for (int k = node.min; k < node.max; ++k)
+              optional.push_back(Optional(child, node.greedy));
+            for (size_t k = optional.size(); k-- > 1;)
+              optional[k - 1] = Concat(std::move(optional[k - 1]), std::move(optional[k]));
+            if (!optional.empty())
+              append(std::move(optional[0]));
+          }
+          return f;
+        }
+        }
+        return Single(Inst::Op::Empty);
+      }
+    };
+
+    std::shared_ptr<Regex::Program const> CompileProgram(Node const& root, bool reverse)
+    {
+      auto program = std::make_shared<Regex::Program>();
+      Compiler compiler { *program, reverse };
+      Compiler::Fragment f = compiler.Compile(root);
+      uint32_t match = compiler.Emit({ .op = Inst::Op::Match });
+      compiler.Patch(f.holes, match);
+      program->start = f.start;
+
+      bool boundary[257] = {};
+      boundary['\n'] = true;
+      boundary['\n' + 1] = true;
+      for (Inst const& inst : program->insts)
+      {
+        if (inst.op == Inst::Op::Range && inst.lo <= inst.hi)
+        {
+          boundary[inst.lo] = true;
+          boundary[inst.hi + 1] = true;
+        }
+      }
+      size_t c = 0;
+      for (int b = 0; b < 256; ++b)
+      {
+        if (b > 0 && boundary[b])
+          c++;
+        if (program->representatives.size() == c)
+          program->representatives.push_back(b);
+        program->classes[b] = c;
+      }
+      program->class_count = c + 1;
+      program->newline_class = program->classes['\n'];
+      return program;
+    }
+
+    enum : uint8_t
+    {
+      // the last byte was a newline, or the text starts there
+      AfterNewline = 1,
+      // a match may start at the current position
+      Unanchored = 2,
+    };
+
+    constexpr uint32_t Dead = 0;
+    constexpr uint32_t Unknown = UINT32_MAX;
+    constexpr uint32_t GiveUp = UINT32_MAX - 1;
+    // clears of the cache in one scan before checking whether it is worth
+    // it, and bytes to scan per state built for it to be
+    constexpr size_t ClearsBeforeGivingUp = 3;
+    constexpr size_t BytesPerState = 10;
+    // bytes a search looks for at once when no match is in progress
+    constexpr size_t MaxSkipBytes = 3;
+
+    // Offset of the first of `bytes` in [p, p + n), n when there is none
+    size_t FindAnyOf(char const* p, size_t n, std::string const& bytes)
+    {
+      if (bytes.size() == 1)
+      {
+        void const* found = std::memchr(p, bytes[0], n);
+        return found ? (char const*) found - p : n;
+      }
+
+      size_t i = 0;
+#ifdef REGEX_SSE2
+      __m128i const a = _mm_set1_epi8(bytes[0]);
+      __m128i const b = _mm_set1_epi8(bytes[1]);
+      __m128i const c = _mm_set1_epi8(bytes.back());
+      for (; i + 16 <= n; i += 16)
+      {
+        __m128i v = _mm_loadu_si128((__m128i const*) (p + i));
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)), _mm_cmpeq_epi8(v, c));
+        if (unsigned mask = _mm_movemask_epi8(any))
+          return i + std::countr_zero(mask);
+      }
+#endif
+      for (; i < n; ++i)
+      {
+        if (bytes.find(p[i]) != std::string::npos)
+          return i;
+      }
+      return n;
+    }
+
+    // Follows the empty transitions from `pc` in priority order, adding the
+    // Range instructions reached to `list`. Returns true when the Match
+    // instruction is reached, stopping there if `stop_at_match`.
+    bool Expand(Regex::Program const& program, uint32_t pc, std::vector<uint32_t>& marks, uint32_t mark,
+                std::vector<uint32_t>& stack, std::vector<uint32_t>& list,
+                bool after_newline, bool before_newline, bool stop_at_match)
+    {
+      bool matched = false;
+      stack.clear();
+      stack.push_back(pc);
+      while (!stack.empty())
+      {
+        pc = stack.back();
+        stack.pop_back();
+        Inst const& inst = program.insts[pc];
+        if (marks[pc] == mark)
+        {
+          // back at a greedy loop while its body is followed: the iteration
+          // matched empty, which ends the loop like in Perl. The thread
+          // leaves it there, before the body paths that consume.
+          if (inst.loop)
+            stack.push_back(inst.out1);
+          continue;
+        }
+        marks[pc] = mark;
+
+        switch (inst.op)
+        {
+        case Inst::Op::Range:
+          list.push_back(pc);
+          break;
+        case Inst::Op::Split:
+          stack.push_back(inst.out1);
+          stack.push_back(inst.out);
+          break;
+        case Inst::Op::Empty:
+          stack.push_back(inst.out);
+          break;
+        case Inst::Op::LineStart:
+          if (after_newline)
+            stack.push_back(inst.out);
+          break;
+        case Inst::Op::LineEnd:
+          if (before_newline)
+            stack.push_back(inst.out);
+          break;
+        case Inst::Op::Match:
+          matched = true;
+          if (stop_at_match)
+            return true;
+          break;
+        }
+      }
+      return matched;
+    }
+
+    uint32_t NextMark(std::vector<uint32_t>& marks, uint32_t& mark)
+    {
+      if (++mark == 0)
+      {
+        std::fill(marks.begin(), marks.end(), 0);
+        mark = 1;
+      }
+      return mark;
+    }
+
+    // Runs a program as a DFA whose states are built when first needed.
+    // Leftmost-first drops the threads that have a lower priority than a
+    // match, the longest mode keeps them all to find the longest match of
+    // an anchored search.
+    struct Dfa
+    {
+      Regex::Program const& m_program;
+      Regex::Cache& m_cache;
+      Regex::Stats& m_stats;
+      size_t m_max_bytes;
+      bool m_longest;
+      size_t m_stride;
+      size_t m_clears = 0;
+      size_t m_clear_scanned = 0;
+
+      Dfa(Regex::Program const& program, Regex::Cache& cache, Regex::Stats& stats, size_t max_bytes, bool longest)
+        : m_program { program },
+          m_cache { cache },
+          m_stats { stats },
+          m_max_bytes { max_bytes },
+          m_longest { longest },
+          m_stride { program.class_count + 2 }
+      {
+        m_cache.m_marks.resize(program.insts.size());
+        if (m_cache.m_states.empty())
+          Clear();
+      }
+
+      // the two end of text classes, at the end of a line or not
+      size_t EndClass(bool before_newline) const { return m_program.class_count + (before_newline ? 0 : 1); }
+      uint32_t const* Transitions() const { return m_cache.m_transitions.data(); }
+
+      void Clear()
+      {
+        m_cache.m_states.clear();
+        m_cache.m_transitions.clear();
+        m_cache.m_ids.clear();
+        m_cache.m_bytes = 0;
+        m_cache.m_skip_state = Unknown;
+        std::fill(std::begin(m_cache.m_starts), std::end(m_cache.m_starts), Unknown);
+        m_cache.m_states.push_back({});
+        m_cache.m_transitions.resize(m_stride, Unknown);
+      }
+
+      // Id of the state, GiveUp when it doesn't fit in the cache
+      uint32_t Intern(std::vector<uint32_t> const& kernel, uint8_t flags, size_t scanned)
+      {
+        if (kernel.empty() && !(flags & Unanchored))
+          return Dead;
+
+        std::string& key = m_cache.m_key;
+        key.assign(1, (char) flags);
+        key.append((char const*) kernel.data(), kernel.size() * sizeof(uint32_t));
+        auto found = m_cache.m_ids.find(key);
+        if (found != m_cache.m_ids.end())
+          return found->second;
+
+        size_t cost = sizeof(Regex::Cache::State) + 2 * key.size() + m_stride * sizeof(uint32_t) + 64;
+        if (m_cache.m_bytes + cost > m_max_bytes)
+        {
+          // too many states for the cache to be of any use
+          if (m_cache.m_bytes == 0 || (++m_clears >= ClearsBeforeGivingUp && scanned - m_clear_scanned < BytesPerState * m_cache.m_states.size()))
+            return GiveUp;
+          m_stats.cache_clears++;
+          m_clear_scanned = scanned;
+          std::string saved = key;
+          Clear();
+          key = std::move(saved);
+        }
+
+        uint32_t id = m_cache.m_states.size();
+        m_cache.m_states.push_back({ kernel, flags });
+        m_cache.m_transitions.resize(m_cache.m_transitions.size() + m_stride, Unknown);
+        m_cache.m_ids.emplace(key, id);
+        m_cache.m_bytes += cost;
+        m_stats.states++;
+        return id;
+      }
+
+      // A search in a cache always starts from the same kernel
+      uint32_t Start(std::vector<uint32_t> const& kernel, uint8_t flags)
+      {
+        uint32_t& start = m_cache.m_starts[flags];
+        if (start == Unknown)
+        {
+          start = Intern(kernel, flags, 0);
+          if (start == GiveUp)
+            return std::exchange(start, Unknown);
+        }
+        return start;
+      }
+
+      // The bytes on which `s` doesn't stay in `s` or ends a match, empty
+      // when there are more than MaxSkipBytes. All the transitions of `s`
+      // are built for it, it is meant for the unanchored start state.
+      std::string SkipBytes(uint32_t s)
+      {
+        if (m_cache.m_skip_state == s)
+          return m_cache.m_skip_bytes;
+
+        size_t clears = m_stats.cache_clears;
+        std::string bytes;
+        for (size_t c = 0; c < m_program.class_count && bytes.size() <= MaxSkipBytes; ++c)
+        {
+          uint32_t t = Transitions()[s * m_stride + c];
+          if (t == Unknown)
+            t = Next(s, c, 0);
+          if (t == GiveUp || m_stats.cache_clears != clears)
+            return {};
+          if (t == s << 1)
+            continue;
+          for (int b = 0; b < 256; ++b)
+          {
+            if (m_program.classes[b] == c)
+              bytes.push_back(b);
+          }
+        }
+        if (bytes.size() > MaxSkipBytes)
+          bytes.clear();
+        m_cache.m_skip_state = s;
+        m_cache.m_skip_bytes = bytes;
+        return bytes;
+      }
+
+      // The same state without the thread starting at the current position
+      uint32_t Anchor(uint32_t s, size_t scanned)
+      {
+        if (s == Dead)
+          return Dead;
+        Regex::Cache::State state = m_cache.m_states[s];
+        return Intern(state.kernel, state.flags & ~Unanchored, scanned);
+      }
+
+      // Transition of `s` on the byte class `c`, built and cached, GiveUp
+      // when the cache can't hold the next state
+      uint32_t Next(uint32_t s, size_t c, size_t scanned)
+      {
+        Regex::Cache& cache = m_cache;
+        bool end = c >= m_program.class_count;
+        bool before_newline = end ? c == EndClass(true) : c == m_program.newline_class;
+        uint8_t flags = cache.m_states[s].flags;
+
+        cache.m_list.clear();
+        uint32_t mark = NextMark(cache.m_marks, cache.m_mark);
+        bool matched = false;
+        auto expand = [&](uint32_t pc) {
+          matched |= Expand(m_program, pc, cache.m_marks, mark, cache.m_stack, cache.m_list,
+                            flags & AfterNewline, before_newline, !m_longest);
+          return matched && !m_longest;
+        };
+        bool cut = false;
+        for (uint32_t pc : cache.m_states[s].kernel)
+        {
+          if ((cut = expand(pc)))
+            break;
+        }
+        if (!cut && (flags & Unanchored))
+          expand(m_program.start);
+
+        uint32_t next = Dead;
+        if (!end)
+        {
+          uint8_t byte = m_program.representatives[c];
+          cache.m_kernel.clear();
+          mark = NextMark(cache.m_marks, cache.m_mark);
+          for (uint32_t pc : cache.m_list)
+          {
+            Inst const& inst = m_program.insts[pc];
+            if (inst.lo <= byte && byte <= inst.hi && cache.m_marks[inst.out] != mark)
+            {
+              cache.m_marks[inst.out] = mark;
+              cache.m_kernel.push_back(inst.out);
+            }
+          }
+          uint8_t next_flags = byte == '\n' ? AfterNewline : 0;
+          if ((flags & Unanchored) && !matched)
+            next_flags |= Unanchored;
+
+          size_t clears = m_stats.cache_clears;
+          next = Intern(cache.m_kernel, next_flags, scanned);
+          if (next == GiveUp)
+            return GiveUp;
+          // the cache was cleared, `s` is gone
+          if (m_stats.cache_clears != clears)
+            return next << 1 | matched;
+        }
+
+        uint32_t transition = next << 1 | matched;
+        cache.m_transitions[s * m_stride + c] = transition;
+        return transition;
+      }
+    };
+
+    enum class Outcome
+    {
+      NoMatch,
+      Match,
+      GaveUp,
+      Cancelled,
+    };
+
+    // The context of ^ and $ around a range of the text
+    struct Boundaries
+    {
+      bool after_newline;
+      bool before_newline;
+    };
+
+    Boundaries BoundariesOf(DocumentSnapshot const& snapshot, size_t from, size_t to)
+    {
+      return { from == 0 || snapshot.At(from - 1) == '\n', to == snapshot.Size() || snapshot.At(to) == '\n' };
+    }
+
+    bool IsCancelled(std::atomic<bool> const* cancelled)
+    {
+      return cancelled && cancelled->load(std::memory_order_relaxed);
+    }
+
+    // Finds where the leftmost-first match ends and whether a newline
+    // follows, keeping the chunks scanned
+    Outcome FindEnd(Dfa& dfa, DocumentSnapshot const& snapshot, size_t from, size_t to, size_t starts_before,
+                    Boundaries boundaries, std::atomic<bool> const* cancelled, size_t& end, bool& end_before_newline)
+    {
+      std::vector<std::string_view>& chunks = dfa.m_cache.m_chunks;
+      chunks.clear();
+      Outcome outcome = Outcome::NoMatch;
+      // in the start state between lines no thread is alive, the search
+      // skips to the next byte that starts one when there are few of them
+      size_t clears = dfa.m_stats.cache_clears;
+      uint32_t skip_state = dfa.Start({}, Unanchored);
+      if (skip_state == GiveUp)
+        return Outcome::GaveUp;
+      std::string skip = dfa.SkipBytes(skip_state);
+      uint32_t s = dfa.Start({}, Unanchored | (boundaries.after_newline ? AfterNewline : 0));
+      if (s == GiveUp)
+        return Outcome::GaveUp;
+      if (skip.empty() || dfa.m_stats.cache_clears != clears)
+        skip_state = Unknown;
+      uint8_t const* classes = dfa.m_program.classes;
+
+      // false once the search is over
+      auto scan = [&](size_t begin, size_t limit) {
+        size_t position = begin;
+        size_t stride = dfa.m_stride;
+        uint32_t const* transitions = dfa.Transitions();
+        uint32_t state = s;
+        DocumentChunkIterator it = snapshot.Chunks(begin, limit);
+        std::string_view chunk;
+        while (it.Next(chunk))
+        {
+          if (IsCancelled(cancelled))
+          {
+            outcome = Outcome::Cancelled;
+            return false;
+          }
+          chunks.push_back(chunk);
+          for (size_t i = 0; i < chunk.size(); ++i)
+          {
+            if (state == skip_state)
+            {
+              i += FindAnyOf(chunk.data() + i, chunk.size() - i, skip);
+              if (i == chunk.size())
+                break;
+            }
+            size_t c = classes[(uint8_t) chunk[i]];
+            uint32_t t = transitions[state * stride + c];
+            if (t == Unknown)
+            {
+              if ((t = dfa.Next(state, c, position + i - from)) == GiveUp)
+              {
+                outcome = Outcome::GaveUp;
+                return false;
+              }
+              transitions = dfa.Transitions();
+              if (dfa.m_stats.cache_clears != clears)
+                skip_state = Unknown;
+            }
+            if (t & 1)
+            {
+              outcome = Outcome::Match;
+              end = position + i;
+              end_before_newline = chunk[i] == '\n';
+            }
+            state = t >> 1;
+            if (state == Dead)
+            {
+              s = Dead;
+              return false;
+            }
+          }
+          position += chunk.size();
+        }
+        s = state;
+        return true;
+      };
+
+      size_t split = std::min(starts_before, to);
+      if (!scan(from, split))
+        return outcome;
+      if (starts_before <= to)
+      {
+        // no match starts from there
+        if ((s = dfa.Anchor(s, split - from)) == GiveUp)
+          return Outcome::GaveUp;
+        if (s == Dead || !scan(split, to))
+          return outcome;
+      }
+
+      size_t c = dfa.EndClass(boundaries.before_newline);
+      uint32_t t = dfa.Transitions()[s * dfa.m_stride + c];
+      if (t == Unknown && (t = dfa.Next(s, c, to - from)) == GiveUp)
+        return Outcome::GaveUp;
+      if (t & 1)
+      {
+        outcome = Outcome::Match;
+        end = to;
+        end_before_newline = boundaries.before_newline;
+      }
+      return outcome;
+    }
+
+    // Finds where the longest match of the reversed program ending at `end`
+    // starts, that is the start of the leftmost match. `chunks` hold the
+    // text from `from` to past `end`.
+    Outcome FindStart(Dfa& dfa, std::vector<std::string_view> const& chunks, size_t from, size_t end,
+                      bool end_before_newline, Boundaries boundaries, size_t& start)
+    {
+      Outcome outcome = Outcome::NoMatch;
+      uint32_t s = dfa.Start({ dfa.m_program.start }, end_before_newline ? AfterNewline : 0);
+      if (s == GiveUp)
+        return Outcome::GaveUp;
+
+      size_t chunk_end = from;
+      for (std::string_view chunk : chunks)
+        chunk_end += chunk.size();
+
+      size_t position = end;
+      for (size_t k = chunks.size(); k-- > 0;)
+      {
+        std::string_view chunk = chunks[k];
+        size_t chunk_start = chunk_end - chunk.size();
+        chunk_end = chunk_start;
+        if (chunk_start >= end)
+          continue;
+        for (size_t i = std::min(chunk.size(), end - chunk_start); i-- > 0;)
+        {
+          size_t c = dfa.m_program.classes[(uint8_t) chunk[i]];
+          uint32_t t = dfa.Transitions()[s * dfa.m_stride + c];
+          if (t == Unknown && (t = dfa.Next(s, c, end - position)) == GiveUp)
+            return Outcome::GaveUp;
+          if (t & 1)
+          {
+            outcome = Outcome::Match;
+            start = position;
+          }
+          position--;
+          s = t >> 1;
+          if (s == Dead)
+            return outcome;
+        }
+      }
+
+      size_t c = dfa.EndClass(boundaries.after_newline);
+      uint32_t t = dfa.Transitions()[s * dfa.m_stride + c];
+      if (t == Unknown && (t = dfa.Next(s, c, end - from)) == GiveUp)
+        return Outcome::GaveUp;
+      if (t & 1)
+      {
+        outcome = Outcome::Match;
+        start = from;
+      }
+      return outcome;
+    }
+
+    // Simulates the NFA, following every thread with the position where it
+    // started. Used when the DFA needs too many states.
+    Outcome FindWithNfa(Regex::Program const& program, DocumentSnapshot const& snapshot, size_t from, size_t to,
+                        size_t starts_before, Boundaries boundaries, std::atomic<bool> const* cancelled,
+                        DocumentRange& match)
+    {
+      struct Thread
+      {
+        uint32_t pc;
+        size_t start;
+      };
+
+      Outcome outcome = Outcome::NoMatch;
+      std::vector<uint32_t> marks(program.insts.size());
+      uint32_t mark = 0;
+      std::vector<uint32_t> stack;
+      std::vector<uint32_t> list;
+      std::vector<Thread> threads;
+      std::vector<Thread> kernel;
+      std::vector<Thread> next;
+      bool after_newline = boundaries.after_newline;
+      bool unanchored = true;
+
+      // Expands the threads at `position` in priority order, returns false
+      // once none is left and none can start
+      auto step = [&](size_t position, int byte, bool before_newline) {
+        threads.clear();
+        NextMark(marks, mark);
+        bool matched = false;
+        auto expand = [&](uint32_t pc, size_t start) {
+          list.clear();
+          matched = Expand(program, pc, marks, mark, stack, list, after_newline, before_newline, true);
+          for (uint32_t range : list)
+            threads.push_back({ range, start });
+          if (matched)
+          {
+            outcome = Outcome::Match;
+            match = { start, position - start };
+          }
+          return matched;
+        };
+        for (Thread t : kernel)
+        {
+          if (expand(t.pc, t.start))
+            break;
+        }
+        unanchored = unanchored && position < starts_before;
+        if (!matched && unanchored)
+          expand(program.start, position);
+        if (matched)
+          unanchored = false;
+
+        if (byte < 0)
+          return false;
+        next.clear();
+        NextMark(marks, mark);
+        for (Thread t : threads)
+        {
+          Inst const& inst = program.insts[t.pc];
+          if (inst.lo <= byte && byte <= inst.hi && marks[inst.out] != mark)
+          {
+            marks[inst.out] = mark;
+            next.push_back({ inst.out, t.start });
+          }
+        }
+        kernel.swap(next);
+        after_newline = byte == '\n';
+        return !kernel.empty() || (unanchored && position + 1 < starts_before);
+      };
+
+      size_t position = from;
+      DocumentChunkIterator it = snapshot.Chunks(from, to);
+      std::string_view chunk;
+      while (it.Next(chunk))
+      {
+        if (IsCancelled(cancelled))
+          return Outcome::Cancelled;
+        for (char c : chunk)
+        {
+          if (!step(position, (uint8_t) c, c == '\n'))
+            return outcome;
+          position++;
+        }
+      }
+      step(to, -1, boundaries.before_newline);
+      return outcome;
+    }
+  }
+
+  Regex::Regex(std::string_view pattern, RegexOptions options)
+    : m_forward_cache { std::make_unique<Cache>() },
+      m_reverse_cache { std::make_unique<Cache>() },
+      m_options { options }
+  {
+    Parser parser { utf8::ToUtf32(pattern), 0, options.case_insensitive };
+    Node root = parser.Parse();
+    m_forward = CompileProgram(root, false);
+    m_reverse = CompileProgram(root, true);
+  }
+
+  Regex::Regex(Regex&&) = default;
+  Regex::~Regex() = default;
+
+  bool Regex::Find(DocumentSnapshot const& snapshot, DocumentRange& match,
+                   size_t from, size_t to, size_t starts_before,
+                   std::atomic<bool> const* cancelled)
+  {
+    to = std::min(to, snapshot.Size());
+    if (from > to || starts_before <= from)
+      return false;
+    Boundaries boundaries = BoundariesOf(snapshot, from, to);
+
+    size_t end = 0;
+    size_t start = 0;
+    bool end_before_newline = false;
+    Dfa forward { *m_forward, *m_forward_cache, m_stats, m_options.max_cache_bytes, false };
+    Outcome outcome = FindEnd(forward, snapshot, from, to, starts_before, boundaries, cancelled, end, end_before_newline);
+    if (outcome == Outcome::Match)
+    {
+      Dfa reverse { *m_reverse, *m_reverse_cache, m_stats, m_options.max_cache_bytes, true };
+      outcome = FindStart(reverse, m_forward_cache->m_chunks, from, end, end_before_newline, boundaries, start);
+      if (outcome == Outcome::Match)
+      {
+        match = { start, end - start };
+        return true;
+      }
+    }
+    if (outcome != Outcome::GaveUp)
+      return false;
+
+    m_stats.nfa_searches++;
+    return FindWithNfa(*m_forward, snapshot, from, to, starts_before, boundaries, cancelled, match) == Outcome::Match;
+  }
+
+  void FindAll(DocumentSnapshot const& snapshot, Regex& regex,
+               std::function<bool(DocumentRange)> const& fn,
+               size_t from, size_t to,
+               std::atomic<bool> const* cancelled,
+               size_t starts_before)
+  {
+    to = std::min(to, snapshot.Size());
+    DocumentRange match;
+    while (from <= to && regex.Find(snapshot, match, from, to, starts_before, cancelled))
+    {
+      if (!fn(match))
+        return;
+      from = match.offset + std::max<size_t>(match.length, 1);
+    }
+  }
+}
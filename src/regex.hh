@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include "document.hh"
+
+namespace application
+{
+  struct RegexOptions
+  {
+    // ASCII letters only, like SearchOptions
+    bool case_insensitive = false;
+    // Memory for the DFA states of each direction. A full cache is cleared,
+    // and a search that keeps filling it goes on with the NFA.
+    size_t max_cache_bytes = 2 * 1024 * 1024;
+  };
+
+  // Regular expressions over UTF-8 text that never backtrack: a pattern is
+  // compiled to an NFA and searched with a DFA built lazily from it, one
+  // state per set of NFA states met in the text, so a search is linear in
+  // the text whatever the pattern.
+  //
+  // Syntax: literal characters, `.` (anything but a newline), classes like
+  // [a-z] and [^0-9], \d \w \s and \D \W \S, \n \r \t \f \v \xHH, escaped
+  // punctuation, groups (...) and (?:...), alternation |, the quantifiers
+  // * + ? {n} {n,} {n,m} and their lazy forms followed by ?, and ^ and $
+  // matching at line boundaries. Matches are leftmost first like in Perl.
+  // Groups don't capture.
+  //
+  // A search runs the DFA forward to find where the leftmost match ends,
+  // then the DFA of the reversed pattern backward from there to find where
+  // it starts. The DFA states live in a cache bounded by max_cache_bytes.
+  // When the cache fills up too fast to be useful the search falls back to
+  // simulating the NFA, which is slower but still linear.
+  //
+  // The caches make a Regex usable by one thread at a time.
+  struct Regex
+  {
+    struct Program;
+    struct Cache;
+
+    struct Stats
+    {
+      // DFA states built, caches cleared because they were full, and
+      // searches done by the NFA after giving up on the DFA
+      size_t states = 0;
+      size_t cache_clears = 0;
+      size_t nfa_searches = 0;
+    };
+
+    std::shared_ptr<Program const> m_forward;
+    std::shared_ptr<Program const> m_reverse;
+    std::unique_ptr<Cache> m_forward_cache;
+    std::unique_ptr<Cache> m_reverse_cache;
+    RegexOptions m_options;
+    Stats m_stats;
+
+    // Throws std::invalid_argument when `pattern` isn't valid
+    explicit Regex(std::string_view pattern, RegexOptions options = {});
+    Regex(Regex&&);
+    ~Regex();
+
+    // The leftmost match in [from, to) of `snapshot` that starts before
+    // `starts_before`. ^ and $ look at the text around the range. Returns
+    // false when there is none or once `cancelled` is set.
+    bool Find(DocumentSnapshot const& snapshot, DocumentRange& match,
+              size_t from = 0, size_t to = SIZE_MAX, size_t starts_before = SIZE_MAX,
+              std::atomic<bool> const* cancelled = NULL);
+  };
+
+  // Calls `fn` on the matches of `regex` in [from, to) of `snapshot` in
+  // order until it returns false, like FindAll for a LiteralMatcher. The
+  // search goes on after an empty match one byte further. Only matches
+  // starting before `starts_before` are reported.
+  void FindAll(DocumentSnapshot const& snapshot, Regex& regex,
+               std::function<bool(DocumentRange)> const& fn,
+               size_t from = 0, size_t to = SIZE_MAX,
+               std::atomic<bool> const* cancelled = NULL,
+               size_t starts_before = SIZE_MAX);
+}
@@ -0,0 +1,56 @@
+#include <cstdio>
+#include "regex.hh"
+
+// Leftmost-first matches of patterns whose loops can match empty, checked
+// against what Perl finds. Exits with 1 when one differs.
+
+using application::Document;
+using application::DocumentRange;
+using application::Regex;
+
+struct Case
+{
+  char const* pattern;
+  char const* text;
+  size_t begin;
+  size_t end;
+};
+
+static Case const cases[] = {
+  // an empty iteration ends the loop before the consuming branch is tried
+  { "a(?:|\\s)*", "a\n  b", 0, 1 },
+  { "a(?: ?\?)*", "a   b", 0, 1 },
+  { "a(?: *?)*", "a   b", 0, 1 },
+  { "a(?:|b)*", "abbb", 0, 1 },
+  { "(?:a|b?\?)*", "aab", 0, 2 },
+  { "(?:a*?)*", "aaa", 0, 0 },
+  { "(?:|a)+", "aa", 0, 0 },
+  { "x(?:|y){2,}", "xyy", 0, 1 },
+  // consuming branches that come first still loop
+  { "a(?:b|)*", "abbb", 0, 4 },
+  { "(?:a?)*", "aaa", 0, 3 },
+  { "(?:a|)+", "aa", 0, 2 },
+  { "(?:^|a)*b", "aab", 0, 3 },
+};
+
+int main()
+{
+  int failures = 0;
+  for (Case const& c : cases)
+  {
+    Regex regex(c.pattern);
+    Document document(c.text);
+    DocumentRange match{};
+    bool found = regex.Find(document.Snapshot(), match);
+    if (!found || match.offset != c.begin || match.offset + match.length != c.end)
+    {
+      std::printf("%s: expected [%zu, %zu), got ", c.pattern, c.begin, c.end);
+      if (found)
+        std::printf("[%zu, %zu)\n", match.offset, match.offset + match.length);
+      else
+        std::printf("no match\n");
+      ++failures;
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,296 @@
+#include "search.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SEARCH_SSE2 1
+#endif
+
+namespace application
+{
+  namespace
+  {
+    char ToLower(char c)
+    {
+      return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+#ifdef SEARCH_SSE2
+    __m128i ToLower(__m128i bytes)
+    {
+      // 'A' to 'Z' moved to the 26 smallest signed bytes
+      __m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8((char) (0x80 - 'A')));
+      __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char) (0x80 + 26)));
+      return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    }
+#endif
+
+    bool MatchesExactly(LiteralMatcher const& matcher, char const* p)
+    {
+      return std::memcmp(p, matcher.m_pattern.data(), matcher.m_pattern.size()) == 0;
+    }
+
+    bool MatchesFolded(LiteralMatcher const& matcher, char const* p)
+    {
+      for (size_t i = 0; i < matcher.m_pattern.size(); ++i)
+      {
+        if (ToLower(p[i]) != matcher.m_pattern[i])
+          return false;
+      }
+      return true;
+    }
+
+    template<bool Fold>
+    bool Matches(LiteralMatcher const& matcher, char const* p)
+    {
+      if constexpr (Fold)
+        return MatchesFolded(matcher, p);
+      return MatchesExactly(matcher, p);
+    }
+
+    template<bool Fold>
+    size_t FindCandidates(LiteralMatcher const& matcher, char const* data, size_t size, size_t from)
+    {
+      std::string const& pattern = matcher.m_pattern;
+      size_t m = pattern.size();
+      // last position a match can start at
+      size_t last = size - m;
+      size_t i = from;
+
+#ifdef SEARCH_SSE2
+      __m128i const first = _mm_set1_epi8(pattern[0]);
+      __m128i const final = _mm_set1_epi8(pattern[m - 1]);
+      auto candidates = [&](size_t at) {
+        __m128i a = _mm_loadu_si128((__m128i const*) (data + at));
+        __m128i b = _mm_loadu_si128((__m128i const*) (data + at + m - 1));
+        if constexpr (Fold)
+        {
+          a = ToLower(a);
+          b = ToLower(b);
+        }
+        return _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final));
+      };
+      auto check = [&](size_t at, unsigned mask) {
+        for (; mask; mask &= mask - 1)
+        {
+          size_t candidate = at + std::countr_zero(mask);
+          if (Matches<Fold>(matcher, data + candidate))
+            return candidate;
+        }
+        return std::string::npos;
+      };
+
+      // candidates are rare in text, blocks of 64 bytes without any are
+      // skipped with a single test
+      for (; i + 64 <= last + 1; i += 64)
+      {
+        __m128i c0 = candidates(i);
+        __m128i c1 = candidates(i + 16);
+        __m128i c2 = candidates(i + 32);
+        __m128i c3 = candidates(i + 48);
+        if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(c0, c1), _mm_or_si128(c2, c3))))
+          continue;
+        uint64_t mask = (uint64_t) _mm_movemask_epi8(c0)
+          | (uint64_t) _mm_movemask_epi8(c1) << 16
+          | (uint64_t) _mm_movemask_epi8(c2) << 32
+          | (uint64_t) _mm_movemask_epi8(c3) << 48;
+        for (; mask; mask &= mask - 1)
+        {
+          size_t candidate = i + std::countr_zero(mask);
+          if (Matches<Fold>(matcher, data + candidate))
+            return candidate;
+        }
+      }
+      for (; i + 16 <= last + 1; i += 16)
+      {
+        size_t found = check(i, _mm_movemask_epi8(candidates(i)));
+        if (found != std::string::npos)
+          return found;
+      }
+#endif
+
+      for (; i <= last; ++i)
+      {
+        char c = Fold ? ToLower(data[i]) : data[i];
+        if (c == pattern[0] && Matches<Fold>(matcher, data + i))
+          return i;
+      }
+      return std::string::npos;
+    }
+  }
+
+  LiteralMatcher::LiteralMatcher(std::string_view pattern, SearchOptions options)
+    : m_pattern { pattern },
+      m_case_insensitive { options.case_insensitive }
+  {
+    if (m_case_insensitive)
+      std::transform(m_pattern.begin(), m_pattern.end(), m_pattern.begin(), [](char c) { return ToLower(c); });
+  }
+
+  size_t LiteralMatcher::Find(char const* data, size_t size, size_t from) const
+  {
+    size_t m = m_pattern.size();
+    if (m == 0 || size < m || from > size - m)
+      return std::string::npos;
+
+    if (m_case_insensitive)
+      return FindCandidates<true>(*this, data, size, from);
+    return FindCandidates<false>(*this, data, size, from);
+  }
+
+  void FindAll(DocumentSnapshot const& snapshot, LiteralMatcher const& matcher,
+               std::function<bool(DocumentRange)> const& fn,
+               size_t from, size_t to, std::atomic<bool> const* cancelled)
+  {
+    size_t m = matcher.Length();
+    if (m == 0)
+      return;
+
+    // the last m - 1 bytes before the chunk, a match starting there ends
+    // in the chunk
+    std::string carry;
+    std::string seam;
+    // matches start there or after, they don't overlap
+    size_t next = from;
+    size_t offset = from;
+
+    DocumentChunkIterator it = snapshot.Chunks(from, to);
+    std::string_view chunk;
+    while (it.Next(chunk))
+    {
+      if (cancelled && cancelled->load(std::memory_order_relaxed))
+        return;
+
+      if (!carry.empty())
+      {
+        seam = carry;
+        seam.append(chunk.substr(0, m - 1));
+        size_t seam_offset = offset - carry.size();
+        size_t i = next > seam_offset ? next - seam_offset : 0;
+        while ((i = matcher.Find(seam.data(), seam.size(), i)) != std::string::npos && i < carry.size())
+        {
+          if (!fn({ seam_offset + i, m }))
+            return;
+          next = seam_offset + i + m;
+          i += m;
+        }
+      }
+
+      size_t i = next > offset ? next - offset : 0;
+      while ((i = matcher.Find(chunk.data(), chunk.size(), i)) != std::string::npos)
+      {
+        if (!fn({ offset + i, m }))
+          return;
+        next = offset + i + m;
+        i += m;
+      }
+
+      if (m > 1)
+      {
+        if (chunk.size() >= m - 1)
+        {
+          carry.assign(chunk.substr(chunk.size() - (m - 1)));
+        }
+        else
+        {
+          carry.append(chunk);
+          if (carry.size() > m - 1)
+            carry.erase(0, carry.size() - (m - 1));
+        }
+      }
+      offset += chunk.size();
+    }
+  }
+
+  namespace
+  {
+    // Searches the document a section at a time, `find` calls its function
+    // on the matches starting in [start, end) of a section. The last section
+    // ends at `size` and also takes a match starting there, a regex may
+    // match empty at the end of the text, so there is one even for an empty
+    // document.
+    template<typename Find>
+    void SearchSections(SearchJob& job, size_t size, SearchJob::BatchFn const& on_batch, Find find)
+    {
+      std::vector<DocumentRange> batch;
+      size_t start = 0;
+      bool last = false;
+      while (!last)
+      {
+        size_t end = std::min(size, start + SearchJob::BatchBytes);
+        last = end == size;
+        size_t next = end;
+        find(start, end, [&](DocumentRange match) {
+          if (match.offset >= end && !last)
+            return false;
+          batch.push_back(match);
+          next = match.offset + match.length;
+          if (batch.size() == SearchJob::BatchMatches)
+          {
+            on_batch(std::move(batch), false);
+            batch.clear();
+          }
+          return true;
+        });
+
+        if (job.Cancelled())
+          return;
+        start = std::max(end, next);
+        job.m_scanned = start;
+        if (!batch.empty() && !last)
+        {
+          on_batch(std::move(batch), false);
+          batch.clear();
+        }
+      }
+
+      job.m_scanned = size;
+      on_batch(std::move(batch), true);
+    }
+  }
+
+  std::shared_ptr<SearchJob> SearchJob::Start(ThreadPool& pool, DocumentSnapshot snapshot, std::string pattern, SearchOptions options, BatchFn on_batch)
+  {
+    auto job = std::make_shared<SearchJob>();
+    job->m_size = snapshot.Size();
+
+    if (options.regex)
+    {
+      // compiled here so that a bad pattern throws to the caller
+      auto regex = std::make_shared<Regex>(pattern, RegexOptions { .case_insensitive = options.case_insensitive });
+      pool.Submit([job, snapshot = std::move(snapshot), regex, on_batch = std::move(on_batch)] {
+        size_t size = snapshot.Size();
+        SearchSections(*job, size, on_batch, [&](size_t start, size_t end, auto const& fn) {
+          // matches may run past the section, the last one may be empty
+          // at the end of the text
+          FindAll(snapshot, *regex, fn, start, size, &job->m_cancelled, end == size ? SIZE_MAX : end);
+        });
+      });
+      return job;
+    }
+
+    pool.Submit([job, snapshot = std::move(snapshot), matcher = LiteralMatcher(pattern, options), on_batch = std::move(on_batch)] {
+      size_t size = snapshot.Size();
+      size_t m = matcher.Length();
+      if (m == 0)
+      {
+        job->m_scanned = size;
+        return on_batch({}, true);
+      }
+      // a match starting in a section may end in the next one
+      SearchSections(*job, size, on_batch, [&](size_t start, size_t end, auto const& fn) {
+        FindAll(snapshot, matcher, fn, start, std::min(size, end + m - 1), &job->m_cancelled);
+      });
+    });
+    return job;
+  }
+
+  double SearchJob::Progress() const
+  {
+    return m_size ? (double) m_scanned.load() / m_size : 1.0;
+  }
+}
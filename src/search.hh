@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "document.hh"
+#include "regex.hh"
+#include "thread_pool.hh"
+
+namespace application
+{
+  struct SearchOptions
+  {
+    // ASCII letters only, other bytes match exactly
+    bool case_insensitive = false;
+    // the pattern is a Regex rather than a literal
+    bool regex = false;
+  };
+
+  // Finds a literal in a buffer. Candidates are the positions where both
+  // the first and the last byte of the pattern match, found 16 at a time
+  // with SSE2, and only those are compared in full.
+  struct LiteralMatcher
+  {
+    // lowercased when the search ignores case
+    std::string m_pattern;
+    bool m_case_insensitive = false;
+
+    LiteralMatcher(std::string_view pattern, SearchOptions options = {});
+
+    size_t Length() const { return m_pattern.size(); }
+    // Start of the first match in [from, size), npos when there is none
+    size_t Find(char const* data, size_t size, size_t from = 0) const;
+  };
+
+  // Calls `fn` on the matches of `matcher` in [from, to) of `snapshot` in
+  // order, including the ones spanning pieces, until it returns false.
+  // Matches don't overlap. Stops at the next piece once `cancelled` is set.
+  void FindAll(DocumentSnapshot const& snapshot, LiteralMatcher const& matcher,
+               std::function<bool(DocumentRange)> const& fn,
+               size_t from = 0, size_t to = SIZE_MAX,
+               std::atomic<bool> const* cancelled = NULL);
+
+  // A search running on a thread pool over a snapshot, so the document can
+  // be edited meanwhile. Matches are handed out by batches in document
+  // order, the last call has `done` set unless the search was cancelled.
+  struct SearchJob
+  {
+    // matches of a batch, and bytes scanned before it is handed out
+    static constexpr size_t BatchMatches = 4096;
+    static constexpr size_t BatchBytes = 8 * 1024 * 1024;
+
+    using BatchFn = std::function<void(std::vector<DocumentRange> matches, bool done)>;
+
+    std::atomic<bool> m_cancelled { false };
+    std::atomic<size_t> m_scanned { 0 };
+    size_t m_size = 0;
+
+    // `on_batch` runs on the pool thread. Throws std::invalid_argument for
+    // a regex that doesn't compile.
+    static std::shared_ptr<SearchJob> Start(ThreadPool& pool, DocumentSnapshot snapshot, std::string pattern, SearchOptions options, BatchFn on_batch);
+
+    void Cancel() { m_cancelled = true; }
+    bool Cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+    // Fraction of the document scanned so far
+    double Progress() const;
+  };
+}
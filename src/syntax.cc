@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <string>
+#include "syntax.hh"
+
+namespace application
+{
+  SyntaxHighlighter::SyntaxHighlighter(std::shared_ptr<Lexer const> lexer, size_t line_count)
+    : m_lexer { std::move(lexer) },
+      m_states(std::max<size_t>(line_count, 1), Unknown)
+  {
+    m_states[0] = Lexer::Initial;
+  }
+
+  void SyntaxHighlighter::LinesChanged(size_t line, size_t removed_lines, size_t inserted_lines)
+  {
+    // the states of the lines after the first edited one
+    auto first = m_states.begin() + (line + 1);
+    m_states.erase(first, first + removed_lines);
+    m_states.insert(m_states.begin() + (line + 1), inserted_lines, Unknown);
+
+    // the lexing stopped at m_valid without meeting the states lexed before,
+    // those from m_valid on don't follow from the ones before it
+    m_dirty_end = m_valid < m_lexed ? std::max(m_dirty_end, m_valid) : 0;
+
+    auto shift = [&](size_t& mark) {
+      if (mark > line + removed_lines)
+        mark = mark - removed_lines + inserted_lines;
+      else if (mark > line)
+        mark = line + 1;
+    };
+    shift(m_lexed);
+    shift(m_dirty_end);
+    m_valid = std::min(m_valid, line + 1);
+    // one range from m_valid covers all the edits
+    m_dirty_end = std::max(m_dirty_end, line + inserted_lines + 1);
+  }
+
+  bool SyntaxHighlighter::Advance(std::string_view line)
+  {
+    size_t next = m_valid;
+    uint32_t state = m_lexer->LexLine(line, m_states[next - 1], NULL);
+    m_lines_lexed++;
+
+    // the text from `next` on wasn't edited, neither are the states lexed
+    // from it when it starts in the same one
+    if (next >= m_dirty_end && next < m_lexed && m_states[next] == state)
+    {
+      m_valid = m_lexed;
+      return false;
+    }
+
+    m_states[next] = state;
+    m_valid = next + 1;
+    m_lexed = std::max(m_lexed, m_valid);
+    return true;
+  }
+
+  void SyntaxHighlighter::Update(DocumentEditor const& editor, size_t line)
+  {
+    line = std::min(line, m_states.size() - 1);
+    // a few more lines, past the edits when they are close, give the states
+    // a chance to converge so that the next edit further down doesn't lex
+    // again what is in between
+    size_t limit = std::max(line, std::min(m_dirty_end, line + ConvergeLines)) + ConvergeLines;
+    auto done = [&]() {
+      return m_valid > line && (m_valid >= m_lexed || m_valid > limit);
+    };
+
+    std::string partial;
+    while (!done())
+    {
+      // the line before the first stale state
+      size_t valid = m_valid;
+      partial.clear();
+      editor.Read(editor.LineOffset(m_valid - 1), [&](std::string_view chunk) {
+        while (!chunk.empty())
+        {
+          size_t newline = chunk.find('\n');
+          if (newline == std::string_view::npos)
+          {
+            partial.append(chunk);
+            break;
+          }
+
+          bool advanced;
+          if (partial.empty())
+          {
+            advanced = Advance(chunk.substr(0, newline));
+          }
+          else
+          {
+            partial.append(chunk.substr(0, newline));
+            advanced = Advance(partial);
+            partial.clear();
+          }
+          chunk.remove_prefix(newline + 1);
+
+          if (!advanced || done())
+            return false;
+        }
+        return true;
+      });
+      // the text has fewer lines than m_states
+      if (m_valid == valid)
+        break;
+    }
+  }
+
+  void SyntaxHighlighter::Highlight(DocumentEditor const& editor, size_t first_line, std::string_view lines, std::vector<TokenSpan>& spans)
+  {
+    size_t count = CountNewlines(lines.data(), lines.size()) + 1;
+    Update(editor, first_line + count - 1);
+
+    size_t start = 0;
+    for (size_t i = 0; i < count && first_line + i < m_states.size(); ++i)
+    {
+      size_t end = std::min(lines.find('\n', start), lines.size());
+      size_t first_span = spans.size();
+      m_lexer->LexLine(lines.substr(start, end - start), m_states[first_line + i], &spans);
+      for (size_t j = first_span; j < spans.size(); ++j)
+        spans[j].offset += (uint32_t) start;
+      start = end + 1;
+    }
+  }
+
+  void SyntaxHighlighter::HighlightLine(DocumentEditor const& editor, size_t line, std::string_view text, std::vector<TokenSpan>& spans)
+  {
+    Update(editor, line);
+    if (line < m_states.size())
+      m_lexer->LexLine(text, m_states[line], &spans);
+  }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "document.hh"
+
+namespace application
+{
+  enum class TokenKind: uint8_t
+  {
+    Text,
+    Punctuation,
+    Key,
+    String,
+    Number,
+    Keyword,
+    Comment,
+    Invalid,
+    Count,
+  };
+
+  // [offset, offset + length) of a text has the colour of `kind`, what no
+  // span covers is Text
+  struct TokenSpan
+  {
+    uint32_t offset;
+    uint32_t length;
+    TokenKind kind;
+  };
+
+  // Lexes one line at a time from the state the line before ended in, so a
+  // line can be lexed again without the ones before it.
+  struct Lexer
+  {
+    // state at the start of the text
+    static constexpr uint32_t Initial = 0;
+
+    virtual ~Lexer() = default;
+    // Appends the spans of `line`, without its newline, to `spans` unless
+    // it is NULL, and returns the state the next line starts in
+    virtual uint32_t LexLine(std::string_view line, uint32_t state, std::vector<TokenSpan>* spans) const = 0;
+  };
+
+  // The lexer state at the start of every line of a DocumentEditor, kept up
+  // to date lazily. An edit only drops the states of the lines after the
+  // edited ones; lexing starts again from the first edited line when a line
+  // past it is asked for, and stops as soon as a line after the edit starts
+  // in the state it had before, all the states after it being unchanged.
+  struct SyntaxHighlighter
+  {
+    // state of a line inserted by an edit and not lexed since
+    static constexpr uint32_t Unknown = UINT32_MAX;
+    // lines lexed past the ones asked for while the states differ from
+    // the ones before the edit
+    static constexpr size_t ConvergeLines = 256;
+
+    std::shared_ptr<Lexer const> m_lexer;
+    // one per line of the text
+    std::vector<uint32_t> m_states;
+    // the states of the lines before m_valid are up to date
+    size_t m_valid = 1;
+    // the lines edited since, and the states lexed from them, are before
+    // m_dirty_end
+    size_t m_dirty_end = 1;
+    // the states before m_lexed were lexed one after the other, they are
+    // those of the text they were lexed from
+    size_t m_lexed = 1;
+    // lines lexed to find the state of the next one
+    size_t m_lines_lexed = 0;
+
+    SyntaxHighlighter(std::shared_ptr<Lexer const> lexer, size_t line_count);
+
+    // Takes in an edit of the text, see DocumentEditor::m_on_lines_changed
+    void LinesChanged(size_t line, size_t removed_lines, size_t inserted_lines);
+    // Lexes what is needed for the states up to `line` to be up to date
+    void Update(DocumentEditor const& editor, size_t line);
+    // Appends the spans of `lines`, the text of the lines from `first_line`
+    // of `editor` separated by newlines, each one possibly cut short. The
+    // offsets are in `lines`.
+    void Highlight(DocumentEditor const& editor, size_t first_line, std::string_view lines, std::vector<TokenSpan>& spans);
+    // Appends the spans of `text`, the start of `line` of `editor`
+    void HighlightLine(DocumentEditor const& editor, size_t line, std::string_view text, std::vector<TokenSpan>& spans);
+
+  private:
+    // lexes the line before m_valid, false when its state let m_valid jump
+    // ahead
+    bool Advance(std::string_view line);
+  };
+}
@@ -0,0 +1,102 @@
+#include "text_layout_cache.hh"
+
+#include <functional>
+
+namespace application
+{
+  namespace
+  {
+    size_t HashKey(std::string_view text, uintptr_t font, int width, int height)
+    {
+      size_t h = std::hash<std::string_view>{}(text);
+      // boost::hash_combine
+      h ^= std::hash<uintptr_t>{}(font) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      h ^= std::hash<int>{}(width) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      h ^= std::hash<int>{}(height) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      return h;
+    }
+
+    TextLayoutCache g_text_layout_cache;
+  }
+
+  TextLayout* TextLayoutCache::Find(std::string_view text, uintptr_t font, int width, int height)
+  {
+    auto found = m_index.find(HashKey(text, font, width, height));
+    if (found == m_index.end())
+    {
+      m_stats.misses++;
+      return NULL;
+    }
+
+    // the hash only picks the entry, a different key with the same hash
+    // is a miss and gets replaced by the next Insert
+    Entry& e = *found->second;
+    if (e.text != text || e.font != font || e.width != width || e.height != height)
+    {
+      m_stats.misses++;
+      return NULL;
+    }
+
+    m_stats.hits++;
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    return e.layout.get();
+  }
+
+  TextLayout* TextLayoutCache::Insert(std::string_view text, uintptr_t font, int width, int height, std::unique_ptr<TextLayout> layout, size_t bytes)
+  {
+    size_t hash = HashKey(text, font, width, height);
+    auto found = m_index.find(hash);
+    if (found != m_index.end())
+      Evict(found->second);
+
+    bytes += sizeof(Entry) + text.size();
+    m_entries.push_front(Entry { hash, std::string(text), font, width, height, std::move(layout), bytes });
+    m_index[hash] = m_entries.begin();
+    m_stats.entries++;
+    m_stats.bytes += bytes;
+
+    // the new entry stays even when it is bigger than the cap on its own
+    while (m_stats.bytes > m_max_bytes && m_entries.size() > 1)
+    {
+      Evict(std::prev(m_entries.end()));
+      m_stats.evictions++;
+    }
+    return m_entries.front().layout.get();
+  }
+
+  void TextLayoutCache::SetMaxBytes(size_t max_bytes)
+  {
+    m_max_bytes = max_bytes;
+    while (m_stats.bytes > m_max_bytes && !m_entries.empty())
+    {
+      Evict(std::prev(m_entries.end()));
+      m_stats.evictions++;
+    }
+  }
+
+  void TextLayoutCache::Clear()
+  {
+    m_entries.clear();
+    m_index.clear();
+    m_stats.entries = 0;
+    m_stats.bytes = 0;
+  }
+
+  TextLayoutCacheStats const& TextLayoutCache::Stats()
+  {
+    return m_stats;
+  }
+
+  void TextLayoutCache::Evict(std::list<Entry>::iterator it)
+  {
+    m_stats.entries--;
+    m_stats.bytes -= it->bytes;
+    m_index.erase(it->hash);
+    m_entries.erase(it);
+  }
+
+  TextLayoutCache& GetTextLayoutCache()
+  {
+    return g_text_layout_cache;
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace application
+{
+  // Text shaped by the platform for one font and box, the platform derives
+  // from it to keep its own layout object
+  struct TextLayout
+  {
+    virtual ~TextLayout() = default;
+  };
+
+  struct TextLayoutCacheStats
+  {
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  // Shaped texts by (text, font, box size), least recently used first out
+  // once they take more than m_max_bytes. Text that doesn't change, like
+  // labels and the lines of a text box that aren't edited, is shaped once.
+  // Only used from the UI thread.
+  struct TextLayoutCache
+  {
+    static constexpr size_t DefaultMaxBytes = 16 * 1024 * 1024;
+
+    struct Entry
+    {
+      size_t hash;
+      std::string text;
+      uintptr_t font;
+      int width;
+      int height;
+      std::unique_ptr<TextLayout> layout;
+      size_t bytes;
+    };
+
+    // most recently used first
+    std::list<Entry> m_entries;
+    std::unordered_map<size_t, std::list<Entry>::iterator> m_index;
+    size_t m_max_bytes = DefaultMaxBytes;
+    TextLayoutCacheStats m_stats;
+
+    // The layout is owned by the cache and valid until the next Insert
+    TextLayout* Find(std::string_view text, uintptr_t font, int width, int height);
+    // `bytes` estimates the memory taken by the layout
+    TextLayout* Insert(std::string_view text, uintptr_t font, int width, int height, std::unique_ptr<TextLayout> layout, size_t bytes);
+    void SetMaxBytes(size_t max_bytes);
+    void Clear();
+    TextLayoutCacheStats const& Stats();
+
+  private:
+    void Evict(std::list<Entry>::iterator it);
+  };
+
+  TextLayoutCache& GetTextLayoutCache();
+}
@@ -0,0 +1,176 @@
+#include "thread_pool.hh"
+
+namespace application
+{
+  namespace
+  {
+    // pool and deque of the worker running on this thread
+    thread_local ThreadPool* t_pool = NULL;
+    thread_local unsigned    t_worker_index = 0;
+  }
+
+  ThreadPool::ThreadPool(unsigned worker_count)
+  {
+    for (unsigned i = 0; i < worker_count; ++i)
+      m_workers.push_back(std::make_unique<Worker>());
+
+    for (unsigned i = 0; i < worker_count; ++i)
+      m_threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_sleep_mutex);
+      m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& t : m_threads)
+      t.join();
+  }
+
+  unsigned ThreadPool::WorkerCount()
+  {
+    return m_workers.size();
+  }
+
+  void ThreadPool::Submit(Task task)
+  {
+    if (m_workers.empty())
+    {
+      task();
+      return;
+    }
+
+    unsigned index = t_pool == this
+      ? t_worker_index
+      : m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+
+    {
+      std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+      m_workers[index]->tasks.push_back(std::move(task));
+    }
+    m_queued.fetch_add(1);
+
+    // taking the lock orders this wake up after a sleeper checked m_queued
+    {
+      std::lock_guard<std::mutex> lock(m_sleep_mutex);
+    }
+    m_wake.notify_one();
+  }
+
+  bool ThreadPool::Pop(Task& task)
+  {
+    size_t n = m_workers.size();
+    if (n == 0) return false;
+
+    if (t_pool == this)
+    {
+      Worker& own = *m_workers[t_worker_index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty())
+      {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+
+    unsigned start = t_pool == this ? t_worker_index + 1 : m_next.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i)
+    {
+      Worker& victim = *m_workers[(start + i) % n];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty())
+      {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ThreadPool::RunOne()
+  {
+    if (m_queued.load() == 0)
+      return false;
+
+    Task task;
+    if (!Pop(task))
+      return false;
+
+    m_queued.fetch_sub(1);
+    task();
+    return true;
+  }
+
+  void ThreadPool::WorkerLoop(unsigned index)
+  {
+    t_pool = this;
+    t_worker_index = index;
+
+    for (;;)
+    {
+      if (RunOne())
+        continue;
+
+      std::unique_lock<std::mutex> lock(m_sleep_mutex);
+      m_wake.wait(lock, [this] { return m_stopping || m_queued.load() > 0; });
+      if (m_stopping)
+        return;
+    }
+  }
+
+  TaskGroup::TaskGroup(ThreadPool& pool)
+    : m_pool { pool }
+  {
+  }
+
+  TaskGroup::~TaskGroup()
+  {
+    Join();
+  }
+
+  void TaskGroup::Run(std::function<void()> fn)
+  {
+    m_pending.fetch_add(1);
+    m_pool.Submit([this, fn = std::move(fn)] {
+      try
+      {
+        fn();
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        if (!m_error)
+          m_error = std::current_exception();
+      }
+      // must stay the last access to the group, Wait may return right after
+      m_pending.fetch_sub(1);
+    });
+  }
+
+  void TaskGroup::Wait()
+  {
+    Join();
+
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(m_error_mutex);
+      std::swap(error, m_error);
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  void TaskGroup::Join()
+  {
+    while (m_pending.load() > 0)
+    {
+      if (!m_pool.RunOne())
+        std::this_thread::yield();
+    }
+  }
+} // namespace application
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace application
+{
+  // Fixed set of worker threads with one task deque each. A worker pops its
+  // own deque from the back and steals from the front of the others when it
+  // runs dry, so tasks spawned by a task stay on the thread that spawned them
+  // unless another one is idle.
+  struct ThreadPool
+  {
+    using Task = std::function<void()>;
+
+    struct Worker
+    {
+      std::mutex       mutex;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread>             m_threads;
+
+    std::mutex              m_sleep_mutex;
+    std::condition_variable m_wake;
+    std::atomic<int>        m_queued { 0 };
+    std::atomic<unsigned>   m_next { 0 };
+    bool                    m_stopping = false;
+
+    explicit ThreadPool(unsigned worker_count);
+    ThreadPool(ThreadPool const&) = delete;
+    ~ThreadPool();
+
+    void Submit(Task task);
+    // Runs one queued task on the calling thread, returns false when there
+    // was none. Lets a thread waiting on tasks help instead of blocking.
+    bool RunOne();
+    unsigned WorkerCount();
+
+  private:
+    bool Pop(Task& task);
+    void WorkerLoop(unsigned index);
+  };
+
+  // Tasks submitted together and joined with Wait. Wait runs queued tasks
+  // while it waits, so groups may be nested inside tasks. The first exception
+  // thrown by a task is rethrown by Wait.
+  struct TaskGroup
+  {
+    ThreadPool&        m_pool;
+    std::atomic<int>   m_pending { 0 };
+    std::mutex         m_error_mutex;
+    std::exception_ptr m_error;
+
+    explicit TaskGroup(ThreadPool& pool);
+    TaskGroup(TaskGroup const&) = delete;
+    ~TaskGroup();
+
+    void Run(std::function<void()> fn);
+    void Wait();
+
+  private:
+    void Join();
+  };
+} // namespace application
@@ -0,0 +1,637 @@
+#include "utf8.hh"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define UTF8_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC compiles the AVX2 intrinsics without a target switch
+#define UTF8_AVX2_TARGET
+#else
+#define UTF8_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace utf8
+{
+  namespace
+  {
+    std::atomic<Isa> g_isa { DetectedIsa() };
+
+    bool IsContinuation(unsigned char c)
+    {
+      return (c & 0xc0) == 0x80;
+    }
+
+    // Decodes the sequence at `p`, returns its length or 0 when it isn't a
+    // valid one: overlong, surrogate, past U+10FFFF or cut short
+    size_t Decode(unsigned char const* p, unsigned char const* end, uint32_t& codepoint)
+    {
+      unsigned char c = p[0];
+      if (c < 0x80)
+      {
+        codepoint = c;
+        return 1;
+      }
+
+      size_t length;
+      unsigned char min_second = 0x80;
+      unsigned char max_second = 0xbf;
+      if (c < 0xc2)
+      {
+        return 0;
+      }
+      else if (c < 0xe0)
+      {
+        length = 2;
+        codepoint = c & 0x1f;
+      }
+      else if (c < 0xf0)
+      {
+        length = 3;
+        codepoint = c & 0x0f;
+        if (c == 0xe0) min_second = 0xa0;
+        if (c == 0xed) max_second = 0x9f;
+      }
+      else if (c < 0xf5)
+      {
+        length = 4;
+        codepoint = c & 0x07;
+        if (c == 0xf0) min_second = 0x90;
+        if (c == 0xf4) max_second = 0x8f;
+      }
+      else
+      {
+        return 0;
+      }
+
+      if ((size_t) (end - p) < length || p[1] < min_second || p[1] > max_second)
+        return 0;
+      codepoint = (codepoint << 6) | (p[1] & 0x3f);
+      for (size_t i = 2; i < length; ++i)
+      {
+        if (!IsContinuation(p[i]))
+          return 0;
+        codepoint = (codepoint << 6) | (p[i] & 0x3f);
+      }
+      return length;
+    }
+
+    bool ValidateScalar(unsigned char const* p, unsigned char const* end)
+    {
+      uint32_t codepoint;
+      while (p < end)
+      {
+        size_t length = Decode(p, end, codepoint);
+        if (!length)
+          return false;
+        p += length;
+      }
+      return true;
+    }
+
+#ifdef UTF8_X86
+    // Each of these handles the ASCII run at the start of the text a whole
+    // vector at a time and returns its length
+    size_t AsciiSse2(unsigned char const* p, size_t n)
+    {
+      size_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        if (_mm_movemask_epi8(_mm_loadu_si128((__m128i const*) (p + i))))
+          break;
+      }
+      return i;
+    }
+
+    UTF8_AVX2_TARGET size_t AsciiAvx2(unsigned char const* p, size_t n)
+    {
+      size_t i = 0;
+      for (; i + 32 <= n; i += 32)
+      {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((__m256i const*) (p + i))))
+          break;
+      }
+      return i;
+    }
+
+    size_t WidenAsciiSse2(unsigned char const* p, size_t n, char16_t* out)
+    {
+      __m128i const zero = _mm_setzero_si128();
+      size_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        __m128i bytes = _mm_loadu_si128((__m128i const*) (p + i));
+        if (_mm_movemask_epi8(bytes))
+          break;
+        _mm_storeu_si128((__m128i*) (out + i), _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128((__m128i*) (out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+      }
+      return i;
+    }
+
+    UTF8_AVX2_TARGET size_t WidenAsciiAvx2(unsigned char const* p, size_t n, char16_t* out)
+    {
+      size_t i = 0;
+      for (; i + 32 <= n; i += 32)
+      {
+        __m256i bytes = _mm256_loadu_si256((__m256i const*) (p + i));
+        if (_mm256_movemask_epi8(bytes))
+          break;
+        _mm256_storeu_si256((__m256i*) (out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+        _mm256_storeu_si256((__m256i*) (out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+      }
+      return i;
+    }
+
+    size_t NarrowAsciiSse2(char16_t const* p, size_t n, char* out)
+    {
+      __m128i const non_ascii = _mm_set1_epi16((short) 0xff80);
+      __m128i const zero = _mm_setzero_si128();
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        __m128i units = _mm_loadu_si128((__m128i const*) (p + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii), zero)) != 0xffff)
+          break;
+        _mm_storel_epi64((__m128i*) (out + i), _mm_packus_epi16(units, units));
+      }
+      return i;
+    }
+
+    size_t CountCodepointsSse2(unsigned char const* p, size_t n)
+    {
+      // bytes above 0xbf or below 0x80, as signed bytes above -65
+      __m128i const last_continuation = _mm_set1_epi8(-65);
+      size_t count = 0;
+      size_t i = 0;
+      while (i + 16 <= n)
+      {
+        // each byte lane counts up to 255 before they are summed up
+        __m128i counts = _mm_setzero_si128();
+        size_t end = std::min(n & ~(size_t) 15, i + 255 * 16);
+        for (; i < end; i += 16)
+        {
+          __m128i bytes = _mm_loadu_si128((__m128i const*) (p + i));
+          counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(bytes, last_continuation));
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+      }
+      for (; i < n; ++i)
+        count += !IsContinuation(p[i]);
+      return count;
+    }
+
+    UTF8_AVX2_TARGET size_t CountCodepointsAvx2(unsigned char const* p, size_t n)
+    {
+      __m256i const last_continuation = _mm256_set1_epi8(-65);
+      size_t count = 0;
+      size_t i = 0;
+      while (i + 32 <= n)
+      {
+        __m256i counts = _mm256_setzero_si256();
+        size_t end = std::min(n & ~(size_t) 31, i + 255 * 32);
+        for (; i < end; i += 32)
+        {
+          __m256i bytes = _mm256_loadu_si256((__m256i const*) (p + i));
+          counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(bytes, last_continuation));
+        }
+        __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+      }
+      for (; i < n; ++i)
+        count += !IsContinuation(p[i]);
+      return count;
+    }
+
+    // Validation by table lookups on the nibbles of each byte and of the
+    // byte before it (Keiser and Lemire, "Validating UTF-8 In Less Than One
+    // Instruction Per Byte"). Every error sets a bit in the three lookups
+    // that is only set in all three for that error.
+    constexpr uint8_t TooShort     = 1 << 0; // lead byte not followed by a continuation
+    constexpr uint8_t TooLong      = 1 << 1; // ASCII followed by a continuation
+    constexpr uint8_t Overlong3    = 1 << 2;
+    constexpr uint8_t TooLarge     = 1 << 3;
+    constexpr uint8_t Surrogate    = 1 << 4;
+    constexpr uint8_t Overlong2    = 1 << 5;
+    constexpr uint8_t TooLarge1000 = 1 << 6;
+    constexpr uint8_t Overlong4    = 1 << 6;
+    constexpr uint8_t TwoConts     = 1 << 7;
+    constexpr uint8_t Carry        = TooShort | TooLong | TwoConts;
+
+#define UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+    UTF8_AVX2_TARGET bool ValidateAvx2(unsigned char const* p, size_t n)
+    {
+      __m256i const byte_1_high = UTF8_TABLE(
+        // ASCII
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        // continuation
+        (char) TwoConts, (char) TwoConts, (char) TwoConts, (char) TwoConts,
+        // 1100____ and 1101____
+        TooShort | Overlong2, TooShort,
+        // 1110____
+        TooShort | Overlong3 | Surrogate,
+        // 1111____
+        TooShort | TooLarge | TooLarge1000 | Overlong4);
+
+      __m256i const byte_1_low = UTF8_TABLE(
+        // ____0000
+        (char) (Carry | Overlong3 | Overlong2 | Overlong4),
+        // ____0001
+        (char) (Carry | Overlong2),
+        // ____001_
+        (char) Carry, (char) Carry,
+        // ____0100
+        (char) (Carry | TooLarge),
+        // ____0101 to ____1100
+        (char) (Carry | TooLarge | TooLarge1000), (char) (Carry | TooLarge | TooLarge1000),
+        (char) (Carry | TooLarge | TooLarge1000), (char) (Carry | TooLarge | TooLarge1000),
+        (char) (Carry | TooLarge | TooLarge1000), (char) (Carry | TooLarge | TooLarge1000),
+        (char) (Carry | TooLarge | TooLarge1000), (char) (Carry | TooLarge | TooLarge1000),
+        // ____1101
+        (char) (Carry | TooLarge | TooLarge1000 | Surrogate),
+        // ____111_
+        (char) (Carry | TooLarge | TooLarge1000), (char) (Carry | TooLarge | TooLarge1000));
+
+      __m256i const byte_2_high = UTF8_TABLE(
+        // ASCII
+        TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+        // 1000____
+        (char) (TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4),
+        // 1001____
+        (char) (TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge),
+        // 101_____
+        (char) (TooLong | Overlong2 | TwoConts | Surrogate | TooLarge),
+        (char) (TooLong | Overlong2 | TwoConts | Surrogate | TooLarge),
+        // lead bytes
+        TooShort, TooShort, TooShort, TooShort);
+
+      __m256i const nibble = _mm256_set1_epi8(0x0f);
+      __m256i const high_bit = _mm256_set1_epi8((char) 0x80);
+      // the last three bytes of a block can't start sequences longer
+      // than what is left of the block
+      __m256i const max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+
+      __m256i error = _mm256_setzero_si256();
+      __m256i previous = _mm256_setzero_si256();
+      __m256i previous_incomplete = _mm256_setzero_si256();
+
+      size_t i = 0;
+      for (; i + 32 <= n; i += 32)
+      {
+        __m256i input = _mm256_loadu_si256((__m256i const*) (p + i));
+        if (!_mm256_movemask_epi8(input))
+        {
+          error = _mm256_or_si256(error, previous_incomplete);
+          previous_incomplete = _mm256_setzero_si256();
+          previous = input;
+          continue;
+        }
+
+        // the input shifted by 1, 2 and 3 bytes, with the end of the
+        // previous block shifted in
+        __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+        __m256i special_cases = _mm256_and_si256(
+          _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+          _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+        // third and fourth bytes of a sequence must be continuations, and
+        // only them as the two bytes cases were checked above
+        __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+        __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+        __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), high_bit);
+        error = _mm256_or_si256(error, _mm256_xor_si256(must_be_continuation, special_cases));
+
+        previous_incomplete = _mm256_subs_epu8(input, max_value);
+        previous = input;
+      }
+
+      if (!_mm256_testz_si256(error, error))
+        return false;
+
+      // the scalar code checks from the start of the last sequence of the
+      // blocks, it may be cut by the end of the last block
+      size_t start = i;
+      for (size_t back = 1; back <= 3 && back <= i; ++back)
+      {
+        unsigned char c = p[i - back];
+        if (c >= 0xc0)
+        {
+          start = i - back;
+          break;
+        }
+        if (c < 0x80)
+          break;
+      }
+      return ValidateScalar(p + start, p + n);
+    }
+
+#undef UTF8_TABLE
+#endif
+
+    // Runs of ASCII go through the vector code, the rest is decoded one
+    // sequence at a time. Counts the units when `out` is NULL.
+    size_t Transcode16(std::string_view text, char16_t* out)
+    {
+      auto p = (unsigned char const*) text.data();
+      auto end = p + text.size();
+      size_t written = 0;
+      [[maybe_unused]] Isa isa = CurrentIsa();
+
+      while (p < end)
+      {
+#ifdef UTF8_X86
+        size_t ascii = 0;
+        if (out)
+          ascii = isa == Isa::Avx2 ? WidenAsciiAvx2(p, end - p, out + written) :
+                  isa == Isa::Sse2 ? WidenAsciiSse2(p, end - p, out + written) : 0;
+        else
+          ascii = isa == Isa::Avx2 ? AsciiAvx2(p, end - p) :
+                  isa == Isa::Sse2 ? AsciiSse2(p, end - p) : 0;
+        p += ascii;
+        written += ascii;
+#else
+        size_t ascii = 0;
+#endif
+
+        unsigned char const* stop = p + std::min<size_t>(end - p, ascii ? 32 : 128);
+        while (p < stop)
+        {
+          uint32_t codepoint;
+          size_t length = Decode(p, end, codepoint);
+          if (!length)
+          {
+            codepoint = ReplacementCharacter;
+            length = 1;
+          }
+          p += length;
+
+          if (codepoint < 0x10000)
+          {
+            if (out)
+              out[written] = (char16_t) codepoint;
+            written += 1;
+          }
+          else
+          {
+            if (out)
+            {
+              codepoint -= 0x10000;
+              out[written] = (char16_t) (0xd800 | (codepoint >> 10));
+              out[written + 1] = (char16_t) (0xdc00 | (codepoint & 0x3ff));
+            }
+            written += 2;
+          }
+        }
+      }
+      return written;
+    }
+  }
+
+  Isa DetectedIsa()
+  {
+#ifdef UTF8_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+      __cpuidex(info, 7, 0);
+      bool avx2 = info[1] & (1 << 5);
+      __cpuid(info, 1);
+      bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+      if (avx2 && os_saves_ymm)
+        return Isa::Avx2;
+    }
+#else
+    // may run before main, from the initializer of g_isa
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return Isa::Avx2;
+#endif
+    return Isa::Sse2;
+#else
+    return Isa::Scalar;
+#endif
+  }
+
+  void LimitIsa(Isa isa)
+  {
+    g_isa = std::min(isa, DetectedIsa());
+  }
+
+  Isa CurrentIsa()
+  {
+    return g_isa.load(std::memory_order_relaxed);
+  }
+
+  bool Validate(std::string_view text)
+  {
+    auto p = (unsigned char const*) text.data();
+    auto end = p + text.size();
+#ifdef UTF8_X86
+    Isa isa = CurrentIsa();
+    if (isa == Isa::Avx2)
+      return ValidateAvx2(p, text.size());
+
+    if (isa == Isa::Sse2)
+    {
+      while (p < end)
+      {
+        size_t ascii = AsciiSse2(p, end - p);
+        p += ascii;
+        // the sequences up to the next vector, further when the text
+        // doesn't look like ASCII
+        unsigned char const* stop = p + std::min<size_t>(end - p, ascii ? 16 : 64);
+        uint32_t codepoint;
+        while (p < stop)
+        {
+          size_t length = Decode(p, end, codepoint);
+          if (!length)
+            return false;
+          p += length;
+        }
+      }
+      return true;
+    }
+#endif
+    return ValidateScalar(p, end);
+  }
+
+  size_t CountCodepoints(std::string_view text)
+  {
+    auto p = (unsigned char const*) text.data();
+#ifdef UTF8_X86
+    Isa isa = CurrentIsa();
+    if (isa == Isa::Avx2)
+      return CountCodepointsAvx2(p, text.size());
+    if (isa == Isa::Sse2)
+      return CountCodepointsSse2(p, text.size());
+#endif
+    size_t count = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+      count += !IsContinuation(p[i]);
+    return count;
+  }
+
+  size_t Encode(uint32_t codepoint, char out[4])
+  {
+    if (codepoint < 0x80)
+    {
+      out[0] = (char) codepoint;
+      return 1;
+    }
+    if (codepoint < 0x800)
+    {
+      out[0] = (char) (0xc0 | (codepoint >> 6));
+      out[1] = (char) (0x80 | (codepoint & 0x3f));
+      return 2;
+    }
+    if (codepoint >= 0xd800 && codepoint <= 0xdfff)
+      return 0;
+    if (codepoint < 0x10000)
+    {
+      out[0] = (char) (0xe0 | (codepoint >> 12));
+      out[1] = (char) (0x80 | ((codepoint >> 6) & 0x3f));
+      out[2] = (char) (0x80 | (codepoint & 0x3f));
+      return 3;
+    }
+    if (codepoint <= 0x10ffff)
+    {
+      out[0] = (char) (0xf0 | (codepoint >> 18));
+      out[1] = (char) (0x80 | ((codepoint >> 12) & 0x3f));
+      out[2] = (char) (0x80 | ((codepoint >> 6) & 0x3f));
+      out[3] = (char) (0x80 | (codepoint & 0x3f));
+      return 4;
+    }
+    return 0;
+  }
+
+  size_t Utf16Length(std::string_view text)
+  {
+    return Transcode16(text, NULL);
+  }
+
+  size_t ToUtf16(std::string_view text, char16_t* out)
+  {
+    return Transcode16(text, out);
+  }
+
+  std::u16string ToUtf16(std::string_view text)
+  {
+    // a byte never makes more than one unit
+    std::u16string out(text.size(), u'\0');
+    out.resize(ToUtf16(text, out.data()));
+    return out;
+  }
+
+  std::string FromUtf16(std::u16string_view text)
+  {
+    // a unit never makes more than three bytes
+    std::string out(text.size() * 3, '\0');
+    char* o = out.data();
+    size_t i = 0;
+    size_t n = text.size();
+    while (i < n)
+    {
+#ifdef UTF8_X86
+      if (CurrentIsa() != Isa::Scalar)
+      {
+        size_t ascii = NarrowAsciiSse2(text.data() + i, n - i, o);
+        i += ascii;
+        o += ascii;
+      }
+#endif
+
+      size_t stop = std::min(n, i + 16);
+      while (i < stop)
+      {
+        uint32_t codepoint = text[i++];
+        if (codepoint >= 0xd800 && codepoint <= 0xdfff)
+        {
+          if (codepoint <= 0xdbff && i < n && text[i] >= 0xdc00 && text[i] <= 0xdfff)
+            codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (text[i++] - 0xdc00);
+          else
+            codepoint = ReplacementCharacter;
+        }
+        o += Encode(codepoint, o);
+      }
+    }
+    out.resize(o - out.data());
+    return out;
+  }
+
+  std::u32string ToUtf32(std::string_view text)
+  {
+    std::u32string out;
+    out.reserve(text.size());
+    auto p = (unsigned char const*) text.data();
+    auto end = p + text.size();
+    while (p < end)
+    {
+      uint32_t codepoint;
+      size_t length = Decode(p, end, codepoint);
+      if (!length)
+      {
+        codepoint = ReplacementCharacter;
+        length = 1;
+      }
+      out.push_back(codepoint);
+      p += length;
+    }
+    return out;
+  }
+
+  std::string FromUtf32(std::u32string_view text)
+  {
+    std::string out(text.size() * 4, '\0');
+    char* o = out.data();
+    for (char32_t c : text)
+    {
+      size_t length = Encode(c, o);
+      if (!length)
+        length = Encode(ReplacementCharacter, o);
+      o += length;
+    }
+    out.resize(o - out.data());
+    return out;
+  }
+
+  std::wstring ToWide(std::string_view text)
+  {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t))
+    {
+      std::wstring out(text.size(), L'\0');
+      out.resize(ToUtf16(text, reinterpret_cast<char16_t*>(out.data())));
+      return out;
+    }
+    else
+    {
+      std::u32string wide = ToUtf32(text);
+      return std::wstring(wide.begin(), wide.end());
+    }
+  }
+
+  std::string FromWide(std::wstring_view text)
+  {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t))
+      return FromUtf16(std::u16string_view(reinterpret_cast<char16_t const*>(text.data()), text.size()));
+    else
+      return FromUtf32(std::u32string_view(reinterpret_cast<char32_t const*>(text.data()), text.size()));
+  }
+}
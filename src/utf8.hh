@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// UTF-8 validation, counting and conversion to and from UTF-16 and UTF-32.
+//
+// Runs of ASCII are converted 16 or 32 bytes at a time and validation uses
+// AVX2 when the CPU has it, SSE2 is the baseline on x86-64 and everything
+// has a scalar fallback. Invalid input never stops a conversion: every
+// byte that doesn't start a valid sequence becomes U+FFFD, like unpaired
+// surrogates on the UTF-16 side.
+namespace utf8
+{
+  constexpr uint32_t ReplacementCharacter = 0xfffd;
+
+  enum class Isa
+  {
+    Scalar,
+    Sse2,
+    Avx2,
+  };
+
+  // Best instruction set of this CPU, what the functions use by default
+  Isa DetectedIsa();
+  // Uses at most `isa` from now on, for tests and benchmarks
+  void LimitIsa(Isa isa);
+  Isa CurrentIsa();
+
+  bool Validate(std::string_view text);
+  // Code points of valid UTF-8, that is the bytes that aren't continuation
+  // bytes
+  size_t CountCodepoints(std::string_view text);
+
+  // Encodes `codepoint` to `out`, returns the number of bytes written, 0
+  // for a surrogate or a value past U+10FFFF
+  size_t Encode(uint32_t codepoint, char out[4]);
+
+  // Code units ToUtf16 writes for `text`
+  size_t Utf16Length(std::string_view text);
+  // `out` must have room for Utf16Length(text) units, at most text.size().
+  // Returns the number of units written.
+  size_t ToUtf16(std::string_view text, char16_t* out);
+  std::u16string ToUtf16(std::string_view text);
+  std::string FromUtf16(std::u16string_view text);
+
+  std::u32string ToUtf32(std::string_view text);
+  std::string FromUtf32(std::u32string_view text);
+
+  // wchar_t is UTF-16 on Windows and UTF-32 elsewhere
+  std::wstring ToWide(std::string_view text);
+  std::string FromWide(std::wstring_view text);
+}
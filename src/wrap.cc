@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <string>
+#include "wrap.hh"
+
+namespace application
+{
+  namespace
+  {
+    bool IsContinuation(char c)
+    {
+      return (c & 0xc0) == 0x80;
+    }
+  }
+
+  size_t WrapLine(std::string_view line, size_t columns, std::vector<uint32_t>* breaks, size_t max_breaks)
+  {
+    columns = std::max<size_t>(columns, 1);
+    // a character takes at least a byte
+    if (line.size() <= columns)
+      return 1;
+
+    size_t rows = 1;
+    size_t row_start = 0;
+    size_t column = 0;
+    // after the last space of the row, 0 when there is none
+    size_t space_break = 0;
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+      char c = line[i];
+      if (IsContinuation(c))
+        continue;
+
+      if (column == columns)
+      {
+        // `c` starts the next row, with the end of the word before it
+        size_t at = space_break > row_start ? space_break : i;
+        rows++;
+        if (breaks)
+          breaks->push_back((uint32_t) at);
+        if (rows - 1 == max_breaks)
+          return rows;
+
+        row_start = at;
+        column = 0;
+        for (size_t j = at; j < i; ++j)
+          column += !IsContinuation(line[j]);
+        space_break = 0;
+      }
+
+      column++;
+      if (c == ' ')
+        space_break = i + 1;
+    }
+    return rows;
+  }
+
+  std::shared_ptr<WrapJob> WrapJob::Start(ThreadPool& pool, DocumentSnapshot snapshot, size_t columns, size_t first_line)
+  {
+    auto job = std::make_shared<WrapJob>();
+    job->m_line_count = snapshot.LineCount();
+    first_line = std::min(first_line, job->m_line_count - 1);
+    // the line queries read the block index of the chunk the document still
+    // appends to, they can't run on the pool
+    size_t first_offset = snapshot.LineOffset(first_line);
+
+    pool.Submit([job, snapshot = std::move(snapshot), columns, first_line, first_offset] {
+      // lines [from, to) starting at `offset`, handed over every BatchLines
+      auto wrap = [&](size_t from, size_t offset, size_t to) {
+        WrapJob::Batch batch { from, {} };
+        auto add = [&](std::string_view line) {
+          batch.rows.push_back((uint32_t) WrapLine(line, columns));
+          size_t next = batch.first_line + batch.rows.size();
+          if (batch.rows.size() < BatchLines && next < to)
+            return true;
+
+          size_t count = batch.rows.size();
+          {
+            std::lock_guard<std::mutex> lock(job->m_mutex);
+            job->m_batches.push_back(std::move(batch));
+          }
+          job->m_lines_done += count;
+          batch = { next, {} };
+          return next < to && !job->Cancelled();
+        };
+
+        if (from == to)
+          return;
+        std::string partial;
+        std::string_view chunk;
+        DocumentChunkIterator it = snapshot.Chunks(offset);
+        while (it.Next(chunk))
+        {
+          while (!chunk.empty())
+          {
+            size_t newline = chunk.find('\n');
+            if (newline == std::string_view::npos)
+            {
+              partial.append(chunk);
+              break;
+            }
+
+            bool more;
+            if (partial.empty())
+            {
+              more = add(chunk.substr(0, newline));
+            }
+            else
+            {
+              partial.append(chunk.substr(0, newline));
+              more = add(partial);
+              partial.clear();
+            }
+            if (!more)
+              return;
+            chunk.remove_prefix(newline + 1);
+          }
+        }
+        // the last line has no newline
+        add(partial);
+      };
+
+      wrap(first_line, first_offset, job->m_line_count);
+      if (!job->Cancelled())
+        wrap(0, 0, first_line);
+    });
+    return job;
+  }
+
+  double WrapJob::Progress() const
+  {
+    return m_line_count ? (double) m_lines_done.load() / m_line_count : 1.0;
+  }
+
+  std::vector<WrapJob::Batch> WrapJob::TakeBatches()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return std::move(m_batches);
+  }
+
+  WrapIndex::~WrapIndex()
+  {
+    CancelJob();
+  }
+
+  void WrapIndex::Reset(size_t line_count)
+  {
+    CancelJob();
+    m_rows.assign(std::max<size_t>(line_count, 1), Unknown);
+    m_dirty_block = 0;
+    m_complete = m_columns == 0;
+  }
+
+  bool WrapIndex::SetColumns(size_t columns)
+  {
+    if (columns == m_columns)
+      return false;
+    m_columns = columns;
+    Reset(m_rows.size());
+    return true;
+  }
+
+  void WrapIndex::LinesChanged(size_t line, size_t removed_lines, size_t inserted_lines)
+  {
+    if (removed_lines || inserted_lines)
+    {
+      auto first = m_rows.begin() + (line + 1);
+      m_rows.erase(first, first + removed_lines);
+      m_rows.insert(m_rows.begin() + (line + 1), inserted_lines, Unknown);
+      // the blocks after shift
+      m_dirty_block = std::min(m_dirty_block, line / BlockLines);
+    }
+    SetRows(line, Unknown);
+
+    if (m_job)
+    {
+      m_edits.push_back({ line, removed_lines, inserted_lines });
+      // started again on a new snapshot instead
+      if (m_edits.size() > MaxEdits)
+        CancelJob();
+    }
+  }
+
+  void WrapIndex::StartJob(ThreadPool& pool, DocumentSnapshot snapshot, size_t first_line)
+  {
+    CancelJob();
+    m_job = WrapJob::Start(pool, std::move(snapshot), m_columns, first_line);
+  }
+
+  void WrapIndex::CancelJob()
+  {
+    if (m_job)
+      m_job->Cancel();
+    m_job = NULL;
+    m_edits.clear();
+  }
+
+  bool WrapIndex::MergeJob()
+  {
+    if (!m_job)
+      return true;
+
+    // read before taking the batches, all of them are in once it is done
+    bool done = m_job->m_lines_done.load() == m_job->m_line_count;
+    for (WrapJob::Batch const& batch : m_job->TakeBatches())
+    {
+      for (size_t i = 0; i < batch.rows.size(); ++i)
+      {
+        // the line in the text as it is now, the edited ones are skipped
+        size_t line = batch.first_line + i;
+        bool edited = false;
+        for (LineEdit const& edit : m_edits)
+        {
+          if (line >= edit.line && line <= edit.line + edit.removed_lines)
+          {
+            edited = true;
+            break;
+          }
+          if (line > edit.line)
+            line = line - edit.removed_lines + edit.inserted_lines;
+        }
+        if (!edited && m_rows[line] == Unknown)
+          SetRows(line, batch.rows[i]);
+      }
+    }
+
+    if (!done)
+      return false;
+    m_job = NULL;
+    m_edits.clear();
+    m_complete = true;
+    return true;
+  }
+
+  size_t WrapIndex::Rows(DocumentEditor const& editor, size_t line)
+  {
+    if (m_rows[line] == Unknown)
+      SetRows(line, WrapLine(editor.Line(line), m_columns));
+    return m_rows[line];
+  }
+
+  void WrapIndex::Scroll(DocumentEditor const& editor, size_t& line, size_t& row, long long delta)
+  {
+    // farther than a block, the lines in between aren't wrapped
+    if (delta > (long long) BlockLines || delta < -(long long) BlockLines)
+    {
+      long long target = (long long) (RowOf(line) + std::min<size_t>(row, KnownRows(line) - 1)) + delta;
+      long long last = (long long) RowOf(m_rows.size()) - 1;
+      line = LineOfRow((size_t) std::clamp(target, 0LL, last), row);
+      return;
+    }
+
+    row = std::min(row, Rows(editor, line) - 1);
+    while (delta < 0)
+    {
+      if ((long long) row + delta >= 0)
+      {
+        row = (size_t) ((long long) row + delta);
+        return;
+      }
+      if (line == 0)
+      {
+        row = 0;
+        return;
+      }
+      // to the last row of the line before
+      delta += (long long) row + 1;
+      line--;
+      row = Rows(editor, line) - 1;
+    }
+    while (delta > 0)
+    {
+      size_t rows = Rows(editor, line);
+      if (row + (size_t) delta < rows)
+      {
+        row += (size_t) delta;
+        return;
+      }
+      if (line + 1 == m_rows.size())
+      {
+        row = rows - 1;
+        return;
+      }
+      // to the first row of the next line
+      delta -= (long long) (rows - row);
+      line++;
+      row = 0;
+    }
+  }
+
+  size_t WrapIndex::RowOf(size_t line)
+  {
+    UpdateBlocks();
+    size_t block = line / BlockLines;
+    size_t rows = 0;
+    for (size_t b = 0; b < block; ++b)
+      rows += m_block_rows[b];
+    for (size_t i = block * BlockLines; i < line; ++i)
+      rows += KnownRows(i);
+    return rows;
+  }
+
+  size_t WrapIndex::LineOfRow(size_t row, size_t& row_in_line)
+  {
+    UpdateBlocks();
+    size_t line = 0;
+    for (size_t b = 0; b < m_block_rows.size() && row >= m_block_rows[b]; ++b)
+    {
+      row -= m_block_rows[b];
+      line += BlockLines;
+    }
+    for (; line + 1 < m_rows.size() && row >= KnownRows(line); ++line)
+      row -= KnownRows(line);
+    row_in_line = std::min<size_t>(row, KnownRows(line) - 1);
+    return line;
+  }
+
+  size_t WrapIndex::KnownRows(size_t line) const
+  {
+    return m_rows[line] == Unknown ? 1 : m_rows[line];
+  }
+
+  void WrapIndex::UpdateBlocks()
+  {
+    size_t blocks = (m_rows.size() + BlockLines - 1) / BlockLines;
+    m_block_rows.resize(blocks);
+    for (size_t b = m_dirty_block; b < blocks; ++b)
+    {
+      size_t rows = 0;
+      size_t end = std::min(m_rows.size(), (b + 1) * BlockLines);
+      for (size_t i = b * BlockLines; i < end; ++i)
+        rows += KnownRows(i);
+      m_block_rows[b] = rows;
+    }
+    m_dirty_block = blocks;
+  }
+
+  void WrapIndex::SetRows(size_t line, size_t rows)
+  {
+    size_t before = KnownRows(line);
+    m_rows[line] = (uint32_t) rows;
+    size_t block = line / BlockLines;
+    if (block < m_dirty_block)
+      m_block_rows[block] = m_block_rows[block] - before + KnownRows(line);
+  }
+}
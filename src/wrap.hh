@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include "document.hh"
+#include "thread_pool.hh"
+
+namespace application
+{
+  // Rows `line`, without its newline, takes at `columns` columns, a column
+  // per character. A row breaks after the last space that fits, or in the
+  // middle of a word that doesn't. Appends where the rows after the first
+  // start, offsets in `line`, to `breaks` unless it is NULL, and stops
+  // after `max_breaks` of them.
+  size_t WrapLine(std::string_view line, size_t columns, std::vector<uint32_t>* breaks = NULL, size_t max_breaks = SIZE_MAX);
+
+  // Rows of the lines of a snapshot wrapped on a thread pool, so the text
+  // can be edited meanwhile. The rows are handed over by batches of lines
+  // that the owner takes on its own thread.
+  struct WrapJob
+  {
+    static constexpr size_t BatchLines = 16 * 1024;
+
+    struct Batch
+    {
+      size_t first_line = 0;
+      std::vector<uint32_t> rows;
+    };
+
+    std::atomic<bool> m_cancelled { false };
+    std::atomic<size_t> m_lines_done { 0 };
+    size_t m_line_count = 0;
+    std::mutex m_mutex;
+    std::vector<Batch> m_batches;
+
+    // Wraps the lines of `snapshot` at `columns`, starting from `first_line`
+    // and going around to the lines before it
+    static std::shared_ptr<WrapJob> Start(ThreadPool& pool, DocumentSnapshot snapshot, size_t columns, size_t first_line);
+
+    void Cancel() { m_cancelled = true; }
+    bool Cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+    double Progress() const;
+    // The batches finished since the last call
+    std::vector<Batch> TakeBatches();
+  };
+
+  // Rows of every line of a text at a width, for a text box that wraps its
+  // lines. The rows of a line are only known once it was wrapped: the lines
+  // shown are wrapped when they are asked for and a WrapJob does the rest in
+  // the background. An edit only forgets the rows of the edited lines.
+  //
+  // The rows of blocks of BlockLines lines are summed, a line not wrapped
+  // yet counting as one, so that scrolling far goes from a row to its line
+  // without walking the lines before it.
+  struct WrapIndex
+  {
+    // rows of a line not wrapped at m_columns yet
+    static constexpr uint32_t Unknown = 0;
+    static constexpr size_t BlockLines = 1024;
+    // a job stops being merged after that many edits and is started again
+    static constexpr size_t MaxEdits = 64;
+
+    struct LineEdit
+    {
+      size_t line;
+      size_t removed_lines;
+      size_t inserted_lines;
+    };
+
+    size_t m_columns = 0;
+    std::vector<uint32_t> m_rows = { Unknown };
+    // rows of every block, those from m_dirty_block on are stale
+    std::vector<size_t> m_block_rows;
+    size_t m_dirty_block = 0;
+    // false until the job wrapped the lines of a new text or width
+    bool m_complete = true;
+    std::shared_ptr<WrapJob> m_job;
+    // edits since the job took its snapshot, its batches are moved through
+    // them to the lines of the current text
+    std::vector<LineEdit> m_edits;
+
+    WrapIndex() = default;
+    WrapIndex(WrapIndex const&) = delete;
+    ~WrapIndex();
+
+    // A new text of `line_count` lines
+    void Reset(size_t line_count);
+    // Forgets all the rows when `columns` differ from m_columns, returns
+    // whether they did
+    bool SetColumns(size_t columns);
+    // Takes in an edit of the text, see DocumentEditor::m_on_lines_changed
+    void LinesChanged(size_t line, size_t removed_lines, size_t inserted_lines);
+
+    // Wraps the lines not wrapped yet on `pool`, those from `first_line`
+    // first, cancelling the job in progress
+    void StartJob(ThreadPool& pool, DocumentSnapshot snapshot, size_t first_line);
+    void CancelJob();
+    // Applies the batches the job finished, false while it is running
+    bool MergeJob();
+
+    // Rows of `line`, wrapping it when it wasn't
+    size_t Rows(DocumentEditor const& editor, size_t line);
+    // Moves the row `row` of `line` by `delta` rows, stopping at the first
+    // and the last row of the text. Lines met are wrapped on the way unless
+    // the move is far, then they count as the rows the index has for them.
+    void Scroll(DocumentEditor const& editor, size_t& line, size_t& row, long long delta);
+    // Rows before `line`, and the line at `row`, lines not wrapped yet
+    // counting as one row
+    size_t RowOf(size_t line);
+    size_t LineOfRow(size_t row, size_t& row_in_line);
+
+  private:
+    size_t KnownRows(size_t line) const;
+    void UpdateBlocks();
+    void SetRows(size_t line, size_t rows);
+  };
+}